@@ -0,0 +1,81 @@
+# MIT License
+#
+# Copyright (c) Sebastian Katzer 2017
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# A single load test session, spawned by bench/run.rb. Runs the given number
+# of mixed operations and prints one "<op> <usec>" line per operation,
+# followed by the CPU ticks and peak RSS of the process.
+#
+#   mruby load.rb <id> <host> <port> <user> <password|key> <auth> <root> <ops> <large> <mix>
+
+id, host, port, user, secret, auth, root, ops, large, mix = ARGV
+
+opts = { port: port.to_i }
+opts[auth.to_sym] = secret
+
+weights = {}
+mix.split(',').each do |pair|
+  op, weight = pair.split(':')
+  weights[op.to_sym] = weight.to_i
+end
+
+deck = []
+weights.each { |op, weight| weight.times { deck << op } }
+deck = deck.shuffle(Random.new(id.to_i))
+
+SFTP.start(host, user, opts) do |sftp|
+  dir   = "#{root}/w#{id}"
+  small = 'x' * 4096
+
+  sftp.mkdir_p(dir)
+  sftp.write("#{dir}/small", small)
+  sftp.write("#{dir}/large", 'x' * large.to_i)
+
+  ops.to_i.times do |n|
+    op = deck[n % deck.size]
+    at = Time.now.to_f
+
+    case op
+    when :stat    then sftp.stat("#{dir}/small")
+    when :read    then sftp.read("#{dir}/small")
+    when :write   then sftp.write("#{dir}/small", small)
+    when :readdir then sftp.dir.entries(dir)
+    when :large   then sftp.download("#{dir}/large")
+    end
+
+    puts "#{op} #{((Time.now.to_f - at) * 1_000_000).to_i}"
+  end
+
+  sftp.rm_rf(dir)
+end
+
+stat   = File.open('/proc/self/stat', &:read) rescue nil
+status = File.open('/proc/self/status', &:read) rescue nil
+
+if stat
+  fields = stat.split(') ').last.split(' ')
+  puts "cpu #{fields[11].to_i + fields[12].to_i}"
+end
+
+if status
+  line = status.split("\n").find { |l| l.start_with? 'VmHWM:' }
+  puts "rss #{line.split(' ')[1]}" if line
+end
@@ -0,0 +1,109 @@
+# MIT License
+#
+# Copyright (c) Sebastian Katzer 2017
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# Drives SESSIONS concurrent SFTP sessions, each running OPS mixed operations
+# against one or more sshd instances, and reports the throughput, latency
+# percentiles per operation and CPU time and peak RSS per session.
+#
+#   HOSTS=127.0.0.1:22,127.0.0.1:2222 SESSIONS=32 OPS=500 rake bench
+#
+# Settings via ENV:
+#   HOSTS     Comma separated list of host:port, used round robin.
+#   SESSIONS  Number of concurrent sessions. Defaults to 8.
+#   OPS       Number of operations per session. Defaults to 200.
+#   MIX       Weights per operation. Defaults to the value of MIX below.
+#   LARGE     Size of the file used for large transfers in bytes.
+#   ROOT      Remote directory for the test files. Defaults to bench.
+#   SFTP_USER, SFTP_PASSWORD or SFTP_KEY to authenticate.
+#   MRUBY_BIN Path to the mruby binary built with bench/build_config.rb.
+
+require 'etc'
+
+MIX   = 'stat:40,read:20,write:15,readdir:15,large:10'
+LOAD  = File.expand_path('load.rb', __dir__)
+MRUBY = ENV.fetch('MRUBY_BIN', File.expand_path('../mruby/build/bench/bin/mruby', __dir__))
+
+hosts    = ENV.fetch('HOSTS', '127.0.0.1:22').split(',')
+sessions = ENV.fetch('SESSIONS', 8).to_i
+ops      = ENV.fetch('OPS', 200).to_i
+auth     = ENV['SFTP_KEY'] ? ['key', ENV['SFTP_KEY']] : ['password', ENV.fetch('SFTP_PASSWORD', '')]
+user     = ENV.fetch('SFTP_USER', Etc.getlogin)
+
+def percentile(sorted, pct)
+  sorted[((pct / 100.0) * sorted.size).ceil.clamp(1, sorted.size) - 1]
+end
+
+started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+workers = Array.new(sessions) do |id|
+  host, port = hosts[id % hosts.size].split(':')
+  args       = [id, host, port || 22, user, auth[1], auth[0], ENV.fetch('ROOT', 'bench'), ops,
+                ENV.fetch('LARGE', 4 * 1024 * 1024), ENV.fetch('MIX', MIX)].map(&:to_s)
+  reader, writer = IO.pipe
+  pid = spawn(MRUBY, LOAD, *args, out: writer)
+
+  writer.close
+  [id, pid, Thread.new { reader.read.tap { reader.close } }]
+end
+
+samples = Hash.new { |h, k| h[k] = [] }
+procs   = []
+failed  = 0
+
+workers.each do |id, pid, output|
+  stats = { id: id }
+
+  output.value.each_line do |line|
+    key, val = line.split
+    case key
+    when 'cpu' then stats[:cpu] = val.to_f / Etc.sysconf(Etc::SC_CLK_TCK)
+    when 'rss' then stats[:rss] = val.to_f / 1024
+    else samples[key] << val.to_f / 1000
+    end
+  end
+
+  failed += 1 unless Process.wait2(pid)[1].success?
+  procs << stats
+end
+
+elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+total   = samples.values.sum(&:size)
+
+puts format('sessions: %<s>d  ops/session: %<o>d  failed: %<f>d  wall: %<w>.2fs  throughput: %<t>.1f ops/s',
+            s: sessions, o: ops, f: failed, w: elapsed, t: total / elapsed)
+puts
+puts format('%-8s %8s %10s %10s %10s %10s', 'op', 'count', 'p50 ms', 'p95 ms', 'p99 ms', 'max ms')
+
+samples.sort.each do |op, list|
+  list.sort!
+  puts format('%-8s %8d %10.2f %10.2f %10.2f %10.2f',
+              op, list.size, percentile(list, 50), percentile(list, 95), percentile(list, 99), list.last)
+end
+
+puts
+puts format('%-8s %10s %10s', 'session', 'cpu s', 'rss MB')
+
+procs.each do |stats|
+  puts format('%-8d %10.2f %10.1f', stats[:id], stats[:cpu] || 0, stats[:rss] || 0)
+end
+
+exit(failed.zero? ? 0 : 1)
@@ -34,6 +34,10 @@ typedef struct mrb_sftp
 {
     struct RData *session;
     LIBSSH2_SFTP *sftp;
+    struct mrb_sftp_pipe *pipe;
+    mrb_int timeout;
+    int64_t deadline;
+    struct mrb_sftp_transfer *transfer;
 } mrb_sftp_t;
 
 #define E_SFTP_ERROR                  (mrb_class_get_under(mrb, mrb_module_get(mrb, "SFTP"), "Exception"))
@@ -45,12 +49,21 @@ typedef struct mrb_sftp
 #define E_SFTP_FILE_ERROR             (mrb_class_get_under(mrb, mrb_module_get(mrb, "SFTP"), "FileError"))
 #define E_SFTP_DIR_ERROR              (mrb_class_get_under(mrb, mrb_module_get(mrb, "SFTP"), "DirError"))
 #define E_SFTP_PATH_ERROR             (mrb_class_get_under(mrb, mrb_module_get(mrb, "SFTP"), "PathError"))
+#define E_SFTP_TIMEOUT_ERROR          (mrb_class_get_under(mrb, mrb_module_get(mrb, "SFTP"), "Timeout"))
 #define E_SFTP_NAME_ERROR             (mrb_class_get_under(mrb, mrb_module_get(mrb, "SFTP"), "NameError"))
 
 MRB_API LIBSSH2_SFTP* mrb_sftp_session (mrb_value self);
 MRB_API mrb_ssh_t* mrb_sftp_ssh_session (mrb_value self);
 MRB_API void mrb_sftp_raise_last_error (mrb_state *mrb, LIBSSH2_SFTP *sftp, const char* msg);
 MRB_API void mrb_sftp_raise (mrb_state *mrb, int err, const char* msg);
+MRB_API mrb_value mrb_sftp_error (mrb_state *mrb, int err, const char* msg);
+MRB_API int64_t mrb_sftp_now (void);
+MRB_API int mrb_sftp_poll_sock (mrb_ssh_t *ssh, int64_t wait);
+MRB_API int mrb_sftp_poll (mrb_value session);
+MRB_API int mrb_sftp_poll_pair (mrb_value a, mrb_value b);
+MRB_API int mrb_sftp_poll_fd (mrb_value session, int fd, short events);
+MRB_API void mrb_sftp_wait (mrb_state *mrb, mrb_value session);
+MRB_API void mrb_sftp_raise_poll_error (mrb_state *mrb, int rc);
 
 MRB_END_DECL
 
@@ -39,9 +39,57 @@ module SFTP
     begin
       yield sftp
     ensure
+      sftp.close
       ssh.close
     end
   end
+
+  # Connects to many hosts at once. The TCP connect, key exchange, login and
+  # SFTP startup of up to concurrency hosts run interleaved in non-blocking
+  # mode, so the total time is close to the slowest handshake instead of the
+  # sum of all. If a block is given, it is passed the sessions and errors and
+  # all connections get closed when the block finishes.
+  #
+  # @param [ Array<String> ] hosts The host names, optional with :port.
+  # @param [ String ]        user  The user name to login with.
+  # @param [ Hash ]          opts  password: or key: with passphrase:, and
+  #                                optional port: 22, timeout: nil per host
+  #                                in seconds, concurrency: 64, compress: false
+  #
+  # @return [ Array<Hash> ] The sessions and the errors, both by host name.
+  def self.start_many(hosts, user, opts = {})
+    sessions, errors = Connection.start_many(hosts, user, opts)
+
+    return [sessions, errors] unless block_given?
+
+    begin
+      yield sessions, errors
+    ensure
+      sessions.each_value do |sftp|
+        sftp.close
+        sftp.session.close
+      end
+    end
+  end
+
+  # Copies a remote file from one session to another without touching the
+  # local disk. Reads from the source are pipelined straight into writes to
+  # the target through a small ring of buffers, so the memory usage does not
+  # depend on the file size.
+  #
+  # @param [ SFTP::Session ] src      The session to read from.
+  # @param [ String ]        src_path The path of the file to copy.
+  # @param [ SFTP::Session ] dst      The session to write to.
+  # @param [ String ]        dst_path The path where to create the copy.
+  # @param [ Int ]           mode     The mode in case of the file has to be
+  #                                   created. Defaults to: 0o644
+  #
+  # @return [ Int ] The number of bytes copied.
+  def self.relay(src, src_path, dst, dst_path, mode = 0o644)
+    src.file.open(src_path) do |from|
+      dst.file.open(dst_path, 'w', mode) { |to| to.copy_from(from) }
+    end
+  end
 end
 
 module SSH
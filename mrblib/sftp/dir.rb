@@ -36,15 +36,27 @@ module SFTP
     # Calls the block once for each entry in the named directory on the remote
     # server. Yields the file name to the block.
     #
+    # Entries can be filtered by name, type, size and mtime. The filters are
+    # applied while reading the directory, so skipped entries never turn into
+    # Ruby objects.
+    #
+    #   dir.foreach('/logs', match: '*.gz', type: :file, size: 1..1024)
+    #
     # @param [ String ] path The path of the remote directory.
+    # @param [ Hash ]   opts Optional filters:
+    #   match: A glob pattern supporting *, ?, [..] and [!..].
+    #   type:  One of :file, :directory or :symlink.
+    #   size:  An Integer or Range of sizes in bytes.
+    #   mtime: An Integer or Range of modification times in seconds.
     # @param [ Proc ]   proc The block to yield.
     #
     # @return [ Void ]
-    def foreach(path)
-      return to_enum(:each, path) unless block_given?
+    def foreach(path, opts = {})
+      return to_enum(:each, path, opts) unless block_given?
 
       io = Handle.new(@session, path)
-      io.open_dir || loop { break unless (item = io.gets) && yield(item) }
+      io.open_dir || opts.empty? || io.filter(opts)
+      loop { break unless (item = io.gets) && yield(item) }
     ensure
       io&.close
     end
@@ -55,11 +67,103 @@ module SFTP
     # Returns an array of names representing the items in the given remote dir.
     #
     # @param [ String ] path The path of the remote directory.
+    # @param [ Hash ]   opts Optional filters, see #foreach.
     #
     # @return [ Array<String> ]
-    def entries(path)
+    def entries(path, opts = {})
       items = []
-      foreach(path) { |item| items << item } || items
+      foreach(path, opts) { |item| items << item } || items
+    end
+
+    # Walks the given remote dir recursively and sums up its content without
+    # creating any objects per entry. The result feeds #du, #count and
+    # #histogram, so several aggregates of one tree need a single walk.
+    #
+    #   res = dir.summary('/pub', du: true)
+    #   dir.count(res)
+    #   dir.histogram(res, :age)
+    #
+    # @param [ String ] path The path of the remote directory.
+    # @param [ Hash ]   opts Set du: true to also sum up the bytes per dir.
+    #
+    # @return [ Hash ] The number of files, dirs, links, others, bytes and
+    #                  errors as well as the sizes and ages histograms.
+    def summary(path, opts = {})
+      @session.scan(path, opts[:du] ? true : false)
+    end
+
+    # The total number of bytes per directory under the given remote dir,
+    # including all of its subdirectories.
+    #
+    # @param [ String|Hash ] path The path of the remote directory or the
+    #                             result of #summary with du: true.
+    #
+    # @return [ Hash<String, Integer> ]
+    def du(path)
+      res = path.is_a?(Hash) ? path : summary(path, du: true)
+      res[:du] || raise(ArgumentError, 'summary without du: true')
+    end
+
+    # Counts the files, dirs, links and other items under the given remote
+    # dir recursively.
+    #
+    # @param [ String|Hash ] path The path of the remote directory or the
+    #                             result of #summary.
+    #
+    # @return [ Hash<Symbol, Integer> ]
+    def count(path)
+      res = path.is_a?(Hash) ? path : summary(path)
+      { files: res[:files], dirs: res[:dirs], links: res[:links], others: res[:others] }
+    end
+
+    # Groups all non-directory items under the given remote dir by size or by
+    # age. Sizes are bucketed by powers of two, keyed by their lower bound.
+    # Ages are bucketed into :hour, :day, :week, :month, :quarter, :year and
+    # :older.
+    #
+    # @param [ String|Hash ] path The path of the remote directory or the
+    #                             result of #summary.
+    # @param [ Symbol ]      by   Either :size or :age. Defaults to :size.
+    #
+    # @return [ Hash ]
+    def histogram(path, by = :size)
+      key = { size: :sizes, age: :ages }[by]
+      raise ArgumentError, "unknown histogram #{by}" unless key
+
+      (path.is_a?(Hash) ? path : summary(path))[key]
+    end
+
+    # Takes a compact snapshot of the name, size, mtime and mode of each item
+    # in the given remote dir. Compare it to a later one to detect changes.
+    #
+    # @param [ String ] path The path of the remote directory.
+    #
+    # @return [ SFTP::Snapshot ]
+    def snapshot(path)
+      io = Handle.new(@session, path)
+      io.open_dir || Snapshot.new(io)
+    ensure
+      io&.close
+    end
+
+    # Lists the given remote dir into a columnar result. Names are stored in
+    # one packed buffer and sizes, mtimes and modes in native arrays, which
+    # keeps the memory usage of huge directories low. Strings are created on
+    # access only.
+    #
+    #   list = dir.list_columnar('/logs', match: '*.gz').sort!(:mtime, true)
+    #   list.name(0) # => 'app.log.9.gz'
+    #
+    # @param [ String ] path The path of the remote directory.
+    # @param [ Hash ]   opts Optional filters, see #foreach.
+    #
+    # @return [ SFTP::Listing ]
+    def list_columnar(path, opts = {})
+      io = Handle.new(@session, path)
+      io.open_dir || opts.empty? || io.filter(opts)
+      Listing.new(io)
+    ensure
+      io&.close
     end
   end
 end
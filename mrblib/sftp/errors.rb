@@ -70,4 +70,7 @@ module SFTP
 
   # The filename is not valid.
   class NameError < SFTP::Exception; end
+
+  # The server did not respond within the timeout or deadline of the session.
+  class Timeout < SFTP::Exception; end
 end
@@ -0,0 +1,141 @@
+# MIT License
+#
+# Copyright (c) Sebastian Katzer 2017
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+module SFTP
+  # A small LRU cache of open file handles keyed by path and flags. Used by
+  # Session#read, #write and #download to skip the open and close round trips
+  # when the same paths are accessed over and over again.
+  class HandleCache
+    # Creates a new SFTP::HandleCache instance atop the given SFTP connection.
+    #
+    # @param [ SFTP::Session ] session The underlying SFTP session.
+    # @param [ Int ]           max     The max number of open handles.
+    # @param [ Int ]           idle    Seconds after an unused handle gets closed.
+    #
+    # @return [ SFTP::HandleCache ]
+    def initialize(session, max = 8, idle = 30)
+      raise ArgumentError, 'max must be greater than zero' if max < 1
+
+      @session = session
+      @max     = max
+      @idle    = (idle * 1000).to_i
+      @files   = {}
+    end
+
+    # The max number of open handles.
+    #
+    # @return [ Int ]
+    attr_reader :max
+
+    # The number of open handles.
+    #
+    # @return [ Int ]
+    def size
+      @files.size
+    end
+
+    # Yields a cached handle for the path and flags or opens a new one. The
+    # handle gets flushed, stays open and becomes the most recently used one,
+    # unless the block raises an error.
+    #
+    # @param [ String ] path  The path to the remote file.
+    # @param [ String ] flags Determines how to open the file.
+    # @param [ Int ]    mode  The mode in case of the file has to be created.
+    #
+    # @return [ Object ] The result of the block.
+    def use(path, flags = 'r', mode = 0o644)
+      expire
+
+      key   = "#{flags}:#{path}"
+      entry = @files.delete(key)
+      io    = entry ? entry[0] : @session.file.open(path, flags, mode)
+
+      begin
+        res = yield(io, !entry.nil?)
+        io.flush
+      rescue StandardError
+        close(io)
+        raise
+      end
+
+      @files[key] = [io, SFTP.clock]
+      drop(@files.keys.first) while @files.size > @max
+
+      res
+    end
+
+    # Closes all handles of the path and of any path below it.
+    #
+    # @param [ String ] path The path to the remote file or dir.
+    #
+    # @return [ Void ]
+    def invalidate(path)
+      dir = path[-1] == '/' ? path : "#{path}/"
+
+      @files.keys.each do |key|
+        file = @files[key][0].path
+        drop(key) if file == path || file[0, dir.size] == dir
+      end
+    end
+
+    # Closes all handles that were not used within the idle timeout.
+    #
+    # @return [ Void ]
+    def expire
+      limit = SFTP.clock - @idle
+
+      @files.keys.each do |key|
+        break if @files[key][1] > limit
+        drop(key)
+      end
+    end
+
+    # Closes all handles.
+    #
+    # @return [ Void ]
+    def clear
+      @files.keys.each { |key| drop(key) }
+    end
+
+    private
+
+    # Removes the handle from the cache and closes it.
+    #
+    # @param [ String ] key The cache key of the handle.
+    #
+    # @return [ Void ]
+    def drop(key)
+      close(@files.delete(key)[0])
+    end
+
+    # Closes the handle unless the session is gone already.
+    #
+    # @param [ SFTP::File ] io The handle to close.
+    #
+    # @return [ Void ]
+    def close(io)
+      io.close unless io.closed?
+    rescue SFTP::Exception
+      nil
+    end
+  end
+end
@@ -0,0 +1,47 @@
+# MIT License
+#
+# Copyright (c) Sebastian Katzer 2017
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+module SFTP
+  # A columnar listing of a remote directory. Names are kept in one packed
+  # buffer and sizes, mtimes and modes in native arrays, so Ruby objects are
+  # created only for the items that are accessed.
+  class Listing
+    include Enumerable
+
+    # Returns true if the listing has no items.
+    #
+    # @return [ Boolean ]
+    def empty?
+      size == 0
+    end
+
+    # Returns a sorted copy of the listing.
+    #
+    # @param [ Symbol ]  by      One of :name, :size or :mtime.
+    # @param [ Boolean ] reverse Sort in descending order if true.
+    #
+    # @return [ SFTP::Listing ]
+    def sort(by = :name, reverse = false)
+      dup.sort!(by, reverse)
+    end
+  end
+end
@@ -67,16 +67,41 @@ module SFTP
       Dir.new(self)
     end
 
+    # Enables a cache of open file handles that read, write and download reuse
+    # for the same path and flags. Handles get closed once not used for idle
+    # seconds, when more than max are open, and when their path gets renamed
+    # or deleted. Pass false to close all handles and disable the cache.
+    #
+    # @param [ Hash|false ] opts Optional max: 8 and idle: 30
+    #
+    # @return [ SFTP::HandleCache ] nil if disabled.
+    def cache_handles(opts = {})
+      @handles.clear if @handles
+      @handles = opts ? HandleCache.new(self, opts[:max] || 8, opts[:idle] || 30) : nil
+    end
+
+    # The cache of open file handles if enabled.
+    #
+    # @return [ SFTP::HandleCache ]
+    attr_reader :handles
+
     # Initiates an upload from local to remote.
     #
-    # @param [ String ] local  The path from where to read the content.
-    # @param [ String ] remote The path to the remote file where to upload.
-    # @param [ Int ]    mode   The mode in case of the file has to be created.
-    #                          Defaults to: 0o644
+    # @param [ String|Int|IO ] local  The path from where to read the content
+    #                                 or a readable fd or IO to stream until EOF.
+    # @param [ String ]        remote The path to the remote file where to upload.
+    # @param [ Int ]           mode   The mode in case of the file has to be created.
+    #                                 Defaults to: 0o644
+    # @param [ Hash ]          opts   Optional transform stage like compress: :gzip
+    #                                 or async: true to upload in a worker thread
+    #                                 that moves only share: 0.25 of its chunk
+    #                                 for a second after a metadata call.
     #
-    # @return [ Void ]
-    def upload(local, remote, mode = 0o644)
-      file.open(remote, 'w', mode) { |io| io.upload(local) }
+    # @return [ Int|SFTP::Transfer ] The transfer object if async was set.
+    def upload(local, remote, mode = 0o644, opts = {})
+      return Transfer.new(self, :upload, remote, local, mode, opts) if opts[:async]
+
+      file.open(remote, 'w', mode) { |io| io.upload(local, opts) }
     end
 
     # Initiates a download from remote to local. If local is omitted, downloads
@@ -84,16 +109,19 @@ module SFTP
     #
     # @param [ String ] remote The path to the remote file to download.
     # @param [ String ] local  The path to where to save the downloaded file.
+    # @param [ Hash ]   opts   Optional transform stage like decompress: :gzip
+    #                          or async: true to download in a worker thread
+    #                          that moves only share: 0.25 of its chunk
+    #                          for a second after a metadata call.
     #
-    # @return [ String|Int ] The downloaded content if local was omitted.
-    def download(remote, local = nil)
-      file.open(remote, 'r') do |io|
-        if local
-          io.download(local)
-        else
-          io.gets(nil)
-        end
-      end
+    # @return [ String|Int|SFTP::Transfer ] The downloaded content if local was
+    #                                       omitted, nil for an empty file or
+    #                                       the transfer object if async was
+    #                                       set.
+    def download(remote, local = nil, opts = {})
+      return Transfer.new(self, :download, remote, local, 0, opts) if opts[:async]
+
+      with_file(remote, 'r') { |io| io.download(local, opts) }
     end
 
     # Opens the file, optionally seeks to the given offset, then returns length
@@ -108,8 +136,8 @@ module SFTP
     #
     # @return [ String ]
     def read(path, size = nil, offset = 0, opts = {})
-      file.open(path, opts[:mode] || 'r') do |io|
-        io.pos = offset if offset != 0
+      with_file(path, opts[:mode] || 'r') do |io, cached|
+        io.pos = offset if offset != 0 || cached
         io.gets(size)
       end
     end
@@ -128,10 +156,28 @@ module SFTP
     def write(path, str, offset = 0, opts = {})
       mode = (offset || 0) > 0 ? 'r+' : (opts[:mode] || 'w')
 
-      file.open(path, mode, opts[:perm] || 0o644) do |io|
-        io.pos = offset if offset != 0
-        io.write(str)
+      with_file(path, mode, opts[:perm] || 0o644) do |io, cached|
+        io.pos = offset if offset != 0 || cached
+        size = io.write(str)
+        setstat(path, size: size) if cached && mode.include?('w')
+        size
       end
     end
+
+    private
+
+    # Yields a cached handle if the cache is enabled, otherwise opens the file
+    # and ensures it gets closed before returning.
+    #
+    # @param [ String ] path  The path to the remote file.
+    # @param [ String ] flags Determines how to open the file.
+    # @param [ Int ]    mode  The mode in case of the file has to be created.
+    #
+    # @return [ Object ] The result of the block.
+    def with_file(path, flags, mode = 0o644, &block)
+      return file.open(path, flags, mode) { |io| block.call(io, false) } unless @handles
+
+      @handles.use(path, flags, mode, &block)
+    end
   end
 end
@@ -0,0 +1,471 @@
+/* MIT License
+ *
+ * Copyright (c) Sebastian Katzer 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "batch.h"
+#include "pipeline.h"
+
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/error.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include "mruby/ext/sftp.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <libssh2_sftp.h>
+
+#ifdef _WIN32
+# define mrb_sftp_fseek(file, off) _fseeki64(file, (__int64)(off), SEEK_SET)
+#else
+# include <sys/types.h>
+# define mrb_sftp_fseek(file, off) fseeko(file, (off_t)(off), SEEK_SET)
+#endif
+
+#define SYM(name, len) mrb_intern_static(mrb, name, len)
+
+#ifndef MRB_SFTP_BATCH_CHUNK_SIZE
+# define MRB_SFTP_BATCH_CHUNK_SIZE 32768
+#endif
+
+#ifndef MRB_SFTP_BATCH_WINDOW
+# define MRB_SFTP_BATCH_WINDOW 4
+#endif
+
+#ifndef MRB_SFTP_BATCH_FILES
+# define MRB_SFTP_BATCH_FILES 32
+#endif
+
+#define MRB_SFTP_BATCH_IO_ERROR -1001
+
+typedef struct mrb_sftp_batch_req
+{
+    uint32_t id;
+    uint64_t off;
+    uint32_t len;
+} mrb_sftp_batch_req_t;
+
+typedef struct mrb_sftp_batch_item
+{
+    FILE *file;
+    char handle[256];
+    uint32_t handle_len;
+    uint64_t next;
+    uint64_t eof;
+    uint64_t bytes;
+    uint64_t pos;
+    mrb_sftp_batch_req_t reqs[MRB_SFTP_BATCH_WINDOW];
+    int pending;
+    mrb_bool closing;
+    int err;
+    const char *msg;
+} mrb_sftp_batch_item_t;
+
+typedef struct mrb_sftp_batch
+{
+    mrb_value self;
+    mrb_value pairs;
+    mrb_value res;
+    mrb_sftp_batch_item_t *items;
+    mrb_int len;
+    mrb_int running;
+    mrb_int width;
+    mrb_int mode;
+    mrb_bool upload;
+    mrb_bool done;
+    char buf[MRB_SFTP_BATCH_CHUNK_SIZE];
+} mrb_sftp_batch_t;
+
+static void
+mrb_sftp_batch_fail (mrb_sftp_batch_item_t *item, int err, const char *msg)
+{
+    if (item->err) return;
+
+    item->err = err ? err : (int)LIBSSH2_FX_FAILURE;
+    item->msg = msg;
+}
+
+static void
+mrb_sftp_batch_finish (mrb_state *mrb, mrb_sftp_batch_t *batch, mrb_int idx)
+{
+    mrb_sftp_batch_item_t *item = &batch->items[idx];
+    mrb_value res;
+
+    if (item->file && fclose(item->file) != 0) {
+        mrb_sftp_batch_fail(item, MRB_SFTP_BATCH_IO_ERROR, "Cannot write to the path specified.");
+    }
+
+    item->file = NULL;
+
+    if (item->err == MRB_SFTP_BATCH_IO_ERROR) {
+        res = mrb_exc_new_str(mrb, E_RUNTIME_ERROR, mrb_str_new_cstr(mrb, item->msg));
+    } else if (item->err) {
+        res = mrb_sftp_error(mrb, item->err, item->msg);
+    } else {
+        res = mrb_fixnum_value((mrb_int)item->bytes);
+    }
+
+    mrb_ary_set(mrb, batch->res, idx, res);
+}
+
+static void
+mrb_sftp_batch_track (mrb_sftp_batch_item_t *item, uint32_t id, uint64_t off, uint32_t len)
+{
+    item->reqs[item->pending].id  = id;
+    item->reqs[item->pending].off = off;
+    item->reqs[item->pending].len = len;
+    item->pending++;
+}
+
+static mrb_bool
+mrb_sftp_batch_untrack (mrb_sftp_batch_item_t *item, uint32_t id, mrb_sftp_batch_req_t *req)
+{
+    int i;
+
+    for (i = 0; i < item->pending; i++) {
+        if (item->reqs[i].id != id) continue;
+
+        *req = item->reqs[i];
+        item->reqs[i] = item->reqs[--item->pending];
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static mrb_bool
+mrb_sftp_batch_fopen (mrb_state *mrb, mrb_sftp_batch_t *batch, mrb_int idx)
+{
+    mrb_value pair              = RARRAY_PTR(batch->pairs)[idx];
+    mrb_value local             = RARRAY_PTR(pair)[batch->upload ? 0 : 1];
+    mrb_sftp_batch_item_t *item = &batch->items[idx];
+
+    if ((item->file = fopen(mrb_string_value_cstr(mrb, &local), batch->upload ? "rb" : "wb")))
+        return TRUE;
+
+    mrb_sftp_batch_fail(item, MRB_SFTP_BATCH_IO_ERROR, "Cannot open the path specified.");
+
+    return FALSE;
+}
+
+static void
+mrb_sftp_batch_open (mrb_state *mrb, mrb_sftp_pipe_t *pipe, mrb_sftp_batch_t *batch, mrb_int idx)
+{
+    mrb_value pair              = RARRAY_PTR(batch->pairs)[idx];
+    mrb_value remote            = RARRAY_PTR(pair)[batch->upload ? 1 : 0];
+    mrb_sftp_batch_item_t *item = &batch->items[idx];
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+    item->eof = UINT64_MAX;
+
+    if (batch->upload && !mrb_sftp_batch_fopen(mrb, batch, idx)) {
+        mrb_sftp_batch_finish(mrb, batch, idx);
+        return;
+    }
+
+    attrs.flags       = LIBSSH2_SFTP_ATTR_PERMISSIONS;
+    attrs.permissions = batch->mode;
+
+    mrb_sftp_pipe_begin(mrb, pipe, SSH_FXP_OPEN);
+    mrb_sftp_pipe_put_str(mrb, pipe, RSTRING_PTR(remote), RSTRING_LEN(remote));
+    mrb_sftp_pipe_put_u32(mrb, pipe, batch->upload ? (LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC) : LIBSSH2_FXF_READ);
+    mrb_sftp_pipe_put_attrs(mrb, pipe, batch->upload ? &attrs : NULL);
+    mrb_sftp_pipe_end(mrb, pipe);
+
+    batch->running++;
+}
+
+static void
+mrb_sftp_batch_close (mrb_state *mrb, mrb_sftp_pipe_t *pipe, mrb_sftp_batch_item_t *item)
+{
+    mrb_sftp_pipe_begin(mrb, pipe, SSH_FXP_CLOSE);
+    mrb_sftp_pipe_put_str(mrb, pipe, item->handle, item->handle_len);
+    mrb_sftp_pipe_end(mrb, pipe);
+
+    item->closing = TRUE;
+}
+
+static void
+mrb_sftp_batch_read (mrb_state *mrb, mrb_sftp_pipe_t *pipe, mrb_sftp_batch_item_t *item, uint64_t off, uint32_t len)
+{
+    uint32_t id = mrb_sftp_pipe_begin(mrb, pipe, SSH_FXP_READ);
+
+    mrb_sftp_pipe_put_str(mrb, pipe, item->handle, item->handle_len);
+    mrb_sftp_pipe_put_u64(mrb, pipe, off);
+    mrb_sftp_pipe_put_u32(mrb, pipe, len);
+    mrb_sftp_pipe_end(mrb, pipe);
+
+    mrb_sftp_batch_track(item, id, off, len);
+}
+
+static void
+mrb_sftp_batch_write (mrb_state *mrb, mrb_sftp_pipe_t *pipe, mrb_sftp_batch_t *batch, mrb_sftp_batch_item_t *item)
+{
+    size_t len = fread(batch->buf, sizeof(char), MRB_SFTP_BATCH_CHUNK_SIZE, item->file);
+    uint32_t id;
+
+    if (len < MRB_SFTP_BATCH_CHUNK_SIZE) {
+        item->eof = item->next + len;
+    }
+
+    if (len < MRB_SFTP_BATCH_CHUNK_SIZE && ferror(item->file)) {
+        mrb_sftp_batch_fail(item, MRB_SFTP_BATCH_IO_ERROR, "Cannot read from the path specified.");
+        return;
+    }
+
+    if (len == 0) return;
+
+    id = mrb_sftp_pipe_begin(mrb, pipe, SSH_FXP_WRITE);
+
+    mrb_sftp_pipe_put_str(mrb, pipe, item->handle, item->handle_len);
+    mrb_sftp_pipe_put_u64(mrb, pipe, item->next);
+    mrb_sftp_pipe_put_str(mrb, pipe, batch->buf, len);
+    mrb_sftp_pipe_end(mrb, pipe);
+
+    mrb_sftp_batch_track(item, id, item->next, (uint32_t)len);
+
+    item->next += len;
+}
+
+static void
+mrb_sftp_batch_data (mrb_state *mrb, mrb_sftp_pipe_t *pipe, mrb_sftp_batch_item_t *item, mrb_sftp_batch_req_t *req, mrb_sftp_reply_t *reply)
+{
+    const char *data;
+    uint32_t len;
+    int err;
+
+    if (reply->type != SSH_FXP_DATA) {
+        if ((err = mrb_sftp_reply_status(reply, NULL, NULL)) == LIBSSH2_FX_EOF) {
+            item->eof = req->off < item->eof ? req->off : item->eof;
+        } else {
+            mrb_sftp_batch_fail(item, err, "Failed to read from the remote file.");
+        }
+        return;
+    }
+
+    if (!mrb_sftp_reply_str(reply, &data, &len) || len > req->len) {
+        mrb_sftp_batch_fail(item, LIBSSH2_FX_BAD_MESSAGE, "Failed to read from the remote file.");
+        return;
+    }
+
+    if (len == 0 && req->off < item->eof) {
+        item->eof = req->off;
+    }
+
+    if ((req->off != item->pos && mrb_sftp_fseek(item->file, req->off) != 0) || fwrite(data, sizeof(char), len, item->file) != len) {
+        mrb_sftp_batch_fail(item, MRB_SFTP_BATCH_IO_ERROR, "Cannot write to the path specified.");
+        return;
+    }
+
+    item->pos    = req->off + len;
+    item->bytes += len;
+
+    if (len > 0 && len < req->len && req->off + len < item->eof) {
+        mrb_sftp_batch_read(mrb, pipe, item, req->off + len, req->len - len);
+    }
+}
+
+static void
+mrb_sftp_batch_step (mrb_state *mrb, mrb_sftp_pipe_t *pipe, void *ctx, mrb_int idx, mrb_sftp_reply_t *reply)
+{
+    mrb_sftp_batch_t *batch     = (mrb_sftp_batch_t *)ctx;
+    mrb_sftp_batch_item_t *item = &batch->items[idx];
+    mrb_sftp_batch_req_t req;
+    int arena                   = mrb_gc_arena_save(mrb);
+    const char *str;
+    uint32_t len;
+    int err;
+
+    if (!reply) {
+        mrb_sftp_batch_open(mrb, pipe, batch, idx);
+        goto done;
+    }
+
+    if (item->closing) {
+        if ((err = mrb_sftp_reply_status(reply, NULL, NULL)) != LIBSSH2_FX_OK) {
+            mrb_sftp_batch_fail(item, err, "Failed to close the remote file.");
+        }
+
+        batch->running--;
+        mrb_sftp_batch_finish(mrb, batch, idx);
+        goto done;
+    }
+
+    if (item->handle_len == 0) {
+        if (!(reply->type == SSH_FXP_HANDLE && mrb_sftp_reply_str(reply, &str, &len) && len > 0 && len <= sizeof(item->handle))) {
+            mrb_sftp_batch_fail(item, mrb_sftp_reply_status(reply, NULL, NULL), "Unable to open the remote path.");
+            batch->running--;
+            mrb_sftp_batch_finish(mrb, batch, idx);
+            goto done;
+        }
+
+        memcpy(item->handle, str, len);
+        item->handle_len = len;
+
+        if (!batch->upload) {
+            mrb_sftp_batch_fopen(mrb, batch, idx);
+        }
+    } else
+    if (!mrb_sftp_batch_untrack(item, reply->id, &req)) {
+        goto done;
+    } else
+    if (batch->upload) {
+        if ((err = mrb_sftp_reply_status(reply, NULL, NULL)) == LIBSSH2_FX_OK) {
+            item->bytes += req.len;
+        } else {
+            mrb_sftp_batch_fail(item, err, "Failed to write to the remote file.");
+        }
+    } else {
+        mrb_sftp_batch_data(mrb, pipe, item, &req, reply);
+    }
+
+    while (!item->err && item->pending < MRB_SFTP_BATCH_WINDOW && item->next < item->eof) {
+        if (batch->upload) {
+            mrb_sftp_batch_write(mrb, pipe, batch, item);
+        } else {
+            mrb_sftp_batch_read(mrb, pipe, item, item->next, MRB_SFTP_BATCH_CHUNK_SIZE);
+            item->next += MRB_SFTP_BATCH_CHUNK_SIZE;
+        }
+    }
+
+    if (item->pending == 0) {
+        mrb_sftp_batch_close(mrb, pipe, item);
+    }
+
+  done:
+
+    mrb_gc_arena_restore(mrb, arena);
+}
+
+static mrb_value
+mrb_sftp_batch_run (mrb_state *mrb, mrb_value ctx)
+{
+    mrb_sftp_batch_t *batch = mrb_cptr(ctx);
+
+    mrb_sftp_pipe_drive(mrb, batch->self, batch->len, &batch->running, batch->width, mrb_sftp_batch_step, batch);
+
+    batch->done = TRUE;
+
+    return batch->res;
+}
+
+static mrb_value
+mrb_sftp_batch_cleanup (mrb_state *mrb, mrb_value ctx)
+{
+    mrb_sftp_batch_t *batch = mrb_cptr(ctx);
+    mrb_int i;
+
+    if (!batch->done && batch->running > 0) {
+        mrb_sftp_pipe_reset(mrb, batch->self);
+    }
+
+    for (i = 0; i < batch->len; i++) {
+        if (batch->items[i].file) {
+            fclose(batch->items[i].file);
+        }
+    }
+
+    mrb_free(mrb, batch->items);
+    mrb_free(mrb, batch);
+
+    return mrb_nil_value();
+}
+
+static mrb_value
+mrb_sftp_batch (mrb_state *mrb, mrb_value self, mrb_value pairs, mrb_int mode, mrb_value opts, mrb_bool upload)
+{
+    mrb_int width = MRB_SFTP_BATCH_FILES;
+    mrb_sftp_batch_t *batch;
+    mrb_value pair, ctx;
+    mrb_int i;
+
+    if (mrb_hash_p(opts) && mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("concurrency", 11))))) {
+        width = mrb_fixnum(mrb_Integer(mrb, mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("concurrency", 11)))));
+    }
+
+    if (width < 1) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Concurrency must be at least 1.");
+    }
+
+    for (i = 0; i < RARRAY_LEN(pairs); i++) {
+        pair = RARRAY_PTR(pairs)[i];
+
+        if (!(mrb_array_p(pair) && RARRAY_LEN(pair) == 2 && mrb_string_p(RARRAY_PTR(pair)[0]) && mrb_string_p(RARRAY_PTR(pair)[1]))) {
+            mrb_raise(mrb, E_TYPE_ERROR, "Pairs of paths expected.");
+        }
+
+        mrb_string_value_cstr(mrb, &RARRAY_PTR(pair)[upload ? 0 : 1]);
+    }
+
+    if (RARRAY_LEN(pairs) == 0)
+        return mrb_ary_new(mrb);
+
+    mrb_sftp_pipe(mrb, self);
+
+    batch = mrb_malloc(mrb, sizeof(mrb_sftp_batch_t));
+
+    memset(batch, 0, sizeof(mrb_sftp_batch_t));
+
+    batch->self   = self;
+    batch->pairs  = pairs;
+    batch->len    = RARRAY_LEN(pairs);
+    batch->width  = width;
+    batch->mode   = mode;
+    batch->upload = upload;
+    batch->res    = mrb_ary_new_capa(mrb, batch->len);
+    batch->items  = mrb_calloc(mrb, batch->len, sizeof(mrb_sftp_batch_item_t));
+    ctx           = mrb_cptr_value(mrb, batch);
+
+    return mrb_ensure(mrb, mrb_sftp_batch_run, ctx, mrb_sftp_batch_cleanup, ctx);
+}
+
+static mrb_value
+mrb_sftp_f_download_many (mrb_state *mrb, mrb_value self)
+{
+    mrb_value pairs, opts = mrb_nil_value();
+
+    mrb_get_args(mrb, "A|H", &pairs, &opts);
+
+    return mrb_sftp_batch(mrb, self, pairs, 0, opts, FALSE);
+}
+
+static mrb_value
+mrb_sftp_f_upload_many (mrb_state *mrb, mrb_value self)
+{
+    mrb_value pairs, opts = mrb_nil_value();
+    mrb_int mode          = 0000644;
+
+    mrb_get_args(mrb, "A|iH", &pairs, &mode, &opts);
+
+    return mrb_sftp_batch(mrb, self, pairs, mode, opts, TRUE);
+}
+
+void
+mrb_mruby_sftp_batch_init (mrb_state *mrb)
+{
+    struct RClass *cls = mrb_class_get_under(mrb, mrb_module_get(mrb, "SFTP"), "Session");
+
+    mrb_define_method(mrb, cls, "download_many", mrb_sftp_f_download_many, MRB_ARGS_ARG(1,1));
+    mrb_define_method(mrb, cls, "upload_many",   mrb_sftp_f_upload_many,   MRB_ARGS_ARG(1,2));
+}
\ No newline at end of file
@@ -0,0 +1,586 @@
+/* MIT License
+ *
+ * Copyright (c) Sebastian Katzer 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "connection.h"
+#include "session.h"
+
+#include "mruby.h"
+#include "mruby/data.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/error.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+#include "mruby/variable.h"
+#include "mruby/ext/ssh.h"
+#include "mruby/ext/sftp.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libssh2_sftp.h>
+
+#ifdef _WIN32
+# include <winsock2.h>
+# include <ws2tcpip.h>
+# define poll WSAPoll
+# define close closesocket
+#else
+# include <errno.h>
+# include <fcntl.h>
+# include <netdb.h>
+# include <poll.h>
+# include <unistd.h>
+# include <sys/socket.h>
+#endif
+
+#define SYM(name, len) mrb_intern_static(mrb, name, len)
+
+#ifndef MRB_SFTP_CONNECT_CONCURRENCY
+# define MRB_SFTP_CONNECT_CONCURRENCY 64
+#endif
+
+#define MRB_SFTP_DIAL_IDLE      0
+#define MRB_SFTP_DIAL_CONNECT   1
+#define MRB_SFTP_DIAL_HANDSHAKE 2
+#define MRB_SFTP_DIAL_AUTH      3
+#define MRB_SFTP_DIAL_INIT      4
+#define MRB_SFTP_DIAL_DONE      5
+#define MRB_SFTP_DIAL_FAILED    6
+
+#define MRB_SFTP_DIAL_TIMEOUT   7
+
+typedef struct mrb_sftp_login
+{
+    const char *user;
+    mrb_int user_len;
+    const char *password;
+    mrb_int password_len;
+    const char *key;
+    const char *passphrase;
+    mrb_bool compress;
+} mrb_sftp_login_t;
+
+typedef struct mrb_sftp_dial
+{
+    mrb_value host;
+    char name[256];
+    char port[8];
+    struct addrinfo *addrs;
+    struct addrinfo *addr;
+    libssh2_socket_t sock;
+    LIBSSH2_SESSION *session;
+    LIBSSH2_SFTP *sftp;
+    int state;
+    int failed;
+    const char *msg;
+    int64_t started;
+} mrb_sftp_dial_t;
+
+static void
+mrb_sftp_connection_close (mrb_ssh_t *ssh)
+{
+    if (mrb_ssh_initialized()) {
+        while (libssh2_session_disconnect(ssh->session, "Normal Shutdown") == LIBSSH2_ERROR_EAGAIN) {
+            mrb_ssh_wait_sock(ssh);
+        }
+
+        while (libssh2_session_free(ssh->session) == LIBSSH2_ERROR_EAGAIN) {
+            mrb_ssh_wait_sock(ssh);
+        }
+    }
+
+    close(ssh->sock);
+}
+
+static void
+mrb_sftp_connection_free (mrb_state *mrb, void *p)
+{
+    if (!p) return;
+
+    mrb_sftp_connection_close((mrb_ssh_t *)p);
+    mrb_free(mrb, p);
+}
+
+static mrb_data_type const mrb_sftp_connection_type = { "SFTP::Connection", mrb_sftp_connection_free };
+
+static void
+mrb_sftp_dial_fail (mrb_sftp_dial_t *d, const char *msg)
+{
+    mrb_ssh_t ssh;
+
+    if (d->session) {
+        memset(&ssh, 0, sizeof(mrb_ssh_t));
+
+        ssh.session = d->session;
+        ssh.sock    = d->sock;
+
+        while (libssh2_session_free(d->session) == LIBSSH2_ERROR_EAGAIN) {
+            if (mrb_sftp_poll_sock(&ssh, 1000) < 0) break;
+        }
+    }
+
+    if (d->sock != LIBSSH2_INVALID_SOCKET) {
+        close(d->sock);
+    }
+
+    if (d->addrs) {
+        freeaddrinfo(d->addrs);
+    }
+
+    d->addrs   = NULL;
+    d->addr    = NULL;
+    d->failed  = d->state;
+    d->state   = MRB_SFTP_DIAL_FAILED;
+    d->msg     = msg;
+    d->session = NULL;
+    d->sftp    = NULL;
+    d->sock    = LIBSSH2_INVALID_SOCKET;
+}
+
+static void
+mrb_sftp_dial_connect (mrb_sftp_dial_t *d)
+{
+    struct addrinfo *ai;
+#ifdef _WIN32
+    u_long on = 1;
+#endif
+    int rc;
+
+    for (; (ai = d->addr); d->addr = ai->ai_next) {
+        if (d->sock != LIBSSH2_INVALID_SOCKET) {
+            close(d->sock);
+        }
+
+        d->sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+        if (d->sock == LIBSSH2_INVALID_SOCKET)
+            continue;
+
+#ifdef _WIN32
+        ioctlsocket(d->sock, FIONBIO, &on);
+        rc = connect(d->sock, ai->ai_addr, (int)ai->ai_addrlen);
+        rc = rc == 0 || WSAGetLastError() == WSAEWOULDBLOCK ? rc : -2;
+#else
+        fcntl(d->sock, F_SETFL, fcntl(d->sock, F_GETFL, 0) | O_NONBLOCK);
+        rc = connect(d->sock, ai->ai_addr, ai->ai_addrlen);
+        rc = rc == 0 || errno == EINPROGRESS ? rc : -2;
+#endif
+
+        if (rc == -2)
+            continue;
+
+        if (rc == 0) {
+            freeaddrinfo(d->addrs);
+            d->addrs = d->addr = NULL;
+            d->state = MRB_SFTP_DIAL_HANDSHAKE;
+        }
+
+        return;
+    }
+
+    mrb_sftp_dial_fail(d, "Unable to connect to the host.");
+}
+
+static void
+mrb_sftp_dial_open (mrb_sftp_dial_t *d)
+{
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(hints));
+
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    d->started = mrb_sftp_now();
+    d->state   = MRB_SFTP_DIAL_CONNECT;
+
+    if (getaddrinfo(d->name, d->port, &hints, &d->addrs) != 0) {
+        d->addrs = NULL;
+        mrb_sftp_dial_fail(d, "Unable to resolve the host.");
+        return;
+    }
+
+    d->addr = d->addrs;
+
+    mrb_sftp_dial_connect(d);
+}
+
+static void
+mrb_sftp_dial_step (mrb_sftp_dial_t *d, mrb_sftp_login_t *login, short revents)
+{
+    socklen_t len = sizeof(int);
+    int rc, err   = 0;
+
+    if (d->state == MRB_SFTP_DIAL_CONNECT) {
+        if (!revents) return;
+
+        if (getsockopt(d->sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len) != 0 || err != 0) {
+            d->addr = d->addr->ai_next;
+            mrb_sftp_dial_connect(d);
+            return;
+        }
+
+        freeaddrinfo(d->addrs);
+
+        d->addrs = d->addr = NULL;
+        d->state = MRB_SFTP_DIAL_HANDSHAKE;
+    }
+
+    if (d->state == MRB_SFTP_DIAL_HANDSHAKE) {
+        if (!d->session) {
+            if (!(d->session = libssh2_session_init())) {
+                mrb_sftp_dial_fail(d, "Unable to create the SSH session.");
+                return;
+            }
+
+            libssh2_session_set_blocking(d->session, 0);
+            libssh2_session_flag(d->session, LIBSSH2_FLAG_COMPRESS, login->compress);
+        }
+
+        if ((rc = libssh2_session_handshake(d->session, d->sock)) == LIBSSH2_ERROR_EAGAIN) return;
+
+        if (rc != 0) {
+            mrb_sftp_dial_fail(d, "Unable to exchange keys with the host.");
+            return;
+        }
+
+        d->state = MRB_SFTP_DIAL_AUTH;
+    }
+
+    if (d->state == MRB_SFTP_DIAL_AUTH) {
+        if (login->password) {
+            rc = libssh2_userauth_password_ex(d->session, login->user, login->user_len, login->password, login->password_len, NULL);
+        } else {
+            rc = libssh2_userauth_publickey_fromfile_ex(d->session, login->user, login->user_len, NULL, login->key, login->passphrase);
+        }
+
+        if (rc == LIBSSH2_ERROR_EAGAIN) return;
+
+        if (rc != 0) {
+            mrb_sftp_dial_fail(d, "Authentication failed.");
+            return;
+        }
+
+        d->state = MRB_SFTP_DIAL_INIT;
+    }
+
+    if (d->state == MRB_SFTP_DIAL_INIT) {
+        if (!(d->sftp = libssh2_sftp_init(d->session))) {
+            if (libssh2_session_last_errno(d->session) == LIBSSH2_ERROR_EAGAIN) return;
+
+            mrb_sftp_dial_fail(d, "Unable to startup the SFTP session.");
+            return;
+        }
+
+        d->state = MRB_SFTP_DIAL_DONE;
+    }
+}
+
+static short
+mrb_sftp_dial_events (mrb_sftp_dial_t *d)
+{
+    int dirs;
+
+    if (d->state == MRB_SFTP_DIAL_CONNECT)
+        return POLLOUT;
+
+    dirs = libssh2_session_block_directions(d->session);
+
+    if (dirs & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+        return dirs & LIBSSH2_SESSION_BLOCK_INBOUND ? POLLIN | POLLOUT : POLLOUT;
+
+    return POLLIN;
+}
+
+static void
+mrb_sftp_dial_all (mrb_sftp_dial_t *dials, mrb_int len, mrb_sftp_login_t *login, mrb_int limit, int64_t timeout)
+{
+    mrb_sftp_dial_t **polled = (mrb_sftp_dial_t **)(dials + len);
+    struct pollfd *fds       = (struct pollfd *)(polled + len);
+    mrb_int i, running, nfds;
+    int64_t now, wait, left;
+    mrb_sftp_dial_t *d;
+    int rc;
+
+    for (;;) {
+        now     = mrb_sftp_now();
+        wait    = -1;
+        running = 0;
+        nfds    = 0;
+
+        for (i = 0; i < len; i++) {
+            d = &dials[i];
+
+            if (d->state == MRB_SFTP_DIAL_IDLE && running < limit) {
+                mrb_sftp_dial_open(d);
+                mrb_sftp_dial_step(d, login, 0);
+            }
+
+            if (d->state == MRB_SFTP_DIAL_IDLE || d->state >= MRB_SFTP_DIAL_DONE)
+                continue;
+
+            if (timeout > 0 && (left = d->started + timeout - now) <= 0) {
+                mrb_sftp_dial_fail(d, "SFTP session timed out while connecting.");
+                d->failed = MRB_SFTP_DIAL_TIMEOUT;
+                continue;
+            }
+
+            if (timeout > 0 && (wait < 0 || left < wait)) {
+                wait = left;
+            }
+
+            fds[nfds].fd      = d->sock;
+            fds[nfds].events  = mrb_sftp_dial_events(d);
+            fds[nfds].revents = 0;
+            polled[nfds++]    = d;
+            running++;
+        }
+
+        if (nfds == 0) break;
+
+        rc = poll(fds, nfds, wait > INT_MAX ? INT_MAX : (int)wait);
+
+#ifndef _WIN32
+        if (rc < 0 && errno == EINTR) continue;
+#endif
+
+        if (rc < 0) {
+            for (i = 0; i < nfds; i++) {
+                mrb_sftp_dial_fail(polled[i], "Unable to wait for the host.");
+            }
+            continue;
+        }
+
+        if (rc == 0) continue;
+
+        for (i = 0; i < nfds; i++) {
+            if (fds[i].revents) mrb_sftp_dial_step(polled[i], login, fds[i].revents);
+        }
+    }
+}
+
+static void
+mrb_sftp_dial_init (mrb_sftp_dial_t *d, mrb_value host, mrb_int port)
+{
+    const char *sep = memchr(RSTRING_PTR(host), ':', RSTRING_LEN(host));
+    mrb_int len     = RSTRING_LEN(host);
+
+    memset(d, 0, sizeof(mrb_sftp_dial_t));
+
+    d->host = host;
+    d->sock = LIBSSH2_INVALID_SOCKET;
+
+    if (sep && !memchr(sep + 1, ':', RSTRING_PTR(host) + len - sep - 1)) {
+        port = strtol(sep + 1, NULL, 10);
+        len  = sep - RSTRING_PTR(host);
+    }
+
+    if (len == 0 || len >= (mrb_int)sizeof(d->name) || port <= 0 || port > 65535) {
+        mrb_sftp_dial_fail(d, "Invalid host name or port.");
+        return;
+    }
+
+    memcpy(d->name, RSTRING_PTR(host), len);
+    snprintf(d->port, sizeof(d->port), "%d", (int)port);
+}
+
+static mrb_value
+mrb_sftp_dial_error (mrb_state *mrb, mrb_sftp_dial_t *d)
+{
+    struct RClass *cls;
+
+    switch (d->failed) {
+    case MRB_SFTP_DIAL_TIMEOUT:
+        cls = E_SFTP_TIMEOUT_ERROR; break;
+    case MRB_SFTP_DIAL_AUTH:
+        cls = E_SSH_NOT_AUTH_ERROR; break;
+    case MRB_SFTP_DIAL_INIT:
+        cls = E_SFTP_ERROR; break;
+    default:
+        cls = E_SSH_NOT_CONNECTED_ERROR; break;
+    }
+
+    return mrb_exc_new_str(mrb, cls, mrb_str_new_cstr(mrb, d->msg));
+}
+
+static mrb_value
+mrb_sftp_f_start_many (mrb_state *mrb, mrb_value self)
+{
+    mrb_value hosts, user, opts = mrb_nil_value();
+    mrb_value password, key, passphrase, secs, res[2];
+    mrb_int port = 22, limit = MRB_SFTP_CONNECT_CONCURRENCY, len, i;
+    mrb_sftp_login_t login;
+    mrb_sftp_dial_t *dials;
+    int64_t timeout = 0;
+    mrb_ssh_t *ssh;
+    mrb_value conn;
+    int arena;
+
+    mrb_get_args(mrb, "AS|H", &hosts, &user, &opts);
+
+    if (mrb_nil_p(opts)) {
+        opts = mrb_hash_new(mrb);
+    }
+
+    password   = mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("password", 8)));
+    key        = mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("key", 3)));
+    passphrase = mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("passphrase", 10)));
+    secs       = mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("timeout", 7)));
+
+    if (mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("port", 4))))) {
+        port = mrb_fixnum(mrb_Integer(mrb, mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("port", 4)))));
+    }
+
+    if (mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("concurrency", 11))))) {
+        limit = mrb_fixnum(mrb_Integer(mrb, mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("concurrency", 11)))));
+    }
+
+    if (limit < 1) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Concurrency must be at least 1.");
+    }
+
+    if (!mrb_nil_p(secs)) {
+#ifndef MRB_WITHOUT_FLOAT
+        timeout = (int64_t)(mrb_to_flo(mrb, secs) * 1000);
+#else
+        timeout = (int64_t)mrb_fixnum(mrb_Integer(mrb, secs)) * 1000;
+#endif
+    }
+
+    if (mrb_nil_p(password) && mrb_nil_p(key)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Password or key required.");
+    }
+
+    if (mrb_string_p(key) && RSTRING_LEN(key) > 1 && RSTRING_PTR(key)[0] == '~' && RSTRING_PTR(key)[1] == '/' && getenv("HOME")) {
+        key = mrb_str_cat(mrb, mrb_str_new_cstr(mrb, getenv("HOME")), RSTRING_PTR(key) + 1, RSTRING_LEN(key) - 1);
+    }
+
+    login.user         = RSTRING_PTR(user);
+    login.user_len     = RSTRING_LEN(user);
+    login.password     = mrb_nil_p(password) ? NULL : mrb_string_value_cstr(mrb, &password);
+    login.password_len = mrb_nil_p(password) ? 0 : RSTRING_LEN(password);
+    login.key          = mrb_nil_p(key) ? NULL : mrb_string_value_cstr(mrb, &key);
+    login.passphrase   = mrb_nil_p(passphrase) ? NULL : mrb_string_value_cstr(mrb, &passphrase);
+    login.compress     = mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("compress", 8))));
+
+    len = RARRAY_LEN(hosts);
+
+    for (i = 0; i < len; i++) {
+        if (!mrb_string_p(RARRAY_PTR(hosts)[i])) {
+            mrb_raise(mrb, E_TYPE_ERROR, "Host name expected.");
+        }
+    }
+
+    res[0] = mrb_hash_new(mrb);
+    res[1] = mrb_hash_new(mrb);
+
+    if (len == 0)
+        return mrb_ary_new_from_values(mrb, 2, res);
+
+    dials = mrb_malloc(mrb, len * (sizeof(mrb_sftp_dial_t) + sizeof(mrb_sftp_dial_t *) + sizeof(struct pollfd)));
+
+    for (i = 0; i < len; i++) {
+        mrb_sftp_dial_init(&dials[i], RARRAY_PTR(hosts)[i], port);
+    }
+
+    mrb_sftp_dial_all(dials, len, &login, limit, timeout);
+
+    for (i = 0; i < len; i++) {
+        arena = mrb_gc_arena_save(mrb);
+
+        if (dials[i].state == MRB_SFTP_DIAL_DONE) {
+            ssh = mrb_malloc(mrb, sizeof(mrb_ssh_t));
+
+            memset(ssh, 0, sizeof(mrb_ssh_t));
+
+            ssh->session = dials[i].session;
+            ssh->sock    = dials[i].sock;
+
+            conn = mrb_obj_value(mrb_data_object_alloc(mrb, mrb_class_ptr(self), ssh, &mrb_sftp_connection_type));
+
+            mrb_iv_set(mrb, conn, SYM("@host", 5), dials[i].host);
+            mrb_hash_set(mrb, res[0], dials[i].host, mrb_sftp_session_new(mrb, conn, dials[i].sftp));
+        } else {
+            mrb_hash_set(mrb, res[1], dials[i].host, mrb_sftp_dial_error(mrb, &dials[i]));
+        }
+
+        mrb_gc_arena_restore(mrb, arena);
+    }
+
+    mrb_free(mrb, dials);
+
+    return mrb_ary_new_from_values(mrb, 2, res);
+}
+
+static mrb_value
+mrb_sftp_connection_f_host (mrb_state *mrb, mrb_value self)
+{
+    return mrb_attr_get(mrb, self, SYM("@host", 5));
+}
+
+static mrb_value
+mrb_sftp_connection_f_logged_in (mrb_state *mrb, mrb_value self)
+{
+    mrb_ssh_t *ssh = DATA_PTR(self);
+
+    return mrb_bool_value(ssh && mrb_ssh_initialized() && libssh2_userauth_authenticated(ssh->session));
+}
+
+static mrb_value
+mrb_sftp_connection_f_closed (mrb_state *mrb, mrb_value self)
+{
+    return mrb_bool_value(DATA_PTR(self) == NULL);
+}
+
+static mrb_value
+mrb_sftp_connection_f_close (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_connection_free(mrb, DATA_PTR(self));
+
+    DATA_PTR(self)  = NULL;
+    DATA_TYPE(self) = NULL;
+
+    return mrb_nil_value();
+}
+
+void
+mrb_mruby_sftp_connection_init (mrb_state *mrb)
+{
+    struct RClass *ftp, *cls;
+
+    ftp = mrb_module_get(mrb, "SFTP");
+    cls = mrb_define_class_under(mrb, ftp, "Connection", mrb->object_class);
+
+    MRB_SET_INSTANCE_TT(cls, MRB_TT_DATA);
+
+    mrb_undef_class_method(mrb, cls, "new");
+
+    mrb_define_class_method(mrb, cls, "start_many", mrb_sftp_f_start_many, MRB_ARGS_ARG(2,1));
+
+    mrb_define_method(mrb, cls, "host",       mrb_sftp_connection_f_host,      MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "logged_in?", mrb_sftp_connection_f_logged_in, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "closed?",    mrb_sftp_connection_f_closed,    MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "close",      mrb_sftp_connection_f_close,     MRB_ARGS_NONE());
+}
\ No newline at end of file
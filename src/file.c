@@ -22,134 +22,1109 @@
  */
 
 #include "handle.h"
+#include "local.h"
+#include "transform.h"
 
 #include "mruby.h"
+#include "mruby/data.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
 #include "mruby/variable.h"
 #include "mruby/ext/sftp.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <libssh2_sftp.h>
 
+#ifdef _WIN32
+# include <io.h>
+# include <windows.h>
+#else
+# include <time.h>
+# include <poll.h>
+# include <errno.h>
+# include <unistd.h>
+#endif
+
 #define SYM(name, len) mrb_intern_static(mrb, name, len)
 
+#ifndef MRB_SFTP_CHUNK_SIZE
+# define MRB_SFTP_CHUNK_SIZE 131072
+#endif
+
+#ifndef MRB_SFTP_FOLLOW_CHUNK_SIZE
+# define MRB_SFTP_FOLLOW_CHUNK_SIZE 32768
+#endif
+
+#ifndef MRB_SFTP_RELAY_SLOTS
+# define MRB_SFTP_RELAY_SLOTS 4
+#endif
+
+#ifndef MRB_SFTP_RELAY_CHUNK_SIZE
+# define MRB_SFTP_RELAY_CHUNK_SIZE 1048576
+#endif
+
+typedef struct mrb_sftp_sink
+{
+    mrb_value self;
+    mrb_int total;
+    mrb_bool sparse;
+    mrb_bool hole;
+} mrb_sftp_sink_t;
+
+typedef struct mrb_sftp_fd
+{
+    mrb_value session;
+    int fd;
+} mrb_sftp_fd_t;
+
+typedef struct mrb_sftp_slot
+{
+    size_t len;
+    size_t off;
+} mrb_sftp_slot_t;
+
+typedef struct mrb_sftp_chunk
+{
+    mrb_value block;
+    mrb_value chunk;
+    mrb_bool reuse;
+    int arena;
+} mrb_sftp_chunk_t;
+
+static void
+mrb_sftp_sleep (mrb_int ms)
+{
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts;
+
+    ts.tv_sec  = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static mrb_int
+mrb_sftp_opt_ms (mrb_state *mrb, mrb_value opts, const char *key, mrb_int def)
+{
+    mrb_value val = mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_cstr(mrb, key)));
+
+    if (mrb_nil_p(val))
+        return def;
+
+#ifndef MRB_WITHOUT_FLOAT
+    if (mrb_float_p(val))
+        return (mrb_int)(mrb_float(val) * 1000);
+#endif
+
+    return mrb_fixnum(mrb_Integer(mrb, val)) * 1000;
+}
+
+static mrb_bool
+mrb_sftp_sparse_opt (mrb_state *mrb, mrb_value opts)
+{
+    return mrb_hash_p(opts) && mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("sparse", 6))));
+}
+
+static int
+mrb_sftp_write_sink (mrb_state *mrb, void *ctx, const char *mem, size_t len)
+{
+    mrb_sftp_sink_t *sink       = (mrb_sftp_sink_t *)ctx;
+    LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle(mrb, sink->self);
+    mrb_bool zero               = FALSE;
+    size_t run;
+    ssize_t rc;
+
+    while (len > 0) {
+        run = sink->sparse ? mrb_sftp_zero_run(mem, len, libssh2_sftp_tell64(handle), &zero) : len;
+
+        if (zero) {
+            libssh2_sftp_seek64(handle, libssh2_sftp_tell64(handle) + run);
+            rc = (ssize_t)run;
+        } else
+        if ((rc = mrb_sftp_write(mrb, sink->self, mem, run)) < 0) {
+            return (int)rc;
+        }
+
+        sink->hole   = zero;
+        sink->total += rc;
+        mem         += run;
+        len         -= run;
+    }
+
+    return 0;
+}
+
+static int
+mrb_sftp_truncate_sink (mrb_state *mrb, mrb_sftp_sink_t *sink)
+{
+    mrb_value session           = mrb_attr_get(mrb, sink->self, SYM("@session", 8));
+    LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle(mrb, sink->self);
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    int rc;
+
+    if (!sink->hole)
+        return 0;
+
+    memset(&attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
+
+    attrs.flags    = LIBSSH2_SFTP_ATTR_SIZE;
+    attrs.filesize = libssh2_sftp_tell64(handle);
+
+    while ((rc = libssh2_sftp_fsetstat(handle, &attrs)) == LIBSSH2SFTP_EAGAIN) {
+        if ((rc = mrb_sftp_poll(session)) < 0) break;
+    }
+
+    return rc;
+}
+
+static int
+mrb_sftp_fileno (mrb_state *mrb, mrb_value io)
+{
+    if (!mrb_fixnum_p(io)) {
+        io = mrb_Integer(mrb, mrb_funcall(mrb, io, "fileno", 0));
+    }
+
+    if (mrb_fixnum(io) < 0) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Invalid file descriptor.");
+    }
+
+    return (int)mrb_fixnum(io);
+}
+
+static ssize_t
+mrb_sftp_fd_io (mrb_value session, int fd, char *mem, size_t len, mrb_bool out)
+{
+#ifdef _WIN32
+    ssize_t rc = out ? _write(fd, mem, (unsigned int)len) : _read(fd, mem, (unsigned int)len);
+
+    return rc < 0 ? MRB_SFTP_LOCAL_IO_ERROR : rc;
+#else
+    ssize_t rc;
+    int err;
+
+    for (;;) {
+        rc = out ? write(fd, mem, len) : read(fd, mem, len);
+
+        if (rc >= 0)
+            return rc;
+
+        if (errno == EINTR)
+            continue;
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return MRB_SFTP_LOCAL_IO_ERROR;
+
+        if ((err = mrb_sftp_poll_fd(session, fd, out ? POLLOUT : POLLIN)) == LIBSSH2_ERROR_TIMEOUT)
+            return err;
+
+        if (err < 0)
+            return MRB_SFTP_LOCAL_IO_ERROR;
+    }
+#endif
+}
+
+static int
+mrb_sftp_fd_sink (mrb_state *mrb, void *ctx, const char *mem, size_t len)
+{
+    mrb_sftp_fd_t *io = (mrb_sftp_fd_t *)ctx;
+    size_t total      = 0;
+    ssize_t rc;
+
+    while (total < len) {
+        if ((rc = mrb_sftp_fd_io(io->session, io->fd, (char *)mem + total, len - total, TRUE)) < 0)
+            return (int)rc;
+
+        if (rc == 0)
+            return MRB_SFTP_LOCAL_IO_ERROR;
+
+        total += rc;
+    }
+
+    return 0;
+}
+
+static void
+mrb_sftp_raise_transfer_error (mrb_state *mrb, mrb_value self, int rc, const char *msg)
+{
+    if (rc == MRB_SFTP_TRANSFORM_ERROR) {
+        mrb_raise(mrb, E_SFTP_FILE_ERROR, "Failed to transform the transferred data.");
+    }
+
+    if (rc == MRB_SFTP_LOCAL_IO_ERROR) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot access the path specified.");
+    }
+
+    mrb_sftp_raise_io_error(mrb, self, rc, msg);
+}
+
+static int
+mrb_sftp_str_sink (mrb_state *mrb, void *ctx, const char *mem, size_t len)
+{
+    mrb_str_cat(mrb, *(mrb_value *)ctx, mem, len);
+    return 0;
+}
+
+static mrb_int
+mrb_sftp_presize (mrb_state *mrb, mrb_value self)
+{
+    mrb_value session           = mrb_attr_get(mrb, self, SYM("@session", 8));
+    LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    int rc;
+
+    while ((rc = libssh2_sftp_fstat_ex(handle, &attrs, 0)) == LIBSSH2SFTP_EAGAIN) {
+        mrb_sftp_wait(mrb, session);
+    }
+
+    if (rc != 0 || !(attrs.flags & LIBSSH2_SFTP_ATTR_SIZE))
+        return -1;
+
+    if (attrs.filesize >= (libssh2_uint64_t)MRB_INT_MAX / 2)
+        return -1;
+
+    return (mrb_int)attrs.filesize;
+}
+
+static mrb_value
+mrb_sftp_download_mem (mrb_state *mrb, mrb_value self, struct RData *transform)
+{
+    mrb_int capa = MRB_SFTP_CHUNK_SIZE;
+    mrb_int len  = 0;
+    mrb_int size;
+    char probe[4096];
+    mrb_value res, raw;
+    ssize_t rc;
+    int err;
+
+    if (transform) {
+        res = mrb_str_new_capa(mrb, capa);
+        raw = mrb_str_new_capa(mrb, capa);
+
+        do {
+            if ((rc = mrb_sftp_read(mrb, self, RSTRING_PTR(raw), capa)) < 0) break;
+            err = mrb_sftp_transform_push(mrb, transform, RSTRING_PTR(raw), rc, rc < capa, mrb_sftp_str_sink, &res);
+            if (err < 0) mrb_sftp_raise_transfer_error(mrb, self, err, "Failed to read from the SFTP handle.");
+        } while (rc == capa);
+
+        len = RSTRING_LEN(res);
+        goto done;
+    }
+
+    if ((size = mrb_sftp_presize(mrb, self)) >= 0) {
+        capa = size;
+    }
+
+    res = mrb_str_new_capa(mrb, capa);
+
+    for (;;) {
+        if (len < capa) {
+            rc = mrb_sftp_read(mrb, self, RSTRING_PTR(res) + len, capa - len);
+        } else {
+            rc = mrb_sftp_read(mrb, self, probe, sizeof(probe));
+        }
+
+        if (rc <= 0) break;
+
+        if (len == capa) {
+            capa = capa + capa / 2 + rc;
+            mrb_str_resize(mrb, res, capa);
+            memcpy(RSTRING_PTR(res) + len, probe, rc);
+        }
+
+        len += rc;
+    }
+
+  done:
+
+    mrb_iv_set(mrb, self, SYM("eof", 3), mrb_true_value());
+
+    if (rc < 0) {
+        mrb_sftp_raise_io_error(mrb, self, rc, "Failed to read from the SFTP handle.");
+    }
+
+    if (len == 0)
+        return mrb_nil_value();
+
+    RSTR_SET_LEN(RSTRING(res), len);
+    RSTRING_PTR(res)[len] = '\0';
+
+    return res;
+}
+
 static mrb_value
 mrb_sftp_f_download (mrb_state *mrb, mrb_value self)
 {
     size_t mem_size = 3200000;
+    mrb_value opts  = mrb_nil_value();
+    struct RData *transform;
+    mrb_sftp_local_t local;
     const char* path;
-    mrb_int len;
-    FILE *file;
     char *mem;
-    int rc;
+    int rc, err = 0;
 
     mrb_value session           = mrb_attr_get(mrb, self, SYM("@session", 8));
-    mrb_ssh_t *ssh              = mrb_sftp_ssh_session(session);
     LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
 
+    mrb_sftp_flush(mrb, self);
     libssh2_sftp_rewind(handle);
     mrb_iv_remove(mrb, self, SYM("buf", 3));
 
-    mrb_get_args(mrb, "s", &path, &len);
+    mrb_get_args(mrb, "z!|H", &path, &opts);
 
-    if (!(file = fopen(path, "wb"))) {
-        mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot open the path specified.");
-    }
+    transform = mrb_sftp_transform(mrb, opts, MRB_SFTP_CHUNK_SIZE);
+
+    if (!path)
+        return mrb_sftp_download_mem(mrb, self, transform);
+
+    mrb_sftp_local_open(mrb, &local, path, opts);
 
     mem = mrb_malloc(mrb, mem_size * sizeof(char));
 
   read:
 
     while ((rc = libssh2_sftp_read(handle, mem, mem_size)) == LIBSSH2SFTP_EAGAIN) {
-        mrb_ssh_wait_sock(ssh);
+        if ((rc = mrb_sftp_poll(session)) < 0) break;
     }
 
-    if (rc < 0) goto done;
+    if (rc < 0) {
+        err = rc;
+        goto done;
+    }
 
-    fwrite(mem, sizeof(char), rc, file);
+    if (transform) {
+        err = mrb_sftp_transform_push(mrb, transform, mem, rc, rc == 0, mrb_sftp_local_write, &local);
+    } else {
+        err = mrb_sftp_local_write(mrb, &local, mem, rc);
+    }
 
-    if (rc > 0) goto read;
+    if (err == 0 && rc > 0) goto read;
 
   done:
 
     mrb_free(mrb, mem);
-    fclose(file);
+
+    if ((rc = mrb_sftp_local_close(&local)) < 0 && err == 0) {
+        err = rc;
+    }
     mrb_iv_set(mrb, self, SYM("eof", 3), mrb_true_value());
 
+    if (err < 0) {
+        mrb_sftp_raise_transfer_error(mrb, self, err, "Failed to read from the SFTP handle.");
+    }
+
     return mrb_fixnum_value(libssh2_sftp_tell64(handle));
 }
 
+static ssize_t
+mrb_sftp_fd_fill (FILE *file, mrb_sftp_fd_t *io, char *mem, size_t len)
+{
+    size_t total = 0;
+    ssize_t rc;
+
+    if (file) {
+        total = fread(mem, sizeof(char), len, file);
+        return ferror(file) ? MRB_SFTP_LOCAL_IO_ERROR : (ssize_t)total;
+    }
+
+    while (total < len) {
+        if ((rc = mrb_sftp_fd_io(io->session, io->fd, mem + total, len - total, FALSE)) < 0)
+            return rc;
+
+        if (rc == 0)
+            break;
+
+        total += rc;
+    }
+
+    return (ssize_t)total;
+}
+
 static mrb_value
 mrb_sftp_f_upload (mrb_state *mrb, mrb_value self)
 {
-    struct stat st;
-    size_t mem_size;
-    const char* path;
-    mrb_int len;
-    FILE *file;
-    char*mem;
+    size_t mem_size = 3200000;
+    mrb_value opts  = mrb_nil_value();
+    FILE *file      = NULL;
+    struct RData *transform;
+    mrb_sftp_sink_t sink;
+    mrb_sftp_fd_t io;
+    mrb_value local;
+    char *mem;
+    ssize_t size;
+    int err = 0;
 
-    mrb_value session           = mrb_attr_get(mrb, self, SYM("@session", 8));
-    mrb_ssh_t *ssh              = mrb_sftp_ssh_session(session);
     LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
 
+    mrb_sftp_flush(mrb, self);
     libssh2_sftp_rewind(handle);
     mrb_iv_remove(mrb, self, SYM("buf", 3));
 
-    mrb_get_args(mrb, "s", &path, &len);
+    mrb_get_args(mrb, "o|H", &local, &opts);
 
-    if (!(file = fopen(path, "rb"))) {
+    io.session = mrb_attr_get(mrb, self, SYM("@session", 8));
+    io.fd      = mrb_string_p(local) ? -1 : mrb_sftp_fileno(mrb, local);
+
+    transform = mrb_sftp_transform(mrb, opts, MRB_SFTP_CHUNK_SIZE);
+
+    if (io.fd == -1 && !(file = fopen(mrb_string_value_cstr(mrb, &local), "rb"))) {
         mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot open the path specified.");
     }
 
-    if (fstat(fileno(file), &st) != 0) {
-        mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot determine file size.");
+    mem         = mrb_malloc(mrb, mem_size * sizeof(char));
+    sink.self   = self;
+    sink.total  = 0;
+    sink.hole   = FALSE;
+    sink.sparse = mrb_sftp_sparse_opt(mrb, opts);
+
+    do {
+        size = mrb_sftp_fd_fill(file, &io, mem, mem_size);
+
+        if (size < 0) {
+            err = (int)size;
+        } else if (transform) {
+            err = mrb_sftp_transform_push(mrb, transform, mem, size, size == 0, mrb_sftp_write_sink, &sink);
+        } else if (size > 0) {
+            err = mrb_sftp_write_sink(mrb, &sink, mem, size);
+        }
+    } while (err == 0 && size > 0);
+
+    if (err == 0) {
+        err = mrb_sftp_truncate_sink(mrb, &sink);
+    }
+
+    mrb_free(mrb, mem);
+    if (file) fclose(file);
+    mrb_iv_set(mrb, self, SYM("eof", 3), mrb_true_value());
+
+    if (err == MRB_SFTP_LOCAL_IO_ERROR && io.fd != -1) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot read from the file descriptor.");
     }
 
-    mem_size = st.st_size;
+    if (err < 0) {
+        mrb_sftp_raise_transfer_error(mrb, self, err, "Failed to write to the SFTP handle.");
+    }
 
-    if (mem_size <= 0) goto done;
+    return mrb_fixnum_value(sink.total);
+}
 
-    mem = (char*) mrb_malloc(mrb, mem_size * sizeof(char));
+static void
+mrb_sftp_drop_buf (mrb_state *mrb, mrb_value self, LIBSSH2_SFTP_HANDLE *handle)
+{
+    mrb_value buf = mrb_attr_get(mrb, self, SYM("buf", 3));
 
-    fread(mem, sizeof(char), mem_size, file);
-    fclose(file);
+    mrb_sftp_flush(mrb, self);
 
-    while (libssh2_sftp_write(handle, mem, mem_size) == LIBSSH2SFTP_EAGAIN) {
-        mrb_ssh_wait_sock(ssh);
+    if (mrb_test(buf)) {
+        libssh2_sftp_seek64(handle, libssh2_sftp_tell64(handle) - RSTRING_LEN(buf));
+        mrb_iv_remove(mrb, self, SYM("buf", 3));
     }
+}
 
-    mrb_free(mrb, mem);
+static mrb_value
+mrb_sftp_f_copy_to (mrb_state *mrb, mrb_value self)
+{
+    size_t mem_size = 3200000;
+    mrb_int total   = 0;
+    mrb_sftp_fd_t out;
+    mrb_value io;
+    char *mem;
+    int rc, err = 0;
 
-  done:
+    mrb_value session           = mrb_attr_get(mrb, self, SYM("@session", 8));
+    LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
+
+    mrb_get_args(mrb, "o", &io);
+
+    out.session = session;
+    out.fd      = mrb_sftp_fileno(mrb, io);
+
+    mrb_sftp_drop_buf(mrb, self, handle);
+
+    mem = mrb_malloc(mrb, mem_size * sizeof(char));
 
+    for (;;) {
+        while ((rc = libssh2_sftp_read(handle, mem, mem_size)) == LIBSSH2SFTP_EAGAIN) {
+            if ((rc = mrb_sftp_poll(session)) < 0) break;
+        }
+
+        if (rc < 0) {
+            err = rc;
+            break;
+        }
+
+        if (rc == 0 || (err = mrb_sftp_fd_sink(mrb, &out, mem, rc)) != 0)
+            break;
+
+        total += rc;
+    }
+
+    mrb_free(mrb, mem);
     mrb_iv_set(mrb, self, SYM("eof", 3), mrb_true_value());
 
-    return mrb_fixnum_value(mem_size);
+    if (err == MRB_SFTP_LOCAL_IO_ERROR) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot write to the file descriptor.");
+    }
+
+    if (err < 0) {
+        mrb_sftp_raise_io_error(mrb, self, err, "Failed to read from the SFTP handle.");
+    }
+
+    return mrb_fixnum_value(total);
+}
+
+static mrb_value
+mrb_sftp_relay (mrb_state *mrb, mrb_value self, mrb_value src)
+{
+    mrb_value to_session        = mrb_attr_get(mrb, self, SYM("@session", 8));
+    mrb_value from_session      = mrb_attr_get(mrb, src, SYM("@session", 8));
+    LIBSSH2_SFTP_HANDLE *to     = mrb_sftp_handle_bang(mrb, self);
+    LIBSSH2_SFTP_HANDLE *from   = mrb_sftp_handle_bang(mrb, src);
+    mrb_bool serial             = mrb_sftp_ssh_session(to_session) == mrb_sftp_ssh_session(from_session);
+    mrb_bool eof                = FALSE;
+    mrb_bool reading            = FALSE;
+    mrb_bool writing            = FALSE;
+    mrb_int total               = 0;
+    mrb_int head = 0, tail = 0, filled = 0;
+    mrb_sftp_slot_t slots[MRB_SFTP_RELAY_SLOTS];
+    mrb_sftp_slot_t *slot;
+    const char *msg;
+    mrb_value failed;
+    mrb_bool busy;
+    ssize_t rc;
+    int err = 0;
+    char *mem;
+
+    mrb_sftp_drop_buf(mrb, self, to);
+    mrb_sftp_drop_buf(mrb, src, from);
+
+    memset(slots, 0, sizeof(slots));
+
+    mem    = mrb_malloc(mrb, MRB_SFTP_RELAY_SLOTS * MRB_SFTP_RELAY_CHUNK_SIZE);
+    failed = self;
+    msg    = "Failed to write to the SFTP handle.";
+
+    while (!eof || filled > 0) {
+        busy = FALSE;
+
+        if (!eof && filled < MRB_SFTP_RELAY_SLOTS && !(serial && writing)) {
+            slot    = &slots[head];
+            rc      = libssh2_sftp_read(from, mem + head * MRB_SFTP_RELAY_CHUNK_SIZE + slot->len, MRB_SFTP_RELAY_CHUNK_SIZE - slot->len);
+            reading = rc == LIBSSH2SFTP_EAGAIN;
+
+            if (rc < 0 && !reading) {
+                err    = (int)rc;
+                failed = src;
+                msg    = "Failed to read from the SFTP handle.";
+                break;
+            }
+
+            if (rc >= 0) {
+                eof        = rc == 0;
+                slot->len += rc;
+                busy       = TRUE;
+            }
+
+            if (slot->len == MRB_SFTP_RELAY_CHUNK_SIZE || (eof && slot->len > 0)) {
+                head = (head + 1) % MRB_SFTP_RELAY_SLOTS;
+                filled++;
+            }
+        }
+
+        if (filled > 0 && !(serial && reading)) {
+            slot    = &slots[tail];
+            rc      = libssh2_sftp_write(to, mem + tail * MRB_SFTP_RELAY_CHUNK_SIZE + slot->off, slot->len - slot->off);
+            writing = rc == LIBSSH2SFTP_EAGAIN;
+
+            if (rc < 0 && !writing) {
+                err = (int)rc;
+                break;
+            }
+
+            if (rc > 0) {
+                slot->off += rc;
+                total     += rc;
+                busy       = TRUE;
+            }
+
+            if (slot->off == slot->len) {
+                slot->len = slot->off = 0;
+                tail      = (tail + 1) % MRB_SFTP_RELAY_SLOTS;
+                filled--;
+            }
+        }
+
+        if (!busy && (err = mrb_sftp_poll_pair(from_session, to_session)) < 0)
+            break;
+    }
+
+    mrb_free(mrb, mem);
+    mrb_iv_set(mrb, src, SYM("eof", 3), mrb_true_value());
+
+    if (err < 0) {
+        mrb_sftp_raise_io_error(mrb, failed, err, msg);
+    }
+
+    return mrb_fixnum_value(total);
+}
+
+static mrb_value
+mrb_sftp_f_copy_from (mrb_state *mrb, mrb_value self)
+{
+    size_t mem_size = 3200000;
+    mrb_sftp_sink_t sink;
+    mrb_value io;
+    ssize_t size;
+    char *mem;
+    int fd, err = 0;
+
+    mrb_value session           = mrb_attr_get(mrb, self, SYM("@session", 8));
+    LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
+
+    mrb_get_args(mrb, "o", &io);
+
+    if (mrb_obj_equal(mrb, io, self)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Cannot copy a file onto itself.");
+    }
+
+    if (mrb_obj_is_kind_of(mrb, io, mrb_class_get_under(mrb, mrb_module_get(mrb, "SFTP"), "File")))
+        return mrb_sftp_relay(mrb, self, io);
+
+    fd = mrb_sftp_fileno(mrb, io);
+
+    mrb_sftp_drop_buf(mrb, self, handle);
+
+    mem         = mrb_malloc(mrb, mem_size * sizeof(char));
+    sink.self   = self;
+    sink.total  = 0;
+    sink.hole   = FALSE;
+    sink.sparse = FALSE;
+
+    for (;;) {
+        if ((size = mrb_sftp_fd_io(session, fd, mem, mem_size, FALSE)) < 0) {
+            err = (int)size;
+            break;
+        }
+
+        if (size == 0 || (err = mrb_sftp_write_sink(mrb, &sink, mem, size)) != 0)
+            break;
+    }
+
+    mrb_free(mrb, mem);
+
+    if (err == MRB_SFTP_LOCAL_IO_ERROR) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot read from the file descriptor.");
+    }
+
+    if (err < 0) {
+        mrb_sftp_raise_io_error(mrb, self, err, "Failed to write to the SFTP handle.");
+    }
+
+    return mrb_fixnum_value(sink.total);
 }
 
 static mrb_value
 mrb_sftp_f_write (mrb_state *mrb, mrb_value self)
 {
-    const char* buf;
+    LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
+    mrb_sftp_handle_t *data     = DATA_PTR(self);
+    mrb_value buf               = mrb_attr_get(mrb, self, SYM("buf", 3));
+    const char* mem;
     mrb_int len;
-    libssh2_uint64_t pos_before, pos_after;
+    ssize_t rc;
+
+    mrb_get_args(mrb, "s", &mem, &len);
+
+    if (mrb_test(buf)) {
+        libssh2_sftp_seek64(handle, libssh2_sftp_tell64(handle) - RSTRING_LEN(buf));
+        mrb_iv_remove(mrb, self, SYM("buf", 3));
+    }
+
+    if (data->wlen + len > data->wsize) {
+        mrb_sftp_flush(mrb, self);
+    }
+
+    if ((size_t)len >= data->wsize) {
+        if ((rc = mrb_sftp_write(mrb, self, mem, len)) < 0) {
+            mrb_sftp_raise_io_error(mrb, self, rc, "Failed to write to the SFTP handle.");
+        }
+
+        if (rc < len) {
+            mrb_sftp_raise(mrb, LIBSSH2_FX_FAILURE, "Failed to write to the SFTP handle.");
+        }
+
+        return mrb_fixnum_value(rc);
+    }
+
+    if (!data->wbuf) {
+        data->wbuf = mrb_malloc(mrb, data->wsize);
+    }
+
+    memcpy(data->wbuf + data->wlen, mem, len);
+    data->wlen += len;
+
+    if (data->wlen == data->wsize) {
+        mrb_sftp_flush(mrb, self);
+    }
+
+    return mrb_fixnum_value(len);
+}
+
+static mrb_value
+mrb_sftp_f_flush (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_handle_bang(mrb, self);
+    mrb_sftp_flush(mrb, self);
+
+    return self;
+}
+
+static mrb_value
+mrb_sftp_f_get_buffer_size (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_handle_t *data;
+
+    mrb_sftp_handle_bang(mrb, self);
+    data = DATA_PTR(self);
+
+    return mrb_fixnum_value(data->wsize);
+}
+
+static mrb_value
+mrb_sftp_f_set_buffer_size (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_handle_t *data;
+    mrb_int size;
+
+    mrb_get_args(mrb, "i", &size);
+
+    if (size < 0) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Negative buffer size.");
+    }
+
+    mrb_sftp_handle_bang(mrb, self);
+    mrb_sftp_flush(mrb, self);
+
+    data = DATA_PTR(self);
+
+    if (data->wbuf) {
+        mrb_free(mrb, data->wbuf);
+    }
+
+    data->wbuf  = NULL;
+    data->wsize = size;
+
+    return mrb_fixnum_value(size);
+}
+
+static void
+mrb_sftp_yield_lines (mrb_state *mrb, mrb_value self, mrb_value block, mrb_bool chomp, mrb_bool flush)
+{
+    mrb_value buf = mrb_iv_get(mrb, self, SYM("buf", 3));
+    mrb_value line;
+    const char *ptr, *nl;
+    mrb_int len, cut;
+    int arena;
+
+    while (mrb_string_p(buf) && RSTRING_LEN(buf) > 0) {
+        ptr = RSTRING_PTR(buf);
+        nl  = memchr(ptr, '\n', RSTRING_LEN(buf));
+
+        if (!nl && !flush) break;
+
+        arena = mrb_gc_arena_save(mrb);
+        len   = nl ? nl - ptr + 1 : RSTRING_LEN(buf);
+        cut   = len;
+
+        if (chomp && nl) {
+            cut = (len > 1 && ptr[len - 2] == '\r') ? len - 2 : len - 1;
+        }
+
+        line = mrb_str_new(mrb, ptr, cut);
+        buf  = mrb_str_substr(mrb, buf, len, RSTRING_LEN(buf) - len);
+
+        mrb_iv_set(mrb, self, SYM("buf", 3), buf);
+        mrb_yield(mrb, block, line);
+        mrb_gc_arena_restore(mrb, arena);
+
+        buf = mrb_iv_get(mrb, self, SYM("buf", 3));
+    }
+}
 
+static mrb_bool
+mrb_sftp_rotated (mrb_state *mrb, mrb_value self, libssh2_uint64_t offset)
+{
     mrb_value session           = mrb_attr_get(mrb, self, SYM("@session", 8));
-    mrb_ssh_t *ssh              = mrb_sftp_ssh_session(session);
+    mrb_value path              = mrb_iv_get(mrb, self, SYM("@path", 5));
+    LIBSSH2_SFTP *sftp          = mrb_sftp_session(session);
     LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
-    pos_before                  = libssh2_sftp_tell64(handle);
+    LIBSSH2_SFTP_ATTRIBUTES attrs, fattrs;
+    int rc;
+
+    while ((rc = libssh2_sftp_stat_ex(sftp, RSTRING_PTR(path), RSTRING_LEN(path), LIBSSH2_SFTP_STAT, &attrs)) == LIBSSH2SFTP_EAGAIN) {
+        mrb_sftp_wait(mrb, session);
+    }
+
+    if (rc != 0 || !(attrs.flags & LIBSSH2_SFTP_ATTR_SIZE))
+        return FALSE;
 
-    mrb_get_args(mrb, "s", &buf, &len);
+    if (attrs.filesize < offset)
+        return TRUE;
 
-    while (libssh2_sftp_write(handle, buf, len) == LIBSSH2SFTP_EAGAIN) {
-        mrb_ssh_wait_sock(ssh);
+    while ((rc = libssh2_sftp_fstat_ex(handle, &fattrs, 0)) == LIBSSH2SFTP_EAGAIN) {
+        mrb_sftp_wait(mrb, session);
     }
 
-    mrb_iv_remove(mrb, self, SYM("buf", 3));
-    pos_after = libssh2_sftp_tell64(handle);
+    if (rc != 0 || !(fattrs.flags & LIBSSH2_SFTP_ATTR_SIZE))
+        return attrs.filesize != offset;
+
+    if (attrs.filesize != fattrs.filesize)
+        return TRUE;
+
+    if (attrs.flags & fattrs.flags & LIBSSH2_SFTP_ATTR_ACMODTIME && attrs.mtime != fattrs.mtime)
+        return TRUE;
+
+    if (attrs.flags & fattrs.flags & LIBSSH2_SFTP_ATTR_UIDGID && (attrs.uid != fattrs.uid || attrs.gid != fattrs.gid))
+        return TRUE;
+
+    if (attrs.flags & fattrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS && attrs.permissions != fattrs.permissions)
+        return TRUE;
+
+    return FALSE;
+}
+
+static mrb_value
+mrb_sftp_f_follow (mrb_state *mrb, mrb_value self)
+{
+    LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
+    mrb_value opts              = mrb_nil_value();
+    mrb_value block             = mrb_nil_value();
+    mrb_bool chomp              = FALSE;
+    mrb_bool suspect            = FALSE;
+    mrb_bool drained            = TRUE;
+    mrb_int interval            = 250;
+    mrb_int max_interval        = 5000;
+    mrb_int idle_limit          = -1;
+    mrb_int delay, idle         = 0;
+    mrb_value mem, buf;
+    libssh2_uint64_t offset;
+    ssize_t rc;
+
+    mrb_get_args(mrb, "|H&", &opts, &block);
+
+    if (mrb_nil_p(block)) {
+        return mrb_funcall(mrb, self, "to_enum", 2, mrb_symbol_value(SYM("follow", 6)), mrb_nil_p(opts) ? mrb_hash_new(mrb) : opts);
+    }
+
+    if (mrb_hash_p(opts)) {
+        chomp        = mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("chomp", 5))));
+        interval     = mrb_sftp_opt_ms(mrb, opts, "interval", interval);
+        max_interval = mrb_sftp_opt_ms(mrb, opts, "max_interval", max_interval);
+        idle_limit   = mrb_sftp_opt_ms(mrb, opts, "idle", idle_limit);
+    }
+
+    mrb_sftp_flush(mrb, self);
+    mrb_iv_remove(mrb, self, SYM("eof", 3));
+
+    mem   = mrb_str_new_capa(mrb, MRB_SFTP_FOLLOW_CHUNK_SIZE);
+    delay = interval;
+
+    for (;;) {
+        handle = mrb_sftp_handle_bang(mrb, self);
+        offset = libssh2_sftp_tell64(handle);
+
+        if (drained) {
+            libssh2_sftp_seek64(handle, offset);
+        }
+
+        rc      = mrb_sftp_read(mrb, self, RSTRING_PTR(mem), MRB_SFTP_FOLLOW_CHUNK_SIZE);
+        drained = rc < MRB_SFTP_FOLLOW_CHUNK_SIZE;
+
+        if (rc < 0) {
+            mrb_sftp_raise_io_error(mrb, self, rc, "Failed to read from the SFTP handle.");
+        }
+
+        if (rc > 0) {
+            buf = mrb_iv_get(mrb, self, SYM("buf", 3));
+            buf = mrb_string_p(buf) ? mrb_str_cat(mrb, buf, RSTRING_PTR(mem), rc) : mrb_str_new(mrb, RSTRING_PTR(mem), rc);
+
+            mrb_iv_set(mrb, self, SYM("buf", 3), buf);
+            mrb_sftp_yield_lines(mrb, self, block, chomp, FALSE);
+
+            suspect = FALSE;
+            delay   = interval;
+            idle    = 0;
+            continue;
+        }
+
+        if (mrb_sftp_rotated(mrb, self, offset)) {
+            if (!suspect) {
+                suspect = TRUE;
+                continue;
+            }
+
+            mrb_sftp_yield_lines(mrb, self, block, chomp, TRUE);
+            mrb_funcall(mrb, self, "close", 0);
+            mrb_funcall(mrb, self, "open_file", 1, mrb_str_new_lit(mrb, "r"));
+
+            suspect = FALSE;
+            continue;
+        }
+
+        suspect = FALSE;
+
+        if (idle_limit >= 0 && idle >= idle_limit) {
+            mrb_sftp_yield_lines(mrb, self, block, chomp, TRUE);
+            break;
+        }
+
+        mrb_sftp_sleep(delay);
+
+        idle += delay;
+        delay = delay > 0 ? delay * 2 : 1;
+        delay = delay > max_interval ? max_interval : delay;
+    }
+
+    return mrb_nil_value();
+}
+
+static mrb_int
+mrb_sftp_take_buf (mrb_state *mrb, mrb_value self, char *mem, mrb_int len)
+{
+    mrb_value buf = mrb_attr_get(mrb, self, SYM("buf", 3));
+    mrb_int size;
+
+    if (!mrb_string_p(buf) || RSTRING_LEN(buf) == 0)
+        return 0;
+
+    size = RSTRING_LEN(buf) < len ? RSTRING_LEN(buf) : len;
+
+    memcpy(mem, RSTRING_PTR(buf), size);
+
+    if (size == RSTRING_LEN(buf)) {
+        mrb_iv_remove(mrb, self, SYM("buf", 3));
+    } else {
+        mrb_iv_set(mrb, self, SYM("buf", 3), mrb_str_substr(mrb, buf, size, RSTRING_LEN(buf) - size));
+    }
+
+    return size;
+}
+
+static mrb_int
+mrb_sftp_fill (mrb_state *mrb, mrb_value self, char *mem, mrb_int len)
+{
+    mrb_int filled = mrb_sftp_take_buf(mrb, self, mem, len);
+    ssize_t rc     = filled < len ? mrb_sftp_read(mrb, self, mem + filled, len - filled) : 0;
+
+    if (rc < 0) {
+        mrb_sftp_raise_io_error(mrb, self, rc, "Failed to read from the SFTP handle.");
+    }
+
+    return filled + rc;
+}
+
+static mrb_value
+mrb_sftp_next_chunk (mrb_state *mrb, mrb_sftp_chunk_t *ctx, mrb_int size)
+{
+    if (ctx->reuse && mrb_string_p(ctx->chunk)) {
+        mrb_str_modify(mrb, RSTRING(ctx->chunk));
+    } else {
+        mrb_gc_arena_restore(mrb, ctx->arena);
+        ctx->chunk = mrb_str_new_capa(mrb, size);
+    }
+
+    if (RSTRING_CAPA(ctx->chunk) < size) {
+        mrb_str_resize(mrb, ctx->chunk, size);
+    }
+
+    return ctx->chunk;
+}
+
+static void
+mrb_sftp_yield_chunk (mrb_state *mrb, mrb_sftp_chunk_t *ctx, mrb_int len)
+{
+    RSTR_SET_LEN(RSTRING(ctx->chunk), len);
+    RSTRING_PTR(ctx->chunk)[len] = '\0';
+
+    if (len > 0) {
+        mrb_yield(mrb, ctx->block, ctx->chunk);
+    }
+}
+
+static int
+mrb_sftp_yield_sink (mrb_state *mrb, void *ctx, const char *mem, size_t len)
+{
+    mrb_value chunk = mrb_sftp_next_chunk(mrb, (mrb_sftp_chunk_t *)ctx, len);
+
+    memcpy(RSTRING_PTR(chunk), mem, len);
+    mrb_sftp_yield_chunk(mrb, (mrb_sftp_chunk_t *)ctx, len);
+
+    return 0;
+}
+
+static mrb_value
+mrb_sftp_f_each_chunk (mrb_state *mrb, mrb_value self)
+{
+    mrb_int size     = MRB_SFTP_CHUNK_SIZE;
+    mrb_value opts   = mrb_nil_value();
+    mrb_value block  = mrb_nil_value();
+    mrb_value raw    = mrb_nil_value();
+    struct RData *transform;
+    mrb_sftp_chunk_t ctx;
+    mrb_int filled;
+    int err;
+
+    mrb_get_args(mrb, "|iH&", &size, &opts, &block);
+
+    if (mrb_nil_p(block)) {
+        return mrb_funcall(mrb, self, "to_enum", 3, mrb_symbol_value(SYM("each_chunk", 10)), mrb_fixnum_value(size), mrb_nil_p(opts) ? mrb_hash_new(mrb) : opts);
+    }
+
+    if (size <= 0) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Chunk size must be positive.");
+    }
+
+    ctx.block = block;
+    ctx.chunk = mrb_nil_value();
+    ctx.reuse = TRUE;
+
+    if (mrb_hash_p(opts) && mrb_hash_key_p(mrb, opts, mrb_symbol_value(SYM("reuse", 5)))) {
+        ctx.reuse = mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("reuse", 5))));
+    }
+
+    mrb_sftp_handle_bang(mrb, self);
+    mrb_sftp_flush(mrb, self);
+
+    if ((transform = mrb_sftp_transform(mrb, opts, size))) {
+        raw = mrb_str_new_capa(mrb, size);
+    }
+
+    ctx.arena = mrb_gc_arena_save(mrb);
+
+    if (transform) {
+        do {
+            filled = mrb_sftp_fill(mrb, self, RSTRING_PTR(raw), size);
+            err    = mrb_sftp_transform_push(mrb, transform, RSTRING_PTR(raw), filled, filled < size, mrb_sftp_yield_sink, &ctx);
+
+            if (err < 0) {
+                mrb_sftp_raise_transfer_error(mrb, self, err, "Failed to read from the SFTP handle.");
+            }
+        } while (filled == size);
+    } else {
+        do {
+            mrb_sftp_next_chunk(mrb, &ctx, size);
+            filled = mrb_sftp_fill(mrb, self, RSTRING_PTR(ctx.chunk), size);
+            mrb_sftp_yield_chunk(mrb, &ctx, filled);
+        } while (filled == size);
+    }
+
+    mrb_iv_set(mrb, self, SYM("eof", 3), mrb_true_value());
 
-    return mrb_fixnum_value(pos_after - pos_before);
+    return self;
 }
 
 void
@@ -161,7 +1136,14 @@ mrb_mruby_sftp_file_init (mrb_state *mrb)
     sup = mrb_class_get_under(mrb, ftp, "Handle");
     cls = mrb_define_class_under(mrb, ftp, "File", sup);
 
-    mrb_define_method(mrb, cls, "download", mrb_sftp_f_download, MRB_ARGS_REQ(1));
-    mrb_define_method(mrb, cls, "upload",   mrb_sftp_f_upload, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "download", mrb_sftp_f_download, MRB_ARGS_ARG(1,1));
+    mrb_define_method(mrb, cls, "upload",   mrb_sftp_f_upload, MRB_ARGS_ARG(1,1));
+    mrb_define_method(mrb, cls, "copy_to",  mrb_sftp_f_copy_to,   MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "copy_from",mrb_sftp_f_copy_from, MRB_ARGS_REQ(1));
     mrb_define_method(mrb, cls, "write",    mrb_sftp_f_write,  MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "flush",    mrb_sftp_f_flush,  MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "follow",   mrb_sftp_f_follow, MRB_ARGS_OPT(1)|MRB_ARGS_BLOCK());
+    mrb_define_method(mrb, cls, "each_chunk", mrb_sftp_f_each_chunk, MRB_ARGS_OPT(2)|MRB_ARGS_BLOCK());
+    mrb_define_method(mrb, cls, "buffer_size",  mrb_sftp_f_get_buffer_size, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "buffer_size=", mrb_sftp_f_set_buffer_size, MRB_ARGS_REQ(1));
 }
@@ -0,0 +1,232 @@
+/* MIT License
+ *
+ * Copyright (c) Sebastian Katzer 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "filter.h"
+
+#include "mruby.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+
+#include <string.h>
+
+#define SYM(name, len) mrb_intern_static(mrb, name, len)
+
+static mrb_value
+mrb_sftp_filter_opt (mrb_state *mrb, mrb_value opts, const char *key, size_t len)
+{
+    return mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_static(mrb, key, len)));
+}
+
+static libssh2_uint64_t
+mrb_sftp_filter_int (mrb_state *mrb, mrb_value val, libssh2_uint64_t def)
+{
+    if (mrb_nil_p(val))
+        return def;
+
+    if (!mrb_fixnum_p(val)) {
+        val = mrb_funcall(mrb, val, "to_i", 0);
+    }
+
+    return mrb_fixnum(val) < 0 ? 0 : (libssh2_uint64_t)mrb_fixnum(val);
+}
+
+static void
+mrb_sftp_filter_range (mrb_state *mrb, mrb_value val, libssh2_uint64_t *min, libssh2_uint64_t *max, libssh2_uint64_t limit)
+{
+    if (mrb_fixnum_p(val)) {
+        *min = *max = mrb_sftp_filter_int(mrb, val, 0);
+        return;
+    }
+
+    *min = mrb_sftp_filter_int(mrb, mrb_funcall(mrb, val, "begin", 0), 0);
+    *max = mrb_sftp_filter_int(mrb, mrb_funcall(mrb, val, "end", 0), limit);
+
+    if (*max != limit && *max > 0 && mrb_test(mrb_funcall(mrb, val, "exclude_end?", 0))) {
+        *max -= 1;
+    }
+}
+
+static unsigned long
+mrb_sftp_filter_type (mrb_state *mrb, mrb_value val)
+{
+    mrb_sym type;
+
+    if (mrb_nil_p(val))
+        return 0;
+
+    type = mrb_symbol_p(val) ? mrb_symbol(val) : 0;
+
+    if (type == SYM("file", 4))
+        return LIBSSH2_SFTP_S_IFREG;
+
+    if (type == SYM("directory", 9))
+        return LIBSSH2_SFTP_S_IFDIR;
+
+    if (type == SYM("symlink", 7))
+        return LIBSSH2_SFTP_S_IFLNK;
+
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "Unknown type filter, expected :file, :directory or :symlink.");
+
+    return 0;
+}
+
+static mrb_bool
+mrb_sftp_glob (const char *pat, const char *str, const char *end)
+{
+    const char *star = NULL, *back = NULL;
+    mrb_bool hit, neg;
+
+    while (str < end) {
+        switch (*pat) {
+        case '*':
+            star = ++pat;
+            back = str;
+            continue;
+        case '?':
+            pat++; str++;
+            continue;
+        case '[':
+            neg = pat[1] == '!' || pat[1] == '^';
+            hit = FALSE;
+
+            for (pat += neg ? 2 : 1; *pat && *pat != ']'; pat++) {
+                if (pat[1] == '-' && pat[2] && pat[2] != ']') {
+                    hit |= *str >= pat[0] && *str <= pat[2];
+                    pat += 2;
+                } else {
+                    hit |= *str == *pat;
+                }
+            }
+
+            if (*pat == ']' && hit != neg) {
+                pat++; str++;
+                continue;
+            }
+            break;
+        case '\\':
+            if (pat[1] && pat[1] == *str) {
+                pat += 2; str++;
+                continue;
+            }
+            break;
+        case '\0':
+            break;
+        default:
+            if (*pat == *str) {
+                pat++; str++;
+                continue;
+            }
+        }
+
+        if (!star)
+            return FALSE;
+
+        pat = star;
+        str = ++back;
+    }
+
+    while (*pat == '*') pat++;
+
+    return *pat == '\0';
+}
+
+mrb_sftp_filter_t *
+mrb_sftp_filter_new (mrb_state *mrb, mrb_value opts)
+{
+    mrb_value match = mrb_sftp_filter_opt(mrb, opts, "match", 5);
+    mrb_value size  = mrb_sftp_filter_opt(mrb, opts, "size", 4);
+    mrb_value mtime = mrb_sftp_filter_opt(mrb, opts, "mtime", 5);
+    mrb_sftp_filter_t filter, *ptr;
+    libssh2_uint64_t min, max;
+
+    memset(&filter, 0, sizeof(mrb_sftp_filter_t));
+
+    filter.type = mrb_sftp_filter_type(mrb, mrb_sftp_filter_opt(mrb, opts, "type", 4));
+
+    if (!mrb_nil_p(match)) {
+        match = mrb_str_to_str(mrb, match);
+    }
+
+    if ((filter.size = !mrb_nil_p(size))) {
+        mrb_sftp_filter_range(mrb, size, &filter.min_size, &filter.max_size, (libssh2_uint64_t)-1);
+    }
+
+    if ((filter.mtime = !mrb_nil_p(mtime))) {
+        mrb_sftp_filter_range(mrb, mtime, &min, &max, (unsigned long)-1);
+        filter.min_mtime = (unsigned long)min;
+        filter.max_mtime = (unsigned long)max;
+    }
+
+    ptr = mrb_malloc(mrb, sizeof(mrb_sftp_filter_t));
+    *ptr = filter;
+
+    if (!mrb_nil_p(match)) {
+        ptr->match = mrb_malloc(mrb, RSTRING_LEN(match) + 1);
+        memcpy(ptr->match, RSTRING_PTR(match), RSTRING_LEN(match));
+        ptr->match[RSTRING_LEN(match)] = '\0';
+    }
+
+    return ptr;
+}
+
+void
+mrb_sftp_filter_free (mrb_state *mrb, mrb_sftp_filter_t *filter)
+{
+    if (!filter) return;
+
+    mrb_free(mrb, filter->match);
+    mrb_free(mrb, filter);
+}
+
+mrb_bool
+mrb_sftp_filter_match (mrb_sftp_filter_t *filter, const char *name, size_t len, LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    if (filter->type) {
+        if (!(attrs->flags & LIBSSH2_SFTP_ATTR_PERMISSIONS))
+            return FALSE;
+
+        if ((attrs->permissions & LIBSSH2_SFTP_S_IFMT) != filter->type)
+            return FALSE;
+    }
+
+    if (filter->size) {
+        if (!(attrs->flags & LIBSSH2_SFTP_ATTR_SIZE))
+            return FALSE;
+
+        if (attrs->filesize < filter->min_size || attrs->filesize > filter->max_size)
+            return FALSE;
+    }
+
+    if (filter->mtime) {
+        if (!(attrs->flags & LIBSSH2_SFTP_ATTR_ACMODTIME))
+            return FALSE;
+
+        if (attrs->mtime < filter->min_mtime || attrs->mtime > filter->max_mtime)
+            return FALSE;
+    }
+
+    if (filter->match && !mrb_sftp_glob(filter->match, name, name + len))
+        return FALSE;
+
+    return TRUE;
+}
\ No newline at end of file
@@ -0,0 +1,45 @@
+/* MIT License
+ *
+ * Copyright (c) Sebastian Katzer 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "mruby.h"
+#include <libssh2_sftp.h>
+
+MRB_BEGIN_DECL
+
+typedef struct mrb_sftp_filter
+{
+    char *match;
+    unsigned long type;
+    libssh2_uint64_t min_size;
+    libssh2_uint64_t max_size;
+    unsigned long min_mtime;
+    unsigned long max_mtime;
+    mrb_bool size;
+    mrb_bool mtime;
+} mrb_sftp_filter_t;
+
+mrb_sftp_filter_t *mrb_sftp_filter_new (mrb_state *mrb, mrb_value opts);
+void mrb_sftp_filter_free (mrb_state *mrb, mrb_sftp_filter_t *filter);
+mrb_bool mrb_sftp_filter_match (mrb_sftp_filter_t *filter, const char *name, size_t len, LIBSSH2_SFTP_ATTRIBUTES *attrs);
+
+MRB_END_DECL
\ No newline at end of file
@@ -22,22 +22,38 @@
  */
 
 #include "stat.h"
+#include "filter.h"
 #include "handle.h"
+#include "pipeline.h"
+#include "transfer.h"
 
 #include "mruby.h"
 #include "mruby/data.h"
+#include "mruby/error.h"
 #include "mruby/hash.h"
+#include "mruby/array.h"
 #include "mruby/class.h"
 #include "mruby/string.h"
 #include "mruby/version.h"
 #include "mruby/variable.h"
 #include "mruby/ext/sftp.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <libssh2_sftp.h>
 
 #define SYM(name, len) mrb_intern_static(mrb, name, len)
 
+#define MRB_SFTP_SHORT_WRITE -1000
+
+#ifndef MRB_SFTP_RANGES_CHUNK_SIZE
+# define MRB_SFTP_RANGES_CHUNK_SIZE 32768
+#endif
+
+#ifndef MRB_SFTP_RANGES_WINDOW
+# define MRB_SFTP_RANGES_WINDOW 64
+#endif
+
 #if MRUBY_RELEASE_NO < 10400
 static inline mrb_int
 mrb_str_index(mrb_state *mrb, mrb_value str, const char *lit, mrb_int len, mrb_int off)
@@ -47,6 +63,102 @@ mrb_str_index(mrb_state *mrb, mrb_value str, const char *lit, mrb_int len, mrb_i
 }
 #endif
 
+typedef struct mrb_sftp_range
+{
+    mrb_int offset;
+    mrb_int len;
+    mrb_int index;
+} mrb_sftp_range_t;
+
+typedef struct mrb_sftp_span
+{
+    mrb_int first;
+    mrb_int count;
+    uint64_t start;
+    uint64_t avail;
+    char *buf;
+    size_t capa;
+    int pending;
+} mrb_sftp_span_t;
+
+typedef struct mrb_sftp_span_req
+{
+    uint32_t id;
+    mrb_int span;
+    uint64_t off;
+    uint32_t len;
+} mrb_sftp_span_req_t;
+
+typedef struct mrb_sftp_ranges
+{
+    mrb_value self;
+    mrb_value session;
+    mrb_value path;
+    mrb_value res;
+    mrb_value block;
+    mrb_sftp_pipe_t *pipe;
+    mrb_sftp_range_t *items;
+    mrb_int len;
+    mrb_int gap;
+    mrb_sftp_span_t *spans;
+    mrb_int spans_len;
+    mrb_int *ready;
+    mrb_int ready_head;
+    mrb_int ready_len;
+    mrb_int cur;
+    uint64_t next;
+    mrb_sftp_span_req_t reqs[MRB_SFTP_RANGES_WINDOW];
+    int pending;
+    char handle[256];
+    uint32_t handle_len;
+    int err;
+    mrb_bool open;
+    mrb_bool healthy;
+    mrb_bool done;
+} mrb_sftp_ranges_t;
+
+static ssize_t
+mrb_sftp_write_mem (mrb_value session, LIBSSH2_SFTP_HANDLE *handle, const char *mem, size_t len)
+{
+    size_t total = 0;
+    ssize_t rc;
+
+    while (total < len) {
+        while ((rc = libssh2_sftp_write(handle, mem + total, len - total)) == LIBSSH2SFTP_EAGAIN) {
+            if ((rc = mrb_sftp_poll(session)) < 0) return rc;
+        }
+
+        if (rc < 0) return rc;
+        if (rc == 0) break;
+
+        total += rc;
+    }
+
+    return total;
+}
+
+static inline mrb_bool
+mrb_sftp_handle_usable (mrb_sftp_handle_t *data)
+{
+    mrb_sftp_t *sftp = data->session->data;
+    return data->handle && sftp && !sftp->transfer && mrb_ssh_initialized();
+}
+
+static ssize_t
+mrb_sftp_handle_flush (mrb_sftp_handle_t *data)
+{
+    size_t len = data->wlen;
+    ssize_t rc;
+
+    if (!(len > 0 && mrb_sftp_handle_usable(data)))
+        return 0;
+
+    rc = mrb_sftp_write_mem(mrb_obj_value(data->session), data->handle, data->wbuf, len);
+    data->wlen = 0;
+
+    return (rc >= 0 && (size_t)rc < len) ? MRB_SFTP_SHORT_WRITE : rc;
+}
+
 static void
 mrb_sftp_handle_free (mrb_state *mrb, void *p)
 {
@@ -56,10 +168,18 @@ mrb_sftp_handle_free (mrb_state *mrb, void *p)
 
     data = (mrb_sftp_handle_t *)p;
 
-    if (data->handle && data->session->data && mrb_ssh_initialized()) {
+    if (mrb_sftp_handle_usable(data)) {
         libssh2_sftp_close_handle(data->handle);
+    } else
+    if (data->handle && data->session->data) {
+        mrb_sftp_transfer_defer(data->session->data, data->handle);
+    }
+
+    if (data->wbuf) {
+        mrb_free(mrb, data->wbuf);
     }
 
+    mrb_sftp_filter_free(mrb, data->filter);
     mrb_free(mrb, data);
 }
 
@@ -84,6 +204,7 @@ mrb_sftp_handle_bang (mrb_state *mrb, mrb_value self)
 {
     LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle(mrb, self);
     mrb_sftp_raise_unless_opened(mrb, handle);
+    mrb_sftp_raise_if_busy(mrb, mrb_obj_value(((mrb_sftp_handle_t *)DATA_PTR(self))->session));
     return handle;
 }
 
@@ -128,6 +249,8 @@ mrb_sftp_open (mrb_state *mrb, mrb_value self, long flags, long mode, int type)
         mrb_raise(mrb, E_SFTP_NOT_CONNECTED_ERROR, "SFTP session not connected.");
     }
 
+    mrb_sftp_raise_if_busy(mrb, session);
+
     do {
         handle = libssh2_sftp_open_ex(sftp, path, len, flags, mode, type);
 
@@ -137,7 +260,7 @@ mrb_sftp_open (mrb_state *mrb, mrb_value self, long flags, long mode, int type)
 
         if (err == LIBSSH2SFTP_EAGAIN)
         {
-            mrb_ssh_wait_sock(ssh);
+            mrb_sftp_wait(mrb, session);
         }
         else if (err == LIBSSH2_ERROR_SFTP_PROTOCOL)
         {
@@ -152,27 +275,107 @@ mrb_sftp_open (mrb_state *mrb, mrb_value self, long flags, long mode, int type)
     data          = mrb_malloc(mrb, sizeof(mrb_sftp_handle_t));
     data->session = mrb_ptr(session);
     data->handle  = handle;
+    data->wbuf    = NULL;
+    data->wlen    = 0;
+    data->wsize   = MRB_SFTP_WRITE_BUFFER_SIZE;
+    data->filter  = NULL;
 
     mrb_data_init(self, data, &mrb_sftp_handle_type);
 
     mrb_iv_set(mrb, self, SYM("type", 4), mrb_fixnum_value(type));
 }
 
-static mrb_value
-mrb_sftp_f_gets_dir (mrb_state *mrb, mrb_value self)
+void
+mrb_sftp_raise_io_error (mrb_state *mrb, mrb_value self, int err, const char *msg)
+{
+    mrb_value session = mrb_attr_get(mrb, self, SYM("@session", 8));
+
+    if (err == LIBSSH2_ERROR_SFTP_PROTOCOL) {
+        mrb_sftp_raise_last_error(mrb, mrb_sftp_session(session), msg);
+    }
+
+    if (err == LIBSSH2_ERROR_TIMEOUT) {
+        mrb_sftp_raise(mrb, err, "SFTP operation timed out.");
+    }
+
+    mrb_ssh_raise_last_error(mrb, mrb_sftp_ssh_session(session));
+}
+
+ssize_t
+mrb_sftp_write (mrb_state *mrb, mrb_value self, const char *mem, size_t len)
+{
+    mrb_value session           = mrb_attr_get(mrb, self, SYM("@session", 8));
+    LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
+
+    return mrb_sftp_write_mem(session, handle, mem, len);
+}
+
+void
+mrb_sftp_flush (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_handle_t *data = DATA_PTR(self);
+    ssize_t rc;
+
+    if (!data || data->wlen == 0) return;
+
+    if ((rc = mrb_sftp_handle_flush(data)) == MRB_SFTP_SHORT_WRITE) {
+        mrb_sftp_raise(mrb, LIBSSH2_FX_FAILURE, "Failed to write to the SFTP handle.");
+    }
+
+    if (rc < 0) {
+        mrb_sftp_raise_io_error(mrb, self, rc, "Failed to write to the SFTP handle.");
+    }
+}
+
+ssize_t
+mrb_sftp_read (mrb_state *mrb, mrb_value self, char *mem, size_t len)
+{
+    mrb_value session           = mrb_attr_get(mrb, self, SYM("@session", 8));
+    LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
+    size_t total                = 0;
+    ssize_t rc;
+
+    while (total < len) {
+        while ((rc = libssh2_sftp_read(handle, mem + total, len - total)) == LIBSSH2SFTP_EAGAIN) {
+            if ((rc = mrb_sftp_poll(session)) < 0) break;
+        }
+
+        if (rc < 0) return total > 0 ? (ssize_t)total : rc;
+        if (rc == 0) break;
+
+        total += rc;
+    }
+
+    return total;
+}
+
+int
+mrb_sftp_readdir (mrb_state *mrb, mrb_value self, char *name, size_t name_len, char *longname, size_t longname_len, LIBSSH2_SFTP_ATTRIBUTES *attrs)
 {
     mrb_value session           = mrb_attr_get(mrb, self, SYM("@session", 8));
-    mrb_ssh_t *ssh              = mrb_sftp_ssh_session(session);
     LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
-    struct RClass *cls          = mrb_class_get_under(mrb, mrb_module_get(mrb, "SFTP"), "Entry");
+    int rc;
+
+    while ((rc = libssh2_sftp_readdir_ex(handle, name, name_len, longname, longname_len, attrs)) == LIBSSH2SFTP_EAGAIN) {
+        if ((rc = mrb_sftp_poll(session)) < 0) break;
+    }
+
+    return rc;
+}
+
+static mrb_value
+mrb_sftp_f_gets_dir (mrb_state *mrb, mrb_value self)
+{
+    struct RClass *cls      = mrb_class_get_under(mrb, mrb_module_get(mrb, "SFTP"), "Entry");
+    mrb_sftp_handle_t *data = DATA_PTR(self);
     LIBSSH2_SFTP_ATTRIBUTES attrs;
     char entry[256], longentry[512];
     mrb_value args[3];
     int rc;
 
-    while ((rc = libssh2_sftp_readdir_ex(handle, entry, 256, longentry, 512, &attrs)) == LIBSSH2SFTP_EAGAIN) {
-        mrb_ssh_wait_sock(ssh);
-    }
+    do {
+        rc = mrb_sftp_readdir(mrb, self, entry, 256, longentry, 512, &attrs);
+    } while (rc > 0 && data->filter && !mrb_sftp_filter_match(data->filter, entry, rc, &attrs));
 
     if (rc <= 0)
         return mrb_nil_value();
@@ -184,11 +387,30 @@ mrb_sftp_f_gets_dir (mrb_state *mrb, mrb_value self)
     return mrb_obj_new(mrb, cls, 3, args);
 }
 
+static mrb_value
+mrb_sftp_f_filter (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_handle_t *data;
+    mrb_sftp_filter_t *filter;
+    mrb_value opts;
+
+    mrb_get_args(mrb, "H", &opts);
+
+    mrb_sftp_handle_bang(mrb, self);
+
+    filter = mrb_sftp_filter_new(mrb, opts);
+    data   = DATA_PTR(self);
+
+    mrb_sftp_filter_free(mrb, data->filter);
+    data->filter = filter;
+
+    return mrb_nil_value();
+}
+
 static mrb_value
 mrb_sftp_f_gets_file (mrb_state *mrb, mrb_value self)
 {
     mrb_value session           = mrb_attr_get(mrb, self, SYM("@session", 8));
-    mrb_ssh_t *ssh              = mrb_sftp_ssh_session(session);
     LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
     mrb_value buf               = mrb_attr_get(mrb, self, SYM("buf", 3));
     mrb_bool arg_given          = FALSE;
@@ -204,6 +426,8 @@ mrb_sftp_f_gets_file (mrb_state *mrb, mrb_value self)
 
     mrb_get_args(mrb, "|o?H!?", &arg, &arg_given, &opts, &opts_given);
 
+    mrb_sftp_flush(mrb, self);
+
     if (opts_given && mrb_hash_p(opts)) {
         chomp = mrb_type(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("chomp", 5)))) == MRB_TT_TRUE;
     }
@@ -248,9 +472,15 @@ mrb_sftp_f_gets_file (mrb_state *mrb, mrb_value self)
   read:
 
     while ((rc = libssh2_sftp_read(handle, mem, mem_size)) == LIBSSH2SFTP_EAGAIN) {
-        mrb_ssh_wait_sock(ssh);
+        if ((rc = mrb_sftp_poll(session)) < 0) break;
     };
 
+    if (rc == LIBSSH2_ERROR_TIMEOUT) {
+        mrb_iv_set(mrb, self, SYM("buf", 3), buf);
+        mrb_free(mrb, mem);
+        mrb_sftp_raise(mrb, rc, "SFTP operation timed out.");
+    }
+
     if (rc <= 0) {
         mrb_iv_set(mrb, self, SYM("eof", 3), mrb_true_value());
         mrb_iv_remove(mrb, self, SYM("buf", 3));
@@ -348,10 +578,11 @@ static mrb_value
 mrb_sftp_f_pos (mrb_state *mrb, mrb_value self)
 {
     LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
+    mrb_sftp_handle_t *data     = DATA_PTR(self);
     mrb_value buf               = mrb_attr_get(mrb, self, SYM("buf", 3));
     libssh2_uint64_t pos;
 
-    pos = libssh2_sftp_tell64(handle);
+    pos = libssh2_sftp_tell64(handle) + data->wlen;
 
     if (mrb_test(buf)) {
         pos -= RSTRING_LEN(buf);
@@ -364,17 +595,22 @@ static mrb_value
 mrb_sftp_f_seek (mrb_state *mrb, mrb_value self)
 {
     LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
+    mrb_value session           = mrb_attr_get(mrb, self, SYM("@session", 8));
     mrb_int offset              = 0;
     mrb_sym whence              = SYM("SET", 3);
     LIBSSH2_SFTP_ATTRIBUTES attrs;
 
     mrb_get_args(mrb, "i|n", &offset, &whence);
 
+    mrb_sftp_flush(mrb, self);
+
     if (whence == SYM("CUR", 3)) {
         offset += libssh2_sftp_tell64(handle);
     } else
     if (whence == SYM("END", 3)) {
-        while (libssh2_sftp_fstat(handle, &attrs) == LIBSSH2SFTP_EAGAIN);
+        while (libssh2_sftp_fstat(handle, &attrs) == LIBSSH2SFTP_EAGAIN) {
+            mrb_sftp_wait(mrb, session);
+        }
         offset += attrs.filesize;
     } else
     if (whence != SYM("SET", 3)) {
@@ -393,6 +629,383 @@ mrb_sftp_f_seek (mrb_state *mrb, mrb_value self)
     return mrb_fixnum_value(libssh2_sftp_tell64(handle));
 }
 
+static mrb_value
+mrb_sftp_f_pread (mrb_state *mrb, mrb_value self)
+{
+    LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
+    mrb_value outbuf            = mrb_nil_value();
+    mrb_int offset, len;
+    libssh2_uint64_t pos;
+    ssize_t rc;
+
+    mrb_get_args(mrb, "ii|S!", &offset, &len, &outbuf);
+
+    if (offset < 0 || len < 0) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Negative offset or length.");
+    }
+
+    mrb_sftp_flush(mrb, self);
+
+    if (mrb_nil_p(outbuf)) {
+        outbuf = mrb_str_new_capa(mrb, len);
+    } else {
+        mrb_str_modify(mrb, RSTRING(outbuf));
+    }
+
+    if (RSTRING_CAPA(outbuf) < len) {
+        mrb_str_resize(mrb, outbuf, len);
+    }
+
+    pos = libssh2_sftp_tell64(handle);
+
+    libssh2_sftp_seek64(handle, offset);
+    rc = mrb_sftp_read(mrb, self, RSTRING_PTR(outbuf), len);
+    libssh2_sftp_seek64(handle, pos);
+
+    if (rc < 0) {
+        mrb_sftp_raise_io_error(mrb, self, rc, "Failed to read from the SFTP handle.");
+    }
+
+    RSTR_SET_LEN(RSTRING(outbuf), rc);
+    RSTRING_PTR(outbuf)[rc] = '\0';
+
+    if (rc == 0 && len > 0)
+        return mrb_nil_value();
+
+    return outbuf;
+}
+
+static int
+mrb_sftp_range_cmp (const void *a, const void *b)
+{
+    const mrb_sftp_range_t *x = a, *y = b;
+
+    if (x->offset == y->offset) return 0;
+
+    return x->offset < y->offset ? -1 : 1;
+}
+
+static void
+mrb_sftp_ranges_read (mrb_state *mrb, mrb_sftp_pipe_t *pipe, mrb_sftp_ranges_t *r, mrb_int idx, uint64_t off, uint32_t len)
+{
+    mrb_sftp_span_req_t *req = &r->reqs[r->pending++];
+
+    req->id   = mrb_sftp_pipe_begin(mrb, pipe, SSH_FXP_READ);
+    req->span = idx;
+    req->off  = off;
+    req->len  = len;
+
+    mrb_sftp_pipe_put_str(mrb, pipe, r->handle, r->handle_len);
+    mrb_sftp_pipe_put_u64(mrb, pipe, off);
+    mrb_sftp_pipe_put_u32(mrb, pipe, len);
+    mrb_sftp_pipe_end(mrb, pipe);
+
+    r->spans[idx].pending++;
+}
+
+static void
+mrb_sftp_ranges_fill (mrb_state *mrb, mrb_sftp_pipe_t *pipe, mrb_sftp_ranges_t *r)
+{
+    mrb_sftp_span_t *span;
+    uint64_t len;
+
+    while (!r->err && r->pending < MRB_SFTP_RANGES_WINDOW && r->cur < r->spans_len) {
+        span = &r->spans[r->cur];
+
+        if (r->next >= span->avail) {
+            if (span->pending == 0) {
+                r->ready[r->ready_len++] = r->cur;
+            }
+
+            if (++r->cur < r->spans_len) {
+                r->next = r->spans[r->cur].start;
+            }
+
+            continue;
+        }
+
+        len = span->avail - r->next;
+        len = len > MRB_SFTP_RANGES_CHUNK_SIZE ? MRB_SFTP_RANGES_CHUNK_SIZE : len;
+
+        mrb_sftp_ranges_read(mrb, pipe, r, r->cur, r->next, (uint32_t)len);
+
+        r->next += len;
+    }
+}
+
+static void
+mrb_sftp_ranges_data (mrb_state *mrb, mrb_sftp_pipe_t *pipe, mrb_sftp_ranges_t *r, mrb_sftp_span_req_t *req, mrb_sftp_reply_t *reply)
+{
+    mrb_sftp_span_t *span = &r->spans[req->span];
+    const char *data;
+    uint64_t need;
+    uint32_t len;
+    size_t capa;
+    int err;
+
+    if (reply->type != SSH_FXP_DATA) {
+        if ((err = mrb_sftp_reply_status(reply, NULL, NULL)) != (int)LIBSSH2_FX_EOF) {
+            r->err = r->err ? r->err : err;
+        } else if (req->off < span->avail) {
+            span->avail = req->off;
+        }
+        return;
+    }
+
+    if (!mrb_sftp_reply_str(reply, &data, &len) || len > req->len) {
+        r->err = r->err ? r->err : (int)LIBSSH2_FX_BAD_MESSAGE;
+        return;
+    }
+
+    if (len == 0) {
+        span->avail = req->off < span->avail ? req->off : span->avail;
+        return;
+    }
+
+    if ((need = req->off + len - span->start) > span->capa) {
+        capa       = span->capa * 2 > need ? span->capa * 2 : (size_t)need;
+        capa       = capa > span->avail - span->start ? (size_t)(span->avail - span->start) : capa;
+        span->buf  = mrb_realloc(mrb, span->buf, capa);
+        span->capa = capa;
+    }
+
+    memcpy(span->buf + (req->off - span->start), data, len);
+
+    if (len < req->len && req->off + len < span->avail) {
+        mrb_sftp_ranges_read(mrb, pipe, r, req->span, req->off + len, req->len - len);
+    }
+}
+
+static void
+mrb_sftp_ranges_emit (mrb_state *mrb, mrb_sftp_ranges_t *r)
+{
+    mrb_sftp_span_t *span;
+    mrb_sftp_range_t *item;
+    mrb_value str, args[2];
+    mrb_int k, start, avail;
+    int arena;
+
+    while (r->ready_head < r->ready_len) {
+        span  = &r->spans[r->ready[r->ready_head++]];
+        avail = (mrb_int)(span->avail - span->start);
+
+        for (k = span->first; k < span->first + span->count; k++) {
+            arena = mrb_gc_arena_save(mrb);
+            item  = &r->items[k];
+            start = item->offset - (mrb_int)span->start;
+            str   = mrb_nil_value();
+
+            if (!r->err && start < avail && item->len > 0) {
+                str = mrb_str_new(mrb, span->buf + start, start + item->len > avail ? avail - start : item->len);
+            }
+
+            mrb_ary_set(mrb, r->res, item->index, str);
+
+            if (!r->err && mrb_test(r->block)) {
+                args[0]    = str;
+                args[1]    = mrb_fixnum_value(item->index);
+                r->healthy = TRUE;
+                mrb_yield_argv(mrb, r->block, 2, args);
+                r->healthy = FALSE;
+
+                if (!(mrb_sftp_ssh_session(r->session) && mrb_ssh_initialized())) {
+                    mrb_raise(mrb, E_SFTP_NOT_CONNECTED_ERROR, "SFTP session not connected.");
+                }
+            }
+
+            mrb_gc_arena_restore(mrb, arena);
+        }
+
+        mrb_free(mrb, span->buf);
+        span->buf = NULL;
+    }
+}
+
+static void
+mrb_sftp_ranges_step (mrb_state *mrb, mrb_sftp_pipe_t *pipe, void *ctx, mrb_int idx, mrb_sftp_reply_t *reply)
+{
+    mrb_sftp_ranges_t *r = (mrb_sftp_ranges_t *)ctx;
+    mrb_sftp_span_req_t req;
+    const char *str;
+    uint32_t len;
+    int i;
+
+    if (!reply) {
+        mrb_sftp_pipe_begin(mrb, pipe, SSH_FXP_OPEN);
+        mrb_sftp_pipe_put_str(mrb, pipe, RSTRING_PTR(r->path), RSTRING_LEN(r->path));
+        mrb_sftp_pipe_put_u32(mrb, pipe, LIBSSH2_FXF_READ);
+        mrb_sftp_pipe_put_attrs(mrb, pipe, NULL);
+        mrb_sftp_pipe_end(mrb, pipe);
+        return;
+    }
+
+    if (r->handle_len == 0) {
+        if (!(reply->type == SSH_FXP_HANDLE && mrb_sftp_reply_str(reply, &str, &len) && len > 0 && len <= sizeof(r->handle))) {
+            r->err  = mrb_sftp_reply_status(reply, NULL, NULL);
+            r->open = FALSE;
+            return;
+        }
+
+        memcpy(r->handle, str, len);
+        r->handle_len = len;
+    } else {
+        for (i = 0; i < r->pending && r->reqs[i].id != reply->id; i++);
+
+        if (i == r->pending) return;
+
+        req        = r->reqs[i];
+        r->reqs[i] = r->reqs[--r->pending];
+
+        mrb_sftp_ranges_data(mrb, pipe, r, &req, reply);
+
+        if (--r->spans[req.span].pending == 0 && req.span < r->cur) {
+            r->ready[r->ready_len++] = req.span;
+        }
+    }
+
+    mrb_sftp_ranges_fill(mrb, pipe, r);
+    mrb_sftp_pipe_flush(mrb, r->session, pipe);
+    mrb_sftp_ranges_emit(mrb, r);
+}
+
+static mrb_value
+mrb_sftp_ranges_run (mrb_state *mrb, mrb_value ctx)
+{
+    mrb_sftp_ranges_t *r = mrb_cptr(ctx);
+    mrb_sftp_span_t *span;
+    mrb_int i, j;
+    uint64_t last;
+
+    r->spans = mrb_calloc(mrb, r->len, sizeof(mrb_sftp_span_t));
+    r->ready = mrb_calloc(mrb, r->len, sizeof(mrb_int));
+
+    for (i = 0; i < r->len; i = j) {
+        last = (uint64_t)(r->items[i].offset + r->items[i].len);
+
+        for (j = i + 1; j < r->len && (uint64_t)r->items[j].offset <= last + r->gap; j++) {
+            if ((uint64_t)(r->items[j].offset + r->items[j].len) > last) {
+                last = (uint64_t)(r->items[j].offset + r->items[j].len);
+            }
+        }
+
+        span        = &r->spans[r->spans_len++];
+        span->first = i;
+        span->count = j - i;
+        span->start = (uint64_t)r->items[i].offset;
+        span->avail = last;
+    }
+
+    r->next = r->spans[0].start;
+    r->pipe = mrb_sftp_pipe_take(mrb, r->session);
+
+    mrb_sftp_pipe_loop(mrb, r->session, r->pipe, 1, NULL, 0, mrb_sftp_ranges_step, r);
+
+    if (r->handle_len > 0) {
+        mrb_sftp_pipe_begin(mrb, r->pipe, SSH_FXP_CLOSE);
+        mrb_sftp_pipe_put_str(mrb, r->pipe, r->handle, r->handle_len);
+        mrb_sftp_pipe_end(mrb, r->pipe);
+        mrb_sftp_pipe_flush(mrb, r->session, r->pipe);
+    }
+
+    r->done = TRUE;
+
+    return r->res;
+}
+
+static mrb_value
+mrb_sftp_ranges_cleanup (mrb_state *mrb, mrb_value ctx)
+{
+    mrb_sftp_ranges_t *r = mrb_cptr(ctx);
+    mrb_int i;
+
+    if (r->done) {
+        mrb_sftp_pipe_give(mrb, r->session, r->pipe);
+    } else {
+        mrb_sftp_pipe_free(mrb, r->healthy ? mrb_sftp_ssh_session(r->session) : NULL, r->pipe);
+    }
+
+    for (i = 0; r->spans && i < r->spans_len; i++) {
+        mrb_free(mrb, r->spans[i].buf);
+    }
+
+    mrb_free(mrb, r->spans);
+    mrb_free(mrb, r->ready);
+
+    return mrb_nil_value();
+}
+
+static mrb_value
+mrb_sftp_f_read_ranges (mrb_state *mrb, mrb_value self)
+{
+    mrb_value ranges, opts = mrb_nil_value();
+    mrb_value block        = mrb_nil_value();
+    mrb_int gap            = 0;
+    mrb_value mem, item;
+    mrb_sftp_ranges_t r;
+    mrb_int i, len;
+
+    mrb_get_args(mrb, "A|H&", &ranges, &opts, &block);
+
+    mrb_sftp_handle_bang(mrb, self);
+    mrb_sftp_flush(mrb, self);
+
+    if (mrb_hash_p(opts) && mrb_test(item = mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("gap", 3))))) {
+        gap = mrb_fixnum(mrb_Integer(mrb, item));
+    }
+
+    if (gap < 0) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Negative gap.");
+    }
+
+    memset(&r, 0, sizeof(mrb_sftp_ranges_t));
+
+    len     = RARRAY_LEN(ranges);
+    r.self  = self;
+    r.block = block;
+    r.res   = mrb_ary_new_capa(mrb, len);
+    mem     = mrb_str_new_capa(mrb, len * sizeof(mrb_sftp_range_t));
+    r.items = (mrb_sftp_range_t *)RSTRING_PTR(mem);
+
+    for (i = 0; i < len; i++) {
+        item = mrb_ary_ref(mrb, ranges, i);
+
+        if (!mrb_array_p(item) || RARRAY_LEN(item) != 2) {
+            mrb_raise(mrb, E_TYPE_ERROR, "Array of [offset, length] pairs expected.");
+        }
+
+        r.items[i].offset = mrb_fixnum(mrb_Integer(mrb, mrb_ary_ref(mrb, item, 0)));
+        r.items[i].len    = mrb_fixnum(mrb_Integer(mrb, mrb_ary_ref(mrb, item, 1)));
+        r.items[i].index  = i;
+
+        if (r.items[i].offset < 0 || r.items[i].len < 0) {
+            mrb_raise(mrb, E_ARGUMENT_ERROR, "Negative offset or length.");
+        }
+
+        mrb_ary_set(mrb, r.res, i, mrb_nil_value());
+    }
+
+    if (len == 0)
+        return r.res;
+
+    qsort(r.items, len, sizeof(mrb_sftp_range_t), mrb_sftp_range_cmp);
+
+    r.session = mrb_attr_get(mrb, self, SYM("@session", 8));
+    r.path    = mrb_iv_get(mrb, self, SYM("@path", 5));
+    r.len     = len;
+    r.gap     = gap;
+    r.open    = TRUE;
+
+    mrb_ensure(mrb, mrb_sftp_ranges_run, mrb_cptr_value(mrb, &r), mrb_sftp_ranges_cleanup, mrb_cptr_value(mrb, &r));
+
+    if (!r.open) {
+        mrb_sftp_raise(mrb, r.err ? r.err : (int)LIBSSH2_FX_FAILURE, "Failed to open the SFTP handle.");
+    }
+
+    mrb_sftp_raise(mrb, r.err, "Failed to read from the SFTP handle.");
+
+    return r.res;
+}
+
 static mrb_value
 mrb_sftp_f_gets (mrb_state *mrb, mrb_value self)
 {
@@ -418,17 +1031,17 @@ static mrb_value
 mrb_sftp_f_sync (mrb_state *mrb, mrb_value self)
 {
     LIBSSH2_SFTP_HANDLE *handle = mrb_sftp_handle_bang(mrb, self);
-    LIBSSH2_SFTP *sftp;
-    mrb_value session;
+    mrb_value session           = mrb_attr_get(mrb, self, SYM("@session", 8));
     int ret;
 
-    while ((ret = libssh2_sftp_fsync(handle)) == LIBSSH2SFTP_EAGAIN);
+    mrb_sftp_flush(mrb, self);
 
-    if (ret != 0) {
-        session = mrb_attr_get(mrb, self, SYM("@session", 8));
-        sftp    = mrb_sftp_session(session);
+    while ((ret = libssh2_sftp_fsync(handle)) == LIBSSH2SFTP_EAGAIN) {
+        mrb_sftp_wait(mrb, session);
+    }
 
-        mrb_sftp_raise_last_error(mrb, sftp, "Cannot sync the SFTP handle.");
+    if (ret != 0) {
+        mrb_sftp_raise_last_error(mrb, mrb_sftp_session(session), "Cannot sync the SFTP handle.");
     }
 
     mrb_iv_remove(mrb, self, SYM("eof", 3));
@@ -440,7 +1053,27 @@ mrb_sftp_f_sync (mrb_state *mrb, mrb_value self)
 static mrb_value
 mrb_sftp_f_close (mrb_state *mrb, mrb_value self)
 {
-    mrb_sftp_handle_free(mrb, DATA_PTR(self));
+    mrb_sftp_handle_t *data = DATA_PTR(self);
+    int err                 = LIBSSH2_FX_OK;
+    ssize_t rc              = 0;
+
+    if (data) {
+        mrb_sftp_raise_if_busy(mrb, mrb_obj_value(data->session));
+        rc = mrb_sftp_handle_flush(data);
+    }
+
+    if (rc == LIBSSH2_ERROR_TIMEOUT) {
+        err = LIBSSH2_ERROR_TIMEOUT;
+    } else
+    if (rc == MRB_SFTP_SHORT_WRITE) {
+        err = LIBSSH2_FX_FAILURE;
+    } else
+    if (rc < 0) {
+        err = libssh2_sftp_last_error(mrb_sftp_session(mrb_attr_get(mrb, self, SYM("@session", 8))));
+        err = err == LIBSSH2_FX_OK ? (int)LIBSSH2_FX_FAILURE : err;
+    }
+
+    mrb_sftp_handle_free(mrb, data);
 
     DATA_PTR(self)  = NULL;
     DATA_TYPE(self) = NULL;
@@ -448,6 +1081,8 @@ mrb_sftp_f_close (mrb_state *mrb, mrb_value self)
     mrb_iv_remove(mrb, self, SYM("eof", 3));
     mrb_iv_remove(mrb, self, SYM("buf", 3));
 
+    mrb_sftp_raise(mrb, err, "Failed to write to the SFTP handle.");
+
     return mrb_nil_value();
 }
 
@@ -477,6 +1112,9 @@ mrb_mruby_sftp_handle_init (mrb_state *mrb)
     mrb_define_method(mrb, cls, "pos",      mrb_sftp_f_pos,    MRB_ARGS_NONE());
     mrb_define_method(mrb, cls, "seek",     mrb_sftp_f_seek,   MRB_ARGS_ARG(1,1));
     mrb_define_method(mrb, cls, "gets",     mrb_sftp_f_gets,   MRB_ARGS_OPT(1));
+    mrb_define_method(mrb, cls, "filter",   mrb_sftp_f_filter, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "pread",    mrb_sftp_f_pread,  MRB_ARGS_ARG(2,1));
+    mrb_define_method(mrb, cls, "read_ranges", mrb_sftp_f_read_ranges, MRB_ARGS_ARG(1,1));
     mrb_define_method(mrb, cls, "eof?",     mrb_sftp_f_eof,    MRB_ARGS_NONE());
     mrb_define_method(mrb, cls, "sync",     mrb_sftp_f_sync,   MRB_ARGS_NONE());
     mrb_define_method(mrb, cls, "close",    mrb_sftp_f_close,  MRB_ARGS_NONE());
@@ -26,15 +26,28 @@
 
 MRB_BEGIN_DECL
 
+#ifndef MRB_SFTP_WRITE_BUFFER_SIZE
+# define MRB_SFTP_WRITE_BUFFER_SIZE 131072
+#endif
+
 typedef struct mrb_sftp_handle
 {
     struct RData *session;
     LIBSSH2_SFTP_HANDLE *handle;
+    char *wbuf;
+    size_t wlen;
+    size_t wsize;
+    struct mrb_sftp_filter *filter;
 } mrb_sftp_handle_t;
 
 void mrb_mruby_sftp_handle_init (mrb_state *mrb);
 
 LIBSSH2_SFTP_HANDLE *mrb_sftp_handle (mrb_state *mrb, mrb_value self);
 LIBSSH2_SFTP_HANDLE *mrb_sftp_handle_bang (mrb_state *mrb, mrb_value self);
+void mrb_sftp_raise_io_error (mrb_state *mrb, mrb_value self, int err, const char *msg);
+ssize_t mrb_sftp_read (mrb_state *mrb, mrb_value self, char *mem, size_t len);
+ssize_t mrb_sftp_write (mrb_state *mrb, mrb_value self, const char *mem, size_t len);
+void mrb_sftp_flush (mrb_state *mrb, mrb_value self);
+int mrb_sftp_readdir (mrb_state *mrb, mrb_value self, char *name, size_t name_len, char *longname, size_t longname_len, LIBSSH2_SFTP_ATTRIBUTES *attrs);
 
 MRB_END_DECL
\ No newline at end of file
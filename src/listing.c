@@ -0,0 +1,527 @@
+/* MIT License
+ *
+ * Copyright (c) Sebastian Katzer 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "filter.h"
+#include "handle.h"
+#include "listing.h"
+
+#include "mruby.h"
+#include "mruby/data.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/string.h"
+#include "mruby/ext/sftp.h"
+
+#include <string.h>
+#include <libssh2_sftp.h>
+
+#define SYM(name, len) mrb_intern_static(mrb, name, len)
+
+typedef struct mrb_sftp_listing
+{
+    char *names;
+    size_t names_len;
+    size_t names_capa;
+    uint32_t *offsets;
+    uint16_t *lens;
+    uint64_t *sizes;
+    uint32_t *mtimes;
+    uint32_t *modes;
+    size_t len;
+    size_t capa;
+} mrb_sftp_listing_t;
+
+typedef struct mrb_sftp_order
+{
+    mrb_sftp_listing_t *data;
+    mrb_sym by;
+    mrb_bool reverse;
+} mrb_sftp_order_t;
+
+static void
+mrb_sftp_listing_clear (mrb_state *mrb, mrb_sftp_listing_t *data)
+{
+    mrb_free(mrb, data->names);
+    mrb_free(mrb, data->offsets);
+    mrb_free(mrb, data->lens);
+    mrb_free(mrb, data->sizes);
+    mrb_free(mrb, data->mtimes);
+    mrb_free(mrb, data->modes);
+
+    memset(data, 0, sizeof(mrb_sftp_listing_t));
+}
+
+static void
+mrb_sftp_listing_free (mrb_state *mrb, void *p)
+{
+    if (!p) return;
+
+    mrb_sftp_listing_clear(mrb, (mrb_sftp_listing_t *)p);
+    mrb_free(mrb, p);
+}
+
+static mrb_data_type const mrb_sftp_listing_type = { "SFTP::Listing", mrb_sftp_listing_free };
+
+static mrb_sftp_listing_t *
+mrb_sftp_listing (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_listing_t *data = mrb_data_get_ptr(mrb, self, &mrb_sftp_listing_type);
+
+    if (!data) {
+        mrb_raise(mrb, E_TYPE_ERROR, "Uninitialized SFTP::Listing.");
+    }
+
+    return data;
+}
+
+static void
+mrb_sftp_listing_reserve (mrb_state *mrb, mrb_sftp_listing_t *data, size_t capa, size_t names_capa)
+{
+    if (capa > data->capa) {
+        data->capa    = capa;
+        data->offsets = mrb_realloc(mrb, data->offsets, capa * sizeof(uint32_t));
+        data->lens    = mrb_realloc(mrb, data->lens, capa * sizeof(uint16_t));
+        data->sizes   = mrb_realloc(mrb, data->sizes, capa * sizeof(uint64_t));
+        data->mtimes  = mrb_realloc(mrb, data->mtimes, capa * sizeof(uint32_t));
+        data->modes   = mrb_realloc(mrb, data->modes, capa * sizeof(uint32_t));
+    }
+
+    if (names_capa > data->names_capa) {
+        data->names_capa = names_capa;
+        data->names      = mrb_realloc(mrb, data->names, names_capa);
+    }
+}
+
+static void
+mrb_sftp_listing_push (mrb_state *mrb, mrb_sftp_listing_t *data, const char *name, size_t name_len, uint64_t size, uint32_t mtime, uint32_t mode)
+{
+    size_t capa = data->capa, names_capa = data->names_capa;
+
+    if (data->len == capa) {
+        capa = capa ? capa * 2 : 64;
+    }
+
+    while (data->names_len + name_len > names_capa) {
+        names_capa = names_capa ? names_capa * 2 : 1024;
+    }
+
+    mrb_sftp_listing_reserve(mrb, data, capa, names_capa);
+
+    data->offsets[data->len] = data->names_len;
+    data->lens[data->len]    = name_len;
+    data->sizes[data->len]   = size;
+    data->mtimes[data->len]  = mtime;
+    data->modes[data->len]   = mode;
+
+    memcpy(data->names + data->names_len, name, name_len);
+
+    data->names_len += name_len;
+    data->len++;
+}
+
+static void
+mrb_sftp_listing_copy (mrb_state *mrb, mrb_sftp_listing_t *dst, mrb_sftp_listing_t *src, size_t i)
+{
+    mrb_sftp_listing_push(mrb, dst, src->names + src->offsets[i], src->lens[i], src->sizes[i], src->mtimes[i], src->modes[i]);
+}
+
+static void
+mrb_sftp_listing_attrs (mrb_sftp_listing_t *data, size_t i, LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    attrs->flags       = LIBSSH2_SFTP_ATTR_SIZE | LIBSSH2_SFTP_ATTR_ACMODTIME | LIBSSH2_SFTP_ATTR_PERMISSIONS;
+    attrs->filesize    = data->sizes[i];
+    attrs->mtime       = data->mtimes[i];
+    attrs->permissions = data->modes[i];
+}
+
+static void
+mrb_sftp_listing_scan (mrb_state *mrb, mrb_sftp_listing_t *data, mrb_value handle)
+{
+    mrb_sftp_handle_t *io = DATA_PTR(handle);
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    char name[512];
+    int rc;
+
+    while ((rc = mrb_sftp_readdir(mrb, handle, name, 512, NULL, 0, &attrs)) > 0) {
+        if ((rc == 1 && name[0] == '.') || (rc == 2 && name[0] == '.' && name[1] == '.'))
+            continue;
+
+        if (io && io->filter && !mrb_sftp_filter_match(io->filter, name, rc, &attrs))
+            continue;
+
+        mrb_sftp_listing_push(mrb, data, name, rc,
+            attrs.flags & LIBSSH2_SFTP_ATTR_SIZE ? attrs.filesize : 0,
+            attrs.flags & LIBSSH2_SFTP_ATTR_ACMODTIME ? attrs.mtime : 0,
+            attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS ? attrs.permissions : 0);
+    }
+
+    if (rc < 0) {
+        mrb_sftp_raise_io_error(mrb, handle, rc, "Failed to read the remote dir.");
+    }
+}
+
+static int
+mrb_sftp_listing_cmp (mrb_sftp_order_t *order, uint32_t a, uint32_t b)
+{
+    mrb_sftp_listing_t *data = order->data;
+    size_t len;
+    int cmp = 0;
+
+    if (order->by == 0) {
+        len = data->lens[a] < data->lens[b] ? data->lens[a] : data->lens[b];
+        cmp = memcmp(data->names + data->offsets[a], data->names + data->offsets[b], len);
+        cmp = cmp ? cmp : (int)data->lens[a] - (int)data->lens[b];
+    } else
+    if (order->by == 1) {
+        cmp = data->sizes[a] < data->sizes[b] ? -1 : data->sizes[a] > data->sizes[b];
+    } else {
+        cmp = data->mtimes[a] < data->mtimes[b] ? -1 : data->mtimes[a] > data->mtimes[b];
+    }
+
+    return order->reverse ? -cmp : cmp;
+}
+
+static void
+mrb_sftp_listing_msort (mrb_sftp_order_t *order, uint32_t *idx, uint32_t *tmp, size_t len)
+{
+    size_t mid = len / 2, i = 0, j = mid, k = 0;
+
+    if (len < 2) return;
+
+    mrb_sftp_listing_msort(order, idx, tmp, mid);
+    mrb_sftp_listing_msort(order, idx + mid, tmp, len - mid);
+
+    while (i < mid && j < len) {
+        if (mrb_sftp_listing_cmp(order, idx[j], idx[i]) < 0) {
+            tmp[k++] = idx[j++];
+        } else {
+            tmp[k++] = idx[i++];
+        }
+    }
+
+    while (i < mid) tmp[k++] = idx[i++];
+    while (j < len) tmp[k++] = idx[j++];
+
+    memcpy(idx, tmp, len * sizeof(uint32_t));
+}
+
+static void
+mrb_sftp_listing_gather (mrb_sftp_listing_t *data, uint32_t *idx, void *col, void *tmp, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < data->len; i++) {
+        memcpy((char *)tmp + i * size, (char *)col + idx[i] * size, size);
+    }
+
+    memcpy(col, tmp, data->len * size);
+}
+
+static mrb_int
+mrb_sftp_listing_index (mrb_state *mrb, mrb_sftp_listing_t *data)
+{
+    mrb_int i;
+
+    mrb_get_args(mrb, "i", &i);
+
+    if (i < 0) {
+        i += data->len;
+    }
+
+    return i >= 0 && (size_t)i < data->len ? i : -1;
+}
+
+static mrb_value
+mrb_sftp_listing_name (mrb_state *mrb, mrb_sftp_listing_t *data, size_t i)
+{
+    return mrb_str_new(mrb, data->names + data->offsets[i], data->lens[i]);
+}
+
+static mrb_value
+mrb_sftp_listing_row (mrb_state *mrb, mrb_sftp_listing_t *data, size_t i)
+{
+    mrb_value args[4];
+
+    args[0] = mrb_sftp_listing_name(mrb, data, i);
+    args[1] = mrb_fixnum_value(data->sizes[i]);
+    args[2] = mrb_fixnum_value(data->mtimes[i]);
+    args[3] = mrb_fixnum_value(data->modes[i]);
+
+    return mrb_ary_new_from_values(mrb, 4, args);
+}
+
+static mrb_value
+mrb_sftp_f_listing_init (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_listing_t *data;
+    mrb_value handle = mrb_nil_value();
+
+    mrb_get_args(mrb, "|o", &handle);
+
+    if (DATA_PTR(self)) {
+        mrb_sftp_listing_free(mrb, DATA_PTR(self));
+    }
+
+    data = mrb_calloc(mrb, 1, sizeof(mrb_sftp_listing_t));
+    mrb_data_init(self, data, &mrb_sftp_listing_type);
+
+    if (!mrb_nil_p(handle)) {
+        mrb_sftp_listing_scan(mrb, data, handle);
+    }
+
+    return self;
+}
+
+static mrb_value
+mrb_sftp_f_listing_init_copy (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_listing_t *data, *src;
+    mrb_value orig;
+    size_t i;
+
+    mrb_get_args(mrb, "o", &orig);
+
+    src = mrb_sftp_listing(mrb, orig);
+
+    if (DATA_PTR(self)) {
+        mrb_sftp_listing_free(mrb, DATA_PTR(self));
+    }
+
+    data = mrb_calloc(mrb, 1, sizeof(mrb_sftp_listing_t));
+    mrb_data_init(self, data, &mrb_sftp_listing_type);
+
+    mrb_sftp_listing_reserve(mrb, data, src->len, src->names_len);
+
+    for (i = 0; i < src->len; i++) {
+        mrb_sftp_listing_copy(mrb, data, src, i);
+    }
+
+    return self;
+}
+
+static mrb_value
+mrb_sftp_f_listing_size (mrb_state *mrb, mrb_value self)
+{
+    return mrb_fixnum_value(mrb_sftp_listing(mrb, self)->len);
+}
+
+static mrb_value
+mrb_sftp_f_listing_memsize (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_listing_t *data = mrb_sftp_listing(mrb, self);
+    size_t row               = sizeof(uint32_t) * 3 + sizeof(uint16_t) + sizeof(uint64_t);
+
+    return mrb_fixnum_value(sizeof(mrb_sftp_listing_t) + data->capa * row + data->names_capa);
+}
+
+static mrb_value
+mrb_sftp_f_listing_at (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_listing_t *data = mrb_sftp_listing(mrb, self);
+    mrb_int i                = mrb_sftp_listing_index(mrb, data);
+
+    return i < 0 ? mrb_nil_value() : mrb_sftp_listing_row(mrb, data, i);
+}
+
+static mrb_value
+mrb_sftp_f_listing_name (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_listing_t *data = mrb_sftp_listing(mrb, self);
+    mrb_int i                = mrb_sftp_listing_index(mrb, data);
+
+    return i < 0 ? mrb_nil_value() : mrb_sftp_listing_name(mrb, data, i);
+}
+
+static mrb_value
+mrb_sftp_f_listing_filesize (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_listing_t *data = mrb_sftp_listing(mrb, self);
+    mrb_int i                = mrb_sftp_listing_index(mrb, data);
+
+    return i < 0 ? mrb_nil_value() : mrb_fixnum_value(data->sizes[i]);
+}
+
+static mrb_value
+mrb_sftp_f_listing_mtime (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_listing_t *data = mrb_sftp_listing(mrb, self);
+    mrb_int i                = mrb_sftp_listing_index(mrb, data);
+
+    return i < 0 ? mrb_nil_value() : mrb_fixnum_value(data->mtimes[i]);
+}
+
+static mrb_value
+mrb_sftp_f_listing_mode (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_listing_t *data = mrb_sftp_listing(mrb, self);
+    mrb_int i                = mrb_sftp_listing_index(mrb, data);
+
+    return i < 0 ? mrb_nil_value() : mrb_fixnum_value(data->modes[i]);
+}
+
+static mrb_value
+mrb_sftp_f_listing_names (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_listing_t *data = mrb_sftp_listing(mrb, self);
+    mrb_value names          = mrb_ary_new_capa(mrb, data->len);
+    size_t i;
+    int arena;
+
+    for (i = 0; i < data->len; i++) {
+        arena = mrb_gc_arena_save(mrb);
+        mrb_ary_push(mrb, names, mrb_sftp_listing_name(mrb, data, i));
+        mrb_gc_arena_restore(mrb, arena);
+    }
+
+    return names;
+}
+
+static mrb_value
+mrb_sftp_f_listing_each (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_listing_t *data = mrb_sftp_listing(mrb, self);
+    mrb_value block;
+    size_t i;
+    int arena;
+
+    mrb_get_args(mrb, "&", &block);
+
+    if (mrb_nil_p(block)) {
+        return mrb_funcall(mrb, self, "to_enum", 1, mrb_symbol_value(SYM("each", 4)));
+    }
+
+    for (i = 0; i < data->len; i++) {
+        arena = mrb_gc_arena_save(mrb);
+        mrb_yield(mrb, block, mrb_sftp_listing_row(mrb, data, i));
+        mrb_gc_arena_restore(mrb, arena);
+    }
+
+    return self;
+}
+
+static mrb_value
+mrb_sftp_f_listing_sort_bang (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_listing_t *data = mrb_sftp_listing(mrb, self);
+    mrb_sym by               = SYM("name", 4);
+    mrb_bool reverse         = FALSE;
+    mrb_sftp_order_t order;
+    uint32_t *idx;
+    void *tmp;
+    size_t i;
+
+    mrb_get_args(mrb, "|nb", &by, &reverse);
+
+    if (by == SYM("name", 4)) {
+        order.by = 0;
+    } else
+    if (by == SYM("size", 4)) {
+        order.by = 1;
+    } else
+    if (by == SYM("mtime", 5)) {
+        order.by = 2;
+    } else {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Unknown sort key, expected :name, :size or :mtime.");
+    }
+
+    if (data->len < 2)
+        return self;
+
+    order.data    = data;
+    order.reverse = reverse;
+
+    idx = mrb_malloc(mrb, data->len * sizeof(uint32_t));
+    tmp = mrb_malloc(mrb, data->len * sizeof(uint64_t));
+
+    for (i = 0; i < data->len; i++) {
+        idx[i] = i;
+    }
+
+    mrb_sftp_listing_msort(&order, idx, (uint32_t *)tmp, data->len);
+
+    mrb_sftp_listing_gather(data, idx, data->offsets, tmp, sizeof(uint32_t));
+    mrb_sftp_listing_gather(data, idx, data->lens, tmp, sizeof(uint16_t));
+    mrb_sftp_listing_gather(data, idx, data->sizes, tmp, sizeof(uint64_t));
+    mrb_sftp_listing_gather(data, idx, data->mtimes, tmp, sizeof(uint32_t));
+    mrb_sftp_listing_gather(data, idx, data->modes, tmp, sizeof(uint32_t));
+
+    mrb_free(mrb, idx);
+    mrb_free(mrb, tmp);
+
+    return self;
+}
+
+static mrb_value
+mrb_sftp_f_listing_filter (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_listing_t *data = mrb_sftp_listing(mrb, self);
+    mrb_value res            = mrb_obj_new(mrb, mrb_obj_class(mrb, self), 0, NULL);
+    mrb_sftp_listing_t *dst  = mrb_sftp_listing(mrb, res);
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    mrb_sftp_filter_t *filter;
+    mrb_value opts;
+    size_t i;
+
+    mrb_get_args(mrb, "H", &opts);
+
+    mrb_sftp_listing_reserve(mrb, dst, data->len, data->names_len);
+
+    filter = mrb_sftp_filter_new(mrb, opts);
+
+    for (i = 0; i < data->len; i++) {
+        mrb_sftp_listing_attrs(data, i, &attrs);
+
+        if (mrb_sftp_filter_match(filter, data->names + data->offsets[i], data->lens[i], &attrs)) {
+            mrb_sftp_listing_copy(mrb, dst, data, i);
+        }
+    }
+
+    mrb_sftp_filter_free(mrb, filter);
+
+    return res;
+}
+
+void
+mrb_mruby_sftp_listing_init (mrb_state *mrb)
+{
+    struct RClass *ftp, *cls;
+
+    ftp = mrb_module_get(mrb, "SFTP");
+    cls = mrb_define_class_under(mrb, ftp, "Listing", mrb->object_class);
+
+    MRB_SET_INSTANCE_TT(cls, MRB_TT_DATA);
+
+    mrb_define_method(mrb, cls, "initialize", mrb_sftp_f_listing_init, MRB_ARGS_OPT(1));
+    mrb_define_method(mrb, cls, "initialize_copy", mrb_sftp_f_listing_init_copy, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "size",       mrb_sftp_f_listing_size, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "memsize",    mrb_sftp_f_listing_memsize, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "[]",         mrb_sftp_f_listing_at, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "name",       mrb_sftp_f_listing_name, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "filesize",   mrb_sftp_f_listing_filesize, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "mtime",      mrb_sftp_f_listing_mtime, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "mode",       mrb_sftp_f_listing_mode, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "names",      mrb_sftp_f_listing_names, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "each",       mrb_sftp_f_listing_each, MRB_ARGS_BLOCK());
+    mrb_define_method(mrb, cls, "sort!",      mrb_sftp_f_listing_sort_bang, MRB_ARGS_OPT(2));
+    mrb_define_method(mrb, cls, "filter",     mrb_sftp_f_listing_filter, MRB_ARGS_REQ(1));
+}
\ No newline at end of file
@@ -0,0 +1,303 @@
+/* MIT License
+ *
+ * Copyright (c) Sebastian Katzer 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
+
+#include "local.h"
+
+#include "mruby.h"
+#include "mruby/hash.h"
+#include "mruby/ext/sftp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+# include <io.h>
+# define mrb_sftp_ftruncate(file, len) _chsize_s(_fileno(file), (__int64)(len))
+#else
+# include <errno.h>
+# include <fcntl.h>
+# include <unistd.h>
+# define mrb_sftp_ftruncate(file, len) ftruncate(fileno(file), (off_t)(len))
+#endif
+
+#if defined(O_DIRECT) || defined(F_NOCACHE)
+# define MRB_SFTP_HAVE_DIRECT
+#endif
+
+#define SYM(name, len) mrb_intern_static(mrb, name, len)
+
+static inline mrb_bool
+mrb_sftp_zero_p (const char *mem, size_t len)
+{
+    return len == 0 || (mem[0] == 0 && memcmp(mem, mem + 1, len - 1) == 0);
+}
+
+size_t
+mrb_sftp_zero_run (const char *mem, size_t len, libssh2_uint64_t pos, mrb_bool *zero)
+{
+    size_t run = 0, block;
+
+    while (run < len) {
+        block = MRB_SFTP_SPARSE_BLOCK_SIZE - (size_t)((pos + run) % MRB_SFTP_SPARSE_BLOCK_SIZE);
+        block = block < len - run ? block : len - run;
+
+        if (run == 0) {
+            *zero = mrb_sftp_zero_p(mem, block);
+        } else
+        if (mrb_sftp_zero_p(mem + run, block) != *zero) {
+            break;
+        }
+
+        run += block;
+    }
+
+    return run;
+}
+
+static void
+mrb_sftp_local_drop (mrb_sftp_local_t *local, mrb_bool last)
+{
+#if !defined(_WIN32) && defined(POSIX_FADV_DONTNEED)
+    int fd = fileno(local->file);
+
+    if (!last && local->pos - local->kicked < MRB_SFTP_DONTNEED_WINDOW)
+        return;
+
+    fflush(local->file);
+
+# ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fd, local->kicked, local->pos - local->kicked, SYNC_FILE_RANGE_WRITE);
+
+    if (local->kicked > local->dropped) {
+        sync_file_range(fd, local->dropped, local->kicked - local->dropped, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, local->dropped, local->kicked - local->dropped, POSIX_FADV_DONTNEED);
+        local->dropped = local->kicked;
+    }
+# endif
+
+    local->kicked = local->pos;
+
+    if (last) {
+        fdatasync(fd);
+        posix_fadvise(fd, local->dropped, 0, POSIX_FADV_DONTNEED);
+    }
+#endif
+}
+
+#ifdef MRB_SFTP_HAVE_DIRECT
+static int
+mrb_sftp_local_flush (mrb_sftp_local_t *local, size_t len)
+{
+    size_t total = 0;
+    ssize_t rc;
+
+    while (total < len) {
+        if ((rc = write(local->fd, local->buf + total, len - total)) < 0 && errno == EINTR)
+            continue;
+
+        if (rc <= 0)
+            return MRB_SFTP_LOCAL_IO_ERROR;
+
+        total += rc;
+    }
+
+    return 0;
+}
+
+static int
+mrb_sftp_local_direct (mrb_sftp_local_t *local, const char *mem, size_t len)
+{
+    size_t size;
+
+    while (len > 0) {
+        size = MRB_SFTP_DIRECT_BUFFER_SIZE - local->len;
+        size = size < len ? size : len;
+
+        memcpy(local->buf + local->len, mem, size);
+
+        local->len += size;
+        local->pos += size;
+        mem        += size;
+        len        -= size;
+
+        if (local->len < MRB_SFTP_DIRECT_BUFFER_SIZE)
+            continue;
+
+        if (mrb_sftp_local_flush(local, local->len) != 0)
+            return MRB_SFTP_LOCAL_IO_ERROR;
+
+        local->len = 0;
+    }
+
+    return 0;
+}
+
+static int
+mrb_sftp_local_open_direct (mrb_state *mrb, mrb_sftp_local_t *local, const char *path)
+{
+# ifdef O_DIRECT
+    local->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+
+    if (local->fd == -1 && errno == EINVAL) {
+        mrb_raise(mrb, E_SFTP_UNSUPPORTED_ERROR, "Direct I/O is not supported by the local file system.");
+    }
+# else
+    local->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (local->fd != -1) {
+        fcntl(local->fd, F_NOCACHE, 1);
+    }
+# endif
+
+    if (local->fd == -1)
+        return -1;
+
+    if (posix_memalign((void **)&local->buf, MRB_SFTP_DIRECT_ALIGN, MRB_SFTP_DIRECT_BUFFER_SIZE) != 0) {
+        close(local->fd);
+        local->buf = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+void
+mrb_sftp_local_open (mrb_state *mrb, mrb_sftp_local_t *local, const char *path, mrb_value opts)
+{
+    mrb_bool direct = FALSE;
+    mrb_value cache = mrb_nil_value();
+
+    memset(local, 0, sizeof(mrb_sftp_local_t));
+
+    local->fd = -1;
+
+    if (mrb_hash_p(opts)) {
+        local->sparse = mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("sparse", 6))));
+        direct        = mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("direct", 6))));
+        cache         = mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("cache", 5)));
+    }
+
+    if (!mrb_nil_p(cache) && !(mrb_symbol_p(cache) && mrb_symbol(cache) == SYM("dontneed", 8))) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Unknown cache mode, expected :dontneed.");
+    }
+
+    if (direct && local->sparse) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Sparse mode cannot be combined with direct I/O.");
+    }
+
+    local->dontneed = !mrb_nil_p(cache);
+
+    if (direct) {
+#ifdef MRB_SFTP_HAVE_DIRECT
+        if (mrb_sftp_local_open_direct(mrb, local, path) == 0)
+            return;
+#else
+        mrb_raise(mrb, E_SFTP_UNSUPPORTED_ERROR, "Direct I/O is not supported on this platform.");
+#endif
+    } else
+    if ((local->file = fopen(path, "wb"))) {
+        return;
+    }
+
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot open the path specified.");
+}
+
+int
+mrb_sftp_local_write (mrb_state *mrb, void *ctx, const char *mem, size_t len)
+{
+    mrb_sftp_local_t *local = (mrb_sftp_local_t *)ctx;
+    mrb_bool zero           = FALSE;
+    size_t run;
+
+#ifdef MRB_SFTP_HAVE_DIRECT
+    if (local->buf)
+        return mrb_sftp_local_direct(local, mem, len);
+#endif
+
+    while (len > 0) {
+        run = local->sparse ? mrb_sftp_zero_run(mem, len, local->pos, &zero) : len;
+
+        if (zero ? fseek(local->file, (long)run, SEEK_CUR) != 0 : fwrite(mem, sizeof(char), run, local->file) != run)
+            return MRB_SFTP_LOCAL_IO_ERROR;
+
+        local->hole = zero;
+        local->pos += run;
+        mem        += run;
+        len        -= run;
+    }
+
+    if (local->dontneed) {
+        mrb_sftp_local_drop(local, FALSE);
+    }
+
+    return 0;
+}
+
+int
+mrb_sftp_local_close (mrb_sftp_local_t *local)
+{
+    int err = 0;
+
+#ifdef MRB_SFTP_HAVE_DIRECT
+    size_t head;
+
+    if (local->buf) {
+        head = local->len - local->len % MRB_SFTP_DIRECT_ALIGN;
+        err  = mrb_sftp_local_flush(local, head);
+
+# ifdef O_DIRECT
+        if (err == 0 && head < local->len) {
+            fcntl(local->fd, F_SETFL, fcntl(local->fd, F_GETFL) & ~O_DIRECT);
+        }
+# endif
+
+        if (err == 0 && head < local->len) {
+            memmove(local->buf, local->buf + head, local->len - head);
+            err = mrb_sftp_local_flush(local, local->len - head);
+        }
+
+        close(local->fd);
+        free(local->buf);
+
+        return err;
+    }
+#endif
+
+    if (local->hole && (fflush(local->file) != 0 || mrb_sftp_ftruncate(local->file, local->pos) != 0)) {
+        err = MRB_SFTP_LOCAL_IO_ERROR;
+    }
+
+    if (local->dontneed) {
+        mrb_sftp_local_drop(local, TRUE);
+    }
+
+    fclose(local->file);
+
+    return err;
+}
\ No newline at end of file
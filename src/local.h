@@ -0,0 +1,67 @@
+/* MIT License
+ *
+ * Copyright (c) Sebastian Katzer 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "mruby.h"
+#include <stdio.h>
+#include <libssh2_sftp.h>
+
+MRB_BEGIN_DECL
+
+#ifndef MRB_SFTP_SPARSE_BLOCK_SIZE
+# define MRB_SFTP_SPARSE_BLOCK_SIZE 4096
+#endif
+
+#ifndef MRB_SFTP_DIRECT_ALIGN
+# define MRB_SFTP_DIRECT_ALIGN 4096
+#endif
+
+#ifndef MRB_SFTP_DIRECT_BUFFER_SIZE
+# define MRB_SFTP_DIRECT_BUFFER_SIZE 4194304
+#endif
+
+#ifndef MRB_SFTP_DONTNEED_WINDOW
+# define MRB_SFTP_DONTNEED_WINDOW 8388608
+#endif
+
+#define MRB_SFTP_LOCAL_IO_ERROR -1001
+
+typedef struct mrb_sftp_local
+{
+    FILE *file;
+    int fd;
+    char *buf;
+    size_t len;
+    libssh2_uint64_t pos;
+    libssh2_uint64_t kicked;
+    libssh2_uint64_t dropped;
+    mrb_bool sparse;
+    mrb_bool hole;
+    mrb_bool dontneed;
+} mrb_sftp_local_t;
+
+void mrb_sftp_local_open (mrb_state *mrb, mrb_sftp_local_t *local, const char *path, mrb_value opts);
+int mrb_sftp_local_write (mrb_state *mrb, void *ctx, const char *mem, size_t len);
+int mrb_sftp_local_close (mrb_sftp_local_t *local);
+size_t mrb_sftp_zero_run (const char *mem, size_t len, libssh2_uint64_t pos, mrb_bool *zero);
+
+MRB_END_DECL
\ No newline at end of file
@@ -0,0 +1,579 @@
+/* MIT License
+ *
+ * Copyright (c) Sebastian Katzer 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pipeline.h"
+#include "transfer.h"
+
+#include "mruby.h"
+#include "mruby/data.h"
+#include "mruby/ext/ssh.h"
+#include "mruby/ext/sftp.h"
+
+#include <string.h>
+#include <libssh2_sftp.h>
+
+#define MRB_SFTP_PIPE_MAX_PACKET 4194304
+
+static inline uint32_t
+mrb_sftp_be32 (const unsigned char *buf)
+{
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
+
+static inline void
+mrb_sftp_put_be32 (unsigned char *buf, uint32_t val)
+{
+    buf[0] = (unsigned char)(val >> 24);
+    buf[1] = (unsigned char)(val >> 16);
+    buf[2] = (unsigned char)(val >> 8);
+    buf[3] = (unsigned char)val;
+}
+
+void
+mrb_sftp_pipe_free (mrb_state *mrb, mrb_ssh_t *ssh, mrb_sftp_pipe_t *pipe)
+{
+    if (!pipe) return;
+
+    if (pipe->channel && ssh && mrb_ssh_initialized()) {
+        while (libssh2_channel_close(pipe->channel) == LIBSSH2_ERROR_EAGAIN) {
+            mrb_ssh_wait_sock(ssh);
+        }
+
+        while (libssh2_channel_free(pipe->channel) == LIBSSH2_ERROR_EAGAIN) {
+            mrb_ssh_wait_sock(ssh);
+        }
+    }
+
+    mrb_free(mrb, pipe->out);
+    mrb_free(mrb, pipe->in);
+    mrb_free(mrb, pipe->slot_ids);
+    mrb_free(mrb, pipe->slot_idx);
+    mrb_free(mrb, pipe);
+}
+
+void
+mrb_sftp_pipe_reset (mrb_state *mrb, mrb_value session)
+{
+    mrb_sftp_t *data = DATA_PTR(session);
+
+    if (data && data->pipe) {
+        mrb_sftp_pipe_free(mrb, mrb_sftp_ssh_session(session), data->pipe);
+        data->pipe = NULL;
+    }
+}
+
+static void
+mrb_sftp_pipe_fail (mrb_state *mrb, mrb_value session, const char *msg)
+{
+    mrb_sftp_pipe_reset(mrb, session);
+    mrb_raise(mrb, E_SFTP_CONNECTION_LOST_ERROR, msg);
+}
+
+static void
+mrb_sftp_pipe_wait (mrb_state *mrb, mrb_value session)
+{
+    mrb_sftp_t *data = DATA_PTR(session);
+    int rc           = mrb_sftp_poll(session);
+
+    if (rc == 0) return;
+
+    if (data && data->pipe) {
+        mrb_sftp_pipe_free(mrb, NULL, data->pipe);
+        data->pipe = NULL;
+    }
+
+    if (rc == LIBSSH2_ERROR_TIMEOUT) {
+        mrb_sftp_raise(mrb, rc, "SFTP operation timed out.");
+    }
+
+    mrb_raise(mrb, E_SFTP_NOT_CONNECTED_ERROR, "SFTP session not connected.");
+}
+
+static void
+mrb_sftp_pipe_reserve (mrb_state *mrb, mrb_sftp_pipe_t *pipe, size_t len)
+{
+    size_t capa = pipe->out_capa ? pipe->out_capa : 4096;
+
+    if (pipe->out_len + len <= pipe->out_capa) return;
+
+    while (capa < pipe->out_len + len) capa *= 2;
+
+    pipe->out      = mrb_realloc(mrb, pipe->out, capa);
+    pipe->out_capa = capa;
+}
+
+static void
+mrb_sftp_pipe_start (mrb_state *mrb, mrb_sftp_pipe_t *pipe, unsigned char type)
+{
+    mrb_sftp_pipe_reserve(mrb, pipe, 5);
+
+    pipe->out_mark = pipe->out_len;
+    pipe->out[pipe->out_len + 4] = type;
+    pipe->out_len += 5;
+}
+
+uint32_t
+mrb_sftp_pipe_begin (mrb_state *mrb, mrb_sftp_pipe_t *pipe, unsigned char type)
+{
+    uint32_t id = pipe->id++;
+
+    if (pipe->slots_len == pipe->slots_capa) {
+        pipe->slots_capa = pipe->slots_capa ? pipe->slots_capa * 2 : MRB_SFTP_PIPE_DEPTH;
+        pipe->slot_ids   = mrb_realloc(mrb, pipe->slot_ids, pipe->slots_capa * sizeof(uint32_t));
+        pipe->slot_idx   = mrb_realloc(mrb, pipe->slot_idx, pipe->slots_capa * sizeof(mrb_int));
+    }
+
+    pipe->slot_ids[pipe->slots_len] = id;
+    pipe->slot_idx[pipe->slots_len] = pipe->cur;
+    pipe->slots_len++;
+
+    mrb_sftp_pipe_start(mrb, pipe, type);
+    mrb_sftp_pipe_put_u32(mrb, pipe, id);
+
+    return id;
+}
+
+void
+mrb_sftp_pipe_put_u32 (mrb_state *mrb, mrb_sftp_pipe_t *pipe, uint32_t val)
+{
+    mrb_sftp_pipe_reserve(mrb, pipe, 4);
+    mrb_sftp_put_be32(pipe->out + pipe->out_len, val);
+    pipe->out_len += 4;
+}
+
+void
+mrb_sftp_pipe_put_u64 (mrb_state *mrb, mrb_sftp_pipe_t *pipe, uint64_t val)
+{
+    mrb_sftp_pipe_put_u32(mrb, pipe, (uint32_t)(val >> 32));
+    mrb_sftp_pipe_put_u32(mrb, pipe, (uint32_t)val);
+}
+
+void
+mrb_sftp_pipe_put_str (mrb_state *mrb, mrb_sftp_pipe_t *pipe, const char *str, size_t len)
+{
+    mrb_sftp_pipe_put_u32(mrb, pipe, (uint32_t)len);
+    mrb_sftp_pipe_reserve(mrb, pipe, len);
+    memcpy(pipe->out + pipe->out_len, str, len);
+    pipe->out_len += len;
+}
+
+void
+mrb_sftp_pipe_put_attrs (mrb_state *mrb, mrb_sftp_pipe_t *pipe, LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    unsigned long flags = attrs ? attrs->flags : 0;
+
+    flags &= LIBSSH2_SFTP_ATTR_SIZE | LIBSSH2_SFTP_ATTR_UIDGID | LIBSSH2_SFTP_ATTR_PERMISSIONS | LIBSSH2_SFTP_ATTR_ACMODTIME;
+
+    mrb_sftp_pipe_put_u32(mrb, pipe, (uint32_t)flags);
+
+    if (flags & LIBSSH2_SFTP_ATTR_SIZE) {
+        mrb_sftp_pipe_put_u64(mrb, pipe, attrs->filesize);
+    }
+
+    if (flags & LIBSSH2_SFTP_ATTR_UIDGID) {
+        mrb_sftp_pipe_put_u32(mrb, pipe, (uint32_t)attrs->uid);
+        mrb_sftp_pipe_put_u32(mrb, pipe, (uint32_t)attrs->gid);
+    }
+
+    if (flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) {
+        mrb_sftp_pipe_put_u32(mrb, pipe, (uint32_t)attrs->permissions);
+    }
+
+    if (flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
+        mrb_sftp_pipe_put_u32(mrb, pipe, (uint32_t)attrs->atime);
+        mrb_sftp_pipe_put_u32(mrb, pipe, (uint32_t)attrs->mtime);
+    }
+}
+
+void
+mrb_sftp_pipe_end (mrb_state *mrb, mrb_sftp_pipe_t *pipe)
+{
+    mrb_sftp_put_be32(pipe->out + pipe->out_mark, (uint32_t)(pipe->out_len - pipe->out_mark - 4));
+    pipe->out_mark = pipe->out_len;
+}
+
+void
+mrb_sftp_pipe_flush (mrb_state *mrb, mrb_value session, mrb_sftp_pipe_t *pipe)
+{
+    size_t off = 0;
+    ssize_t rc;
+
+    while (off < pipe->out_len) {
+        rc = libssh2_channel_write(pipe->channel, (const char *)pipe->out + off, pipe->out_len - off);
+
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            mrb_sftp_pipe_wait(mrb, session);
+            continue;
+        }
+
+        if (rc < 0) {
+            mrb_sftp_pipe_fail(mrb, session, "Failed to write to the SFTP pipeline.");
+        }
+
+        off += rc;
+    }
+
+    pipe->out_len  = 0;
+    pipe->out_mark = 0;
+}
+
+void
+mrb_sftp_pipe_recv (mrb_state *mrb, mrb_value session, mrb_sftp_pipe_t *pipe, mrb_sftp_reply_t *reply)
+{
+    size_t need, capa;
+    uint32_t len;
+    ssize_t rc;
+
+    if (pipe->in_used > 0) {
+        memmove(pipe->in, pipe->in + pipe->in_used, pipe->in_len - pipe->in_used);
+        pipe->in_len -= pipe->in_used;
+        pipe->in_used = 0;
+    }
+
+    for (;;) {
+        need = 4;
+
+        if (pipe->in_len >= 4) {
+            len = mrb_sftp_be32(pipe->in);
+
+            if (len < 5 || len > MRB_SFTP_PIPE_MAX_PACKET) {
+                mrb_sftp_pipe_fail(mrb, session, "Malformed reply on the SFTP pipeline.");
+            }
+
+            if (pipe->in_len >= 4 + (size_t)len) break;
+
+            need = 4 + len;
+        }
+
+        if (pipe->in_capa < need || pipe->in_capa - pipe->in_len < 4096) {
+            capa = pipe->in_capa ? pipe->in_capa : 32768;
+
+            while (capa < need || capa - pipe->in_len < 4096) capa *= 2;
+
+            pipe->in      = mrb_realloc(mrb, pipe->in, capa);
+            pipe->in_capa = capa;
+        }
+
+        rc = libssh2_channel_read(pipe->channel, (char *)pipe->in + pipe->in_len, pipe->in_capa - pipe->in_len);
+
+        if (rc == LIBSSH2_ERROR_EAGAIN || (rc == 0 && !libssh2_channel_eof(pipe->channel))) {
+            mrb_sftp_pipe_wait(mrb, session);
+            continue;
+        }
+
+        if (rc <= 0) {
+            mrb_sftp_pipe_fail(mrb, session, "Failed to read from the SFTP pipeline.");
+        }
+
+        pipe->in_len += rc;
+    }
+
+    reply->type   = pipe->in[4];
+    reply->id     = len >= 5 + 4 ? mrb_sftp_be32(pipe->in + 5) : 0;
+    reply->ptr    = pipe->in + (len >= 5 + 4 ? 9 : 5);
+    reply->end    = pipe->in + 4 + len;
+    pipe->in_used = 4 + len;
+}
+
+mrb_sftp_pipe_t *
+mrb_sftp_pipe (mrb_state *mrb, mrb_value session)
+{
+    mrb_sftp_t *data = DATA_PTR(session);
+    mrb_ssh_t *ssh   = mrb_sftp_ssh_session(session);
+    LIBSSH2_CHANNEL *channel;
+    mrb_sftp_pipe_t *pipe;
+    mrb_sftp_reply_t reply;
+    int rc;
+
+    if (!(data && data->sftp && ssh && mrb_ssh_initialized())) {
+        mrb_raise(mrb, E_SFTP_NOT_CONNECTED_ERROR, "SFTP session not connected.");
+    }
+
+    mrb_sftp_raise_if_busy(mrb, session);
+
+    if (data->pipe) {
+        if (data->pipe->out_len > 0) {
+            data->pipe->out_len  = 0;
+            data->pipe->out_mark = 0;
+        }
+
+        return data->pipe;
+    }
+
+    do {
+        channel = libssh2_channel_open_session(ssh->session);
+
+        if (channel) break;
+
+        if (libssh2_session_last_errno(ssh->session) == LIBSSH2_ERROR_EAGAIN) {
+            mrb_sftp_pipe_wait(mrb, session);
+        } else {
+            mrb_ssh_raise_last_error(mrb, ssh);
+        }
+    } while (!channel);
+
+    pipe = mrb_malloc(mrb, sizeof(mrb_sftp_pipe_t));
+
+    memset(pipe, 0, sizeof(mrb_sftp_pipe_t));
+
+    pipe->channel = channel;
+    pipe->id      = 1;
+    data->pipe    = pipe;
+
+    while ((rc = libssh2_channel_subsystem(channel, "sftp")) == LIBSSH2_ERROR_EAGAIN) {
+        mrb_sftp_pipe_wait(mrb, session);
+    }
+
+    if (rc != 0) {
+        mrb_sftp_pipe_fail(mrb, session, "Failed to start the SFTP pipeline.");
+    }
+
+    mrb_sftp_pipe_start(mrb, pipe, SSH_FXP_INIT);
+    mrb_sftp_pipe_put_u32(mrb, pipe, 3);
+    mrb_sftp_pipe_end(mrb, pipe);
+    mrb_sftp_pipe_flush(mrb, session, pipe);
+    mrb_sftp_pipe_recv(mrb, session, pipe, &reply);
+
+    if (reply.type != SSH_FXP_VERSION) {
+        mrb_sftp_pipe_fail(mrb, session, "Failed to start the SFTP pipeline.");
+    }
+
+    return pipe;
+}
+
+static mrb_int
+mrb_sftp_pipe_take_slot (mrb_sftp_pipe_t *pipe, uint32_t id)
+{
+    mrb_int i, idx;
+
+    for (i = 0; i < pipe->slots_len; i++) {
+        if (pipe->slot_ids[i] != id) continue;
+
+        idx = pipe->slot_idx[i];
+        pipe->slots_len--;
+        pipe->slot_ids[i] = pipe->slot_ids[pipe->slots_len];
+        pipe->slot_idx[i] = pipe->slot_idx[pipe->slots_len];
+
+        return idx;
+    }
+
+    return -1;
+}
+
+void
+mrb_sftp_pipe_run (mrb_state *mrb, mrb_value session, mrb_int len, mrb_sftp_pipe_step_f step, void *ctx)
+{
+    mrb_sftp_pipe_drive(mrb, session, len, NULL, 0, step, ctx);
+}
+
+mrb_sftp_pipe_t *
+mrb_sftp_pipe_take (mrb_state *mrb, mrb_value session)
+{
+    mrb_sftp_pipe_t *pipe = mrb_sftp_pipe(mrb, session);
+    mrb_sftp_t *data      = DATA_PTR(session);
+
+    data->pipe = NULL;
+
+    return pipe;
+}
+
+void
+mrb_sftp_pipe_give (mrb_state *mrb, mrb_value session, mrb_sftp_pipe_t *pipe)
+{
+    mrb_sftp_t *data = DATA_PTR(session);
+
+    if (data && !data->pipe && data->sftp) {
+        data->pipe = pipe;
+    } else {
+        mrb_sftp_pipe_free(mrb, mrb_sftp_ssh_session(session), pipe);
+    }
+}
+
+void
+mrb_sftp_pipe_drive (mrb_state *mrb, mrb_value session, mrb_int len, mrb_int *running, mrb_int width, mrb_sftp_pipe_step_f step, void *ctx)
+{
+    mrb_sftp_pipe_loop(mrb, session, mrb_sftp_pipe(mrb, session), len, running, width, step, ctx);
+}
+
+void
+mrb_sftp_pipe_loop (mrb_state *mrb, mrb_value session, mrb_sftp_pipe_t *pipe, mrb_int len, mrb_int *running, mrb_int width, mrb_sftp_pipe_step_f step, void *ctx)
+{
+    mrb_int started = 0;
+    mrb_sftp_reply_t reply;
+    mrb_int idx;
+
+    pipe->slots_len = 0;
+
+    while (started < len || pipe->slots_len > 0) {
+        while (started < len && pipe->slots_len < MRB_SFTP_PIPE_DEPTH && !(running && *running >= width)) {
+            pipe->cur = started;
+            step(mrb, pipe, ctx, started++, NULL);
+        }
+
+        if (pipe->slots_len == 0) continue;
+
+        mrb_sftp_pipe_flush(mrb, session, pipe);
+        mrb_sftp_pipe_recv(mrb, session, pipe, &reply);
+
+        if ((idx = mrb_sftp_pipe_take_slot(pipe, reply.id)) < 0) continue;
+
+        pipe->cur = idx;
+        step(mrb, pipe, ctx, idx, &reply);
+    }
+}
+
+typedef struct mrb_sftp_pipe_adapter
+{
+    mrb_sftp_pipe_req_f req;
+    mrb_sftp_pipe_rep_f rep;
+    void *ctx;
+} mrb_sftp_pipe_adapter_t;
+
+static void
+mrb_sftp_pipe_adapt (mrb_state *mrb, mrb_sftp_pipe_t *pipe, void *ctx, mrb_int idx, mrb_sftp_reply_t *reply)
+{
+    mrb_sftp_pipe_adapter_t *adapter = (mrb_sftp_pipe_adapter_t *)ctx;
+
+    if (reply) {
+        adapter->rep(mrb, adapter->ctx, idx, reply);
+    } else {
+        adapter->req(mrb, pipe, adapter->ctx, idx);
+    }
+}
+
+void
+mrb_sftp_pipe_batch (mrb_state *mrb, mrb_value session, mrb_int len, mrb_sftp_pipe_req_f req, mrb_sftp_pipe_rep_f rep, void *ctx)
+{
+    mrb_sftp_pipe_adapter_t adapter;
+
+    adapter.req = req;
+    adapter.rep = rep;
+    adapter.ctx = ctx;
+
+    mrb_sftp_pipe_run(mrb, session, len, mrb_sftp_pipe_adapt, &adapter);
+}
+
+mrb_bool
+mrb_sftp_reply_u32 (mrb_sftp_reply_t *reply, uint32_t *val)
+{
+    if (reply->end - reply->ptr < 4) return FALSE;
+
+    *val        = mrb_sftp_be32(reply->ptr);
+    reply->ptr += 4;
+
+    return TRUE;
+}
+
+mrb_bool
+mrb_sftp_reply_u64 (mrb_sftp_reply_t *reply, uint64_t *val)
+{
+    uint32_t hi, lo;
+
+    if (!(mrb_sftp_reply_u32(reply, &hi) && mrb_sftp_reply_u32(reply, &lo))) return FALSE;
+
+    *val = ((uint64_t)hi << 32) | lo;
+
+    return TRUE;
+}
+
+mrb_bool
+mrb_sftp_reply_str (mrb_sftp_reply_t *reply, const char **str, uint32_t *len)
+{
+    if (!mrb_sftp_reply_u32(reply, len)) return FALSE;
+    if ((size_t)(reply->end - reply->ptr) < *len) return FALSE;
+
+    *str        = (const char *)reply->ptr;
+    reply->ptr += *len;
+
+    return TRUE;
+}
+
+mrb_bool
+mrb_sftp_reply_attrs (mrb_sftp_reply_t *reply, LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    uint32_t flags, val, count;
+    uint64_t size;
+    const char *str;
+
+    memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
+
+    if (!mrb_sftp_reply_u32(reply, &flags)) return FALSE;
+
+    attrs->flags = flags;
+
+    if (flags & LIBSSH2_SFTP_ATTR_SIZE) {
+        if (!mrb_sftp_reply_u64(reply, &size)) return FALSE;
+        attrs->filesize = size;
+    }
+
+    if (flags & LIBSSH2_SFTP_ATTR_UIDGID) {
+        if (!mrb_sftp_reply_u32(reply, &val)) return FALSE;
+        attrs->uid = val;
+        if (!mrb_sftp_reply_u32(reply, &val)) return FALSE;
+        attrs->gid = val;
+    }
+
+    if (flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) {
+        if (!mrb_sftp_reply_u32(reply, &val)) return FALSE;
+        attrs->permissions = val;
+    }
+
+    if (flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
+        if (!mrb_sftp_reply_u32(reply, &val)) return FALSE;
+        attrs->atime = val;
+        if (!mrb_sftp_reply_u32(reply, &val)) return FALSE;
+        attrs->mtime = val;
+    }
+
+    if (flags & LIBSSH2_SFTP_ATTR_EXTENDED) {
+        if (!mrb_sftp_reply_u32(reply, &count)) return FALSE;
+
+        while (count-- > 0) {
+            if (!(mrb_sftp_reply_str(reply, &str, &val) && mrb_sftp_reply_str(reply, &str, &val))) return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+int
+mrb_sftp_reply_status (mrb_sftp_reply_t *reply, const char **msg, uint32_t *len)
+{
+    uint32_t code;
+
+    if (reply->type != SSH_FXP_STATUS || !mrb_sftp_reply_u32(reply, &code))
+        return LIBSSH2_FX_BAD_MESSAGE;
+
+    if (msg && !mrb_sftp_reply_str(reply, msg, len)) {
+        *msg = NULL;
+        *len = 0;
+    }
+
+    return (int)code;
+}
+
+mrb_value
+mrb_sftp_reply_error (mrb_state *mrb, mrb_sftp_reply_t *reply, const char *msg)
+{
+    return mrb_sftp_error(mrb, mrb_sftp_reply_status(reply, NULL, NULL), msg);
+}
\ No newline at end of file
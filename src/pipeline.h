@@ -0,0 +1,113 @@
+/* MIT License
+ *
+ * Copyright (c) Sebastian Katzer 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "mruby.h"
+#include "mruby/ext/ssh.h"
+#include <libssh2_sftp.h>
+
+MRB_BEGIN_DECL
+
+#ifndef MRB_SFTP_PIPE_DEPTH
+# define MRB_SFTP_PIPE_DEPTH 256
+#endif
+
+#define SSH_FXP_INIT     1
+#define SSH_FXP_VERSION  2
+#define SSH_FXP_OPEN     3
+#define SSH_FXP_CLOSE    4
+#define SSH_FXP_READ     5
+#define SSH_FXP_WRITE    6
+#define SSH_FXP_LSTAT    7
+#define SSH_FXP_FSTAT    8
+#define SSH_FXP_SETSTAT  9
+#define SSH_FXP_OPENDIR  11
+#define SSH_FXP_READDIR  12
+#define SSH_FXP_REMOVE   13
+#define SSH_FXP_MKDIR    14
+#define SSH_FXP_RMDIR    15
+#define SSH_FXP_STAT     17
+#define SSH_FXP_STATUS   101
+#define SSH_FXP_HANDLE   102
+#define SSH_FXP_DATA     103
+#define SSH_FXP_NAME     104
+#define SSH_FXP_ATTRS    105
+
+typedef struct mrb_sftp_pipe
+{
+    LIBSSH2_CHANNEL *channel;
+    uint32_t id;
+    unsigned char *out;
+    size_t out_len;
+    size_t out_capa;
+    size_t out_mark;
+    unsigned char *in;
+    size_t in_len;
+    size_t in_capa;
+    size_t in_used;
+    mrb_int cur;
+    uint32_t *slot_ids;
+    mrb_int *slot_idx;
+    mrb_int slots_len;
+    mrb_int slots_capa;
+} mrb_sftp_pipe_t;
+
+typedef struct mrb_sftp_reply
+{
+    unsigned char type;
+    uint32_t id;
+    const unsigned char *ptr;
+    const unsigned char *end;
+} mrb_sftp_reply_t;
+
+typedef void (*mrb_sftp_pipe_step_f)(mrb_state *mrb, mrb_sftp_pipe_t *pipe, void *ctx, mrb_int idx, mrb_sftp_reply_t *reply);
+typedef void (*mrb_sftp_pipe_req_f)(mrb_state *mrb, mrb_sftp_pipe_t *pipe, void *ctx, mrb_int idx);
+typedef void (*mrb_sftp_pipe_rep_f)(mrb_state *mrb, void *ctx, mrb_int idx, mrb_sftp_reply_t *reply);
+
+mrb_sftp_pipe_t *mrb_sftp_pipe (mrb_state *mrb, mrb_value session);
+void mrb_sftp_pipe_free (mrb_state *mrb, mrb_ssh_t *ssh, mrb_sftp_pipe_t *pipe);
+void mrb_sftp_pipe_reset (mrb_state *mrb, mrb_value session);
+mrb_sftp_pipe_t *mrb_sftp_pipe_take (mrb_state *mrb, mrb_value session);
+void mrb_sftp_pipe_give (mrb_state *mrb, mrb_value session, mrb_sftp_pipe_t *pipe);
+
+uint32_t mrb_sftp_pipe_begin (mrb_state *mrb, mrb_sftp_pipe_t *pipe, unsigned char type);
+void mrb_sftp_pipe_put_u32 (mrb_state *mrb, mrb_sftp_pipe_t *pipe, uint32_t val);
+void mrb_sftp_pipe_put_u64 (mrb_state *mrb, mrb_sftp_pipe_t *pipe, uint64_t val);
+void mrb_sftp_pipe_put_str (mrb_state *mrb, mrb_sftp_pipe_t *pipe, const char *str, size_t len);
+void mrb_sftp_pipe_put_attrs (mrb_state *mrb, mrb_sftp_pipe_t *pipe, LIBSSH2_SFTP_ATTRIBUTES *attrs);
+void mrb_sftp_pipe_end (mrb_state *mrb, mrb_sftp_pipe_t *pipe);
+
+void mrb_sftp_pipe_flush (mrb_state *mrb, mrb_value session, mrb_sftp_pipe_t *pipe);
+void mrb_sftp_pipe_recv (mrb_state *mrb, mrb_value session, mrb_sftp_pipe_t *pipe, mrb_sftp_reply_t *reply);
+void mrb_sftp_pipe_run (mrb_state *mrb, mrb_value session, mrb_int len, mrb_sftp_pipe_step_f step, void *ctx);
+void mrb_sftp_pipe_drive (mrb_state *mrb, mrb_value session, mrb_int len, mrb_int *running, mrb_int width, mrb_sftp_pipe_step_f step, void *ctx);
+void mrb_sftp_pipe_loop (mrb_state *mrb, mrb_value session, mrb_sftp_pipe_t *pipe, mrb_int len, mrb_int *running, mrb_int width, mrb_sftp_pipe_step_f step, void *ctx);
+void mrb_sftp_pipe_batch (mrb_state *mrb, mrb_value session, mrb_int len, mrb_sftp_pipe_req_f req, mrb_sftp_pipe_rep_f rep, void *ctx);
+
+mrb_bool mrb_sftp_reply_u32 (mrb_sftp_reply_t *reply, uint32_t *val);
+mrb_bool mrb_sftp_reply_u64 (mrb_sftp_reply_t *reply, uint64_t *val);
+mrb_bool mrb_sftp_reply_str (mrb_sftp_reply_t *reply, const char **str, uint32_t *len);
+mrb_bool mrb_sftp_reply_attrs (mrb_sftp_reply_t *reply, LIBSSH2_SFTP_ATTRIBUTES *attrs);
+int mrb_sftp_reply_status (mrb_sftp_reply_t *reply, const char **msg, uint32_t *len);
+mrb_value mrb_sftp_reply_error (mrb_state *mrb, mrb_sftp_reply_t *reply, const char *msg);
+
+MRB_END_DECL
\ No newline at end of file
@@ -23,16 +23,24 @@
 
 #include "session.h"
 #include "handle.h"
+#include "pipeline.h"
 #include "stat.h"
+#include "transfer.h"
 
 #include "mruby.h"
 #include "mruby/data.h"
+#include "mruby/array.h"
 #include "mruby/class.h"
+#include "mruby/error.h"
+#include "mruby/hash.h"
 #include "mruby/string.h"
+#include "mruby/variable.h"
 #include "mruby/ext/ssh.h"
 #include "mruby/ext/sftp.h"
 
+#include <time.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libssh2_sftp.h>
 
 static void
@@ -44,6 +52,9 @@ mrb_sftp_session_free (mrb_state *mrb, void *p)
 
     data = (mrb_sftp_t *)p;
 
+    mrb_sftp_transfer_release(data);
+    mrb_sftp_pipe_free(mrb, data->session->data && mrb_ssh_initialized() ? (mrb_ssh_t *)data->session->data : NULL, data->pipe);
+
     if (data->sftp && data->session->data && mrb_ssh_initialized()) {
         while (libssh2_sftp_shutdown(data->sftp) == LIBSSH2_ERROR_EAGAIN) {
             mrb_ssh_wait_sock((mrb_ssh_t *)data->session->data);
@@ -70,10 +81,37 @@ mrb_sftp_ssh_session (mrb_value self)
 }
 
 static void
-mrb_sftp_raise_unless_connected (mrb_state *mrb, LIBSSH2_SFTP *sftp)
+mrb_sftp_raise_if_closed (mrb_state *mrb, mrb_value self)
+{
+    if (!(mrb_sftp_session(self) && mrb_ssh_initialized())) {
+        mrb_raise(mrb, E_SFTP_NOT_CONNECTED_ERROR, "SFTP session not connected.");
+    }
+}
+
+static void
+mrb_sftp_raise_unless_connected (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_raise_if_closed(mrb, self);
+    mrb_sftp_raise_if_busy(mrb, self);
+}
+
+static int
+mrb_sftp_settle (mrb_value self, struct mrb_sftp_transfer *turn, int ret)
+{
+    if (ret == LIBSSH2_ERROR_SFTP_PROTOCOL) {
+        ret = libssh2_sftp_last_error(mrb_sftp_session(self));
+    }
+
+    mrb_sftp_resume(turn);
+
+    return ret;
+}
+
+static void
+mrb_sftp_raise_unless_ok (mrb_state *mrb, int ret, const char *msg)
 {
-    if (sftp && mrb_ssh_initialized()) return;
-    mrb_raise(mrb, E_SFTP_NOT_CONNECTED_ERROR, "SFTP session not connected.");
+    mrb_sftp_raise_poll_error(mrb, ret);
+    mrb_sftp_raise(mrb, ret, msg);
 }
 
 static int
@@ -84,25 +122,36 @@ mrb_sftp_stat (mrb_state *mrb, mrb_value self, LIBSSH2_SFTP_ATTRIBUTES *attrs, i
 
     LIBSSH2_SFTP *sftp = mrb_sftp_session(self);
     LIBSSH2_SFTP_HANDLE *handle;
+    struct mrb_sftp_transfer *turn;
 
-    mrb_sftp_raise_unless_connected(mrb, sftp);
+    mrb_sftp_raise_if_closed(mrb, self);
 
     mrb_get_args(mrb, "o", &obj);
 
     if (mrb_string_p(obj)) {
-        while ((ret = libssh2_sftp_stat_ex(sftp, RSTRING_PTR(obj), RSTRING_LEN(obj), type, attrs)) == LIBSSH2SFTP_EAGAIN);
-        goto done;
+        turn = mrb_sftp_pause(self);
+
+        while ((ret = libssh2_sftp_stat_ex(sftp, RSTRING_PTR(obj), RSTRING_LEN(obj), type, attrs)) == LIBSSH2SFTP_EAGAIN) {
+            if ((ret = mrb_sftp_poll(self)) < 0) break;
+        }
+
+        ret = mrb_sftp_settle(self, turn, ret);
+        mrb_sftp_raise_poll_error(mrb, ret);
+
+        return ret;
     }
 
+    mrb_sftp_raise_if_busy(mrb, self);
+
     handle = mrb_sftp_handle(mrb, obj);
 
     if (!handle) {
         mrb_raise(mrb, E_SFTP_HANDLE_CLOSED_ERROR, "SFTP handle not opened.");
     }
 
-    while ((ret = libssh2_sftp_fstat(handle, attrs)) == LIBSSH2SFTP_EAGAIN);
-
-  done:
+    while ((ret = libssh2_sftp_fstat(handle, attrs)) == LIBSSH2SFTP_EAGAIN) {
+        mrb_sftp_wait(mrb, self);
+    }
 
     if (ret == LIBSSH2_ERROR_SFTP_PROTOCOL) {
         ret = libssh2_sftp_last_error(sftp);
@@ -111,11 +160,731 @@ mrb_sftp_stat (mrb_state *mrb, mrb_value self, LIBSSH2_SFTP_ATTRIBUTES *attrs, i
     return ret;
 }
 
+typedef struct mrb_sftp_many
+{
+    mrb_value paths;
+    mrb_value res;
+    mrb_value attrs;
+    unsigned char type;
+    const char *msg;
+} mrb_sftp_many_t;
+
+typedef struct mrb_sftp_scan
+{
+    mrb_value parents;
+    mrb_value bytes;
+    mrb_int base;
+    mrb_int files;
+    mrb_int dirs;
+    mrb_int links;
+    mrb_int others;
+    mrb_int total;
+    mrb_int sizes[65];
+    mrb_int ages[7];
+    unsigned long now;
+} mrb_sftp_scan_t;
+
+typedef struct mrb_sftp_tree
+{
+    mrb_sftp_many_t many;
+    mrb_sftp_scan_t *scan;
+    mrb_value dirs;
+    mrb_value handles;
+    mrb_value files;
+    mrb_value subdirs;
+    mrb_value errs;
+    mrb_int removed;
+} mrb_sftp_tree_t;
+
+static unsigned long const mrb_sftp_scan_ages[] = { 3600, 86400, 604800, 2592000, 7776000, 31536000 };
+
+static void
+mrb_sftp_forget (mrb_state *mrb, mrb_value self, mrb_value path)
+{
+    mrb_value cache = mrb_attr_get(mrb, self, mrb_intern_static(mrb, "@handles", 8));
+
+    if (mrb_test(cache)) {
+        mrb_funcall(mrb, cache, "invalidate", 1, path);
+    }
+}
+
+static mrb_value
+mrb_sftp_paths (mrb_state *mrb)
+{
+    mrb_value paths, path;
+    mrb_int i;
+
+    mrb_get_args(mrb, "A", &paths);
+
+    for (i = 0; i < RARRAY_LEN(paths); i++) {
+        path = mrb_ary_ref(mrb, paths, i);
+
+        if (!mrb_string_p(path)) {
+            mrb_raise(mrb, E_TYPE_ERROR, "String expected.");
+        }
+    }
+
+    return paths;
+}
+
+static void
+mrb_sftp_path_req (mrb_state *mrb, mrb_sftp_pipe_t *pipe, void *ctx, mrb_int idx)
+{
+    mrb_sftp_many_t *many = (mrb_sftp_many_t *)ctx;
+    mrb_value path        = mrb_ary_ref(mrb, many->paths, idx);
+
+    mrb_sftp_pipe_begin(mrb, pipe, many->type);
+    mrb_sftp_pipe_put_str(mrb, pipe, RSTRING_PTR(path), RSTRING_LEN(path));
+    mrb_sftp_pipe_end(mrb, pipe);
+}
+
+static void
+mrb_sftp_stat_rep (mrb_state *mrb, void *ctx, mrb_int idx, mrb_sftp_reply_t *reply)
+{
+    mrb_sftp_many_t *many = (mrb_sftp_many_t *)ctx;
+    int arena             = mrb_gc_arena_save(mrb);
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    mrb_value val;
+
+    if (reply->type == SSH_FXP_ATTRS && mrb_sftp_reply_attrs(reply, &attrs)) {
+        val = mrb_sftp_stat_obj(mrb, &attrs);
+    } else {
+        val = mrb_sftp_reply_error(mrb, reply, "Failed to stat the path specified.");
+    }
+
+    mrb_ary_set(mrb, many->res, idx, val);
+    mrb_gc_arena_restore(mrb, arena);
+}
+
+static void
+mrb_sftp_exist_rep (mrb_state *mrb, void *ctx, mrb_int idx, mrb_sftp_reply_t *reply)
+{
+    mrb_sftp_many_t *many = (mrb_sftp_many_t *)ctx;
+    int arena             = mrb_gc_arena_save(mrb);
+    mrb_value val;
+
+    if (reply->type == SSH_FXP_ATTRS) {
+        val = mrb_true_value();
+    } else {
+        switch (mrb_sftp_reply_status(reply, NULL, NULL)) {
+            case LIBSSH2_FX_NO_SUCH_FILE:
+            case LIBSSH2_FX_NO_SUCH_PATH:
+            case LIBSSH2_FX_INVALID_FILENAME:
+                val = mrb_false_value();
+                break;
+            default:
+                val = mrb_sftp_reply_error(mrb, reply, "Failed to stat the path specified.");
+        }
+    }
+
+    mrb_ary_set(mrb, many->res, idx, val);
+    mrb_gc_arena_restore(mrb, arena);
+}
+
+static mrb_value
+mrb_sftp_stat_many (mrb_state *mrb, mrb_value self, unsigned char type, mrb_sftp_pipe_rep_f rep)
+{
+    mrb_sftp_many_t many;
+
+    mrb_sftp_raise_unless_connected(mrb, self);
+
+    many.paths = mrb_sftp_paths(mrb);
+    many.res   = mrb_ary_new_capa(mrb, RARRAY_LEN(many.paths));
+    many.type  = type;
+
+    if (RARRAY_LEN(many.paths) > 0) {
+        mrb_ary_set(mrb, many.res, RARRAY_LEN(many.paths) - 1, mrb_nil_value());
+        mrb_sftp_pipe_batch(mrb, self, RARRAY_LEN(many.paths), mrb_sftp_path_req, rep, &many);
+    }
+
+    return many.res;
+}
+
+static mrb_value
+mrb_sftp_f_stat_many (mrb_state *mrb, mrb_value self)
+{
+    return mrb_sftp_stat_many(mrb, self, SSH_FXP_STAT, mrb_sftp_stat_rep);
+}
+
+static mrb_value
+mrb_sftp_f_lstat_many (mrb_state *mrb, mrb_value self)
+{
+    return mrb_sftp_stat_many(mrb, self, SSH_FXP_LSTAT, mrb_sftp_stat_rep);
+}
+
+static mrb_value
+mrb_sftp_f_exist_many (mrb_state *mrb, mrb_value self)
+{
+    return mrb_sftp_stat_many(mrb, self, SSH_FXP_STAT, mrb_sftp_exist_rep);
+}
+
+static void
+mrb_sftp_status_rep (mrb_state *mrb, void *ctx, mrb_int idx, mrb_sftp_reply_t *reply)
+{
+    mrb_sftp_many_t *many = (mrb_sftp_many_t *)ctx;
+    int arena             = mrb_gc_arena_save(mrb);
+    int err               = mrb_sftp_reply_status(reply, NULL, NULL);
+
+    mrb_ary_set(mrb, many->res, idx, err == LIBSSH2_FX_OK ? mrb_true_value() : mrb_sftp_error(mrb, err, many->msg));
+    mrb_gc_arena_restore(mrb, arena);
+}
+
+static void
+mrb_sftp_kind_rep (mrb_state *mrb, void *ctx, mrb_int idx, mrb_sftp_reply_t *reply)
+{
+    mrb_sftp_many_t *many = (mrb_sftp_many_t *)ctx;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    mrb_int kind;
+
+    if (reply->type == SSH_FXP_ATTRS && mrb_sftp_reply_attrs(reply, &attrs)) {
+        kind = (attrs.permissions & LIBSSH2_SFTP_S_IFMT) == LIBSSH2_SFTP_S_IFDIR ? 1 : 2;
+    } else {
+        kind = -mrb_sftp_reply_status(reply, NULL, NULL);
+    }
+
+    mrb_ary_set(mrb, many->res, idx, mrb_fixnum_value(kind));
+}
+
+static void
+mrb_sftp_attrs_req (mrb_state *mrb, mrb_sftp_pipe_t *pipe, void *ctx, mrb_int idx)
+{
+    mrb_sftp_many_t *many = (mrb_sftp_many_t *)ctx;
+    mrb_value path        = mrb_ary_ref(mrb, many->paths, idx);
+    mrb_value opts        = mrb_array_p(many->attrs) ? mrb_ary_ref(mrb, many->attrs, idx) : many->attrs;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+    if (!mrb_hash_p(opts)) {
+        mrb_raise(mrb, E_TYPE_ERROR, "Hash expected.");
+    }
+
+    mrb_sftp_hash_to_stat(mrb, opts, &attrs);
+
+    mrb_sftp_pipe_begin(mrb, pipe, many->type);
+    mrb_sftp_pipe_put_str(mrb, pipe, RSTRING_PTR(path), RSTRING_LEN(path));
+    mrb_sftp_pipe_put_attrs(mrb, pipe, &attrs);
+    mrb_sftp_pipe_end(mrb, pipe);
+}
+
+static mrb_value
+mrb_sftp_run_many (mrb_state *mrb, mrb_value self, mrb_sftp_many_t *many, mrb_sftp_pipe_req_f req, mrb_sftp_pipe_rep_f rep)
+{
+    mrb_int len = RARRAY_LEN(many->paths);
+
+    many->res = mrb_ary_new_capa(mrb, len);
+
+    if (len > 0) {
+        mrb_ary_set(mrb, many->res, len - 1, mrb_nil_value());
+        mrb_sftp_pipe_batch(mrb, self, len, req, rep, many);
+    }
+
+    return many->res;
+}
+
+static mrb_value
+mrb_sftp_f_delete_many (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_many_t many;
+    mrb_int i;
+
+    mrb_sftp_raise_unless_connected(mrb, self);
+
+    many.paths = mrb_sftp_paths(mrb);
+    many.type  = SSH_FXP_REMOVE;
+
+    for (i = 0; i < RARRAY_LEN(many.paths); i++) {
+        mrb_sftp_forget(mrb, self, mrb_ary_ref(mrb, many.paths, i));
+    }
+    many.msg   = "Failed to delete the file specified.";
+
+    return mrb_sftp_run_many(mrb, self, &many, mrb_sftp_path_req, mrb_sftp_status_rep);
+}
+
+static mrb_value
+mrb_sftp_f_setstat_many (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_many_t many;
+    mrb_value paths, attrs, path;
+    mrb_int i;
+
+    mrb_sftp_raise_unless_connected(mrb, self);
+
+    mrb_get_args(mrb, "Ao", &paths, &attrs);
+
+    for (i = 0; i < RARRAY_LEN(paths); i++) {
+        path = mrb_ary_ref(mrb, paths, i);
+
+        if (!mrb_string_p(path)) {
+            mrb_raise(mrb, E_TYPE_ERROR, "String expected.");
+        }
+    }
+
+    if (mrb_array_p(attrs) && RARRAY_LEN(attrs) != RARRAY_LEN(paths)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Expected one attribute hash per path.");
+    }
+
+    many.paths = paths;
+    many.attrs = attrs;
+    many.type  = SSH_FXP_SETSTAT;
+    many.msg   = "Failed to set the stats as specified.";
+
+    return mrb_sftp_run_many(mrb, self, &many, mrb_sftp_attrs_req, mrb_sftp_status_rep);
+}
+
+static void
+mrb_sftp_mkdir_req (mrb_state *mrb, mrb_sftp_pipe_t *pipe, void *ctx, mrb_int idx)
+{
+    mrb_sftp_many_t *many = (mrb_sftp_many_t *)ctx;
+    mrb_value path        = mrb_ary_ref(mrb, many->paths, idx);
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+    attrs.flags       = LIBSSH2_SFTP_ATTR_PERMISSIONS;
+    attrs.permissions = mrb_fixnum(many->attrs);
+
+    mrb_sftp_pipe_begin(mrb, pipe, SSH_FXP_MKDIR);
+    mrb_sftp_pipe_put_str(mrb, pipe, RSTRING_PTR(path), RSTRING_LEN(path));
+    mrb_sftp_pipe_put_attrs(mrb, pipe, &attrs);
+    mrb_sftp_pipe_end(mrb, pipe);
+}
+
+static mrb_value
+mrb_sftp_f_mkdir_p (mrb_state *mrb, mrb_value self)
+{
+    mrb_int mode = 0000733, created = 0, i, kind;
+    mrb_sftp_many_t many;
+    const char *path;
+    mrb_value levels, res, level;
+    mrb_int len;
+
+    mrb_sftp_raise_unless_connected(mrb, self);
+
+    mrb_get_args(mrb, "s|i", &path, &len, &mode);
+
+    while (len > 1 && path[len - 1] == '/') len--;
+
+    levels = mrb_ary_new(mrb);
+
+    for (i = 1; i <= len; i++) {
+        if ((i == len || path[i] == '/') && path[i - 1] != '/') {
+            mrb_ary_push(mrb, levels, mrb_str_new(mrb, path, i));
+        }
+    }
+
+    many.paths = levels;
+    many.type  = SSH_FXP_STAT;
+    res        = mrb_sftp_run_many(mrb, self, &many, mrb_sftp_path_req, mrb_sftp_kind_rep);
+
+    for (i = RARRAY_LEN(levels) - 1; i >= 0; i--) {
+        kind = mrb_fixnum(mrb_ary_ref(mrb, res, i));
+
+        if (kind == 2) {
+            mrb_sftp_raise(mrb, LIBSSH2_FX_NOT_A_DIRECTORY, "Failed to create the dir specified.");
+        }
+
+        if (kind == 1) break;
+    }
+
+    if (i == RARRAY_LEN(levels) - 1)
+        return mrb_fixnum_value(0);
+
+    many.paths = mrb_ary_new_from_values(mrb, RARRAY_LEN(levels) - i - 1, RARRAY_PTR(levels) + i + 1);
+    many.attrs = mrb_fixnum_value(mode);
+    many.msg   = "Failed to create the dir specified.";
+    res        = mrb_sftp_run_many(mrb, self, &many, mrb_sftp_mkdir_req, mrb_sftp_status_rep);
+    levels     = many.paths;
+
+    for (i = 0; i < RARRAY_LEN(levels); i++) {
+        if (mrb_true_p(mrb_ary_ref(mrb, res, i))) {
+            created++;
+            continue;
+        }
+
+        level      = mrb_ary_ref(mrb, levels, i);
+        many.paths = mrb_ary_new_from_values(mrb, 1, &level);
+
+        if (mrb_true_p(mrb_ary_ref(mrb, mrb_sftp_run_many(mrb, self, &many, mrb_sftp_mkdir_req, mrb_sftp_status_rep), 0))) {
+            created++;
+            continue;
+        }
+
+        many.type = SSH_FXP_STAT;
+
+        if (mrb_fixnum(mrb_ary_ref(mrb, mrb_sftp_run_many(mrb, self, &many, mrb_sftp_path_req, mrb_sftp_kind_rep), 0)) != 1) {
+            mrb_exc_raise(mrb, mrb_ary_ref(mrb, res, i));
+        }
+    }
+
+    return mrb_fixnum_value(created);
+}
+
+static void
+mrb_sftp_tree_error (mrb_state *mrb, mrb_sftp_tree_t *tree, int err, const char *msg)
+{
+    if (err == LIBSSH2_FX_OK || err == LIBSSH2_FX_EOF || err == LIBSSH2_FX_NO_SUCH_FILE) return;
+
+    mrb_ary_push(mrb, tree->errs, mrb_sftp_error(mrb, err, msg));
+}
+
+static void
+mrb_sftp_scan_add (mrb_state *mrb, mrb_sftp_scan_t *scan, mrb_int dir, LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    unsigned long type = attrs->permissions & LIBSSH2_SFTP_S_IFMT;
+    libssh2_uint64_t size;
+    mrb_int bit, age;
+
+    if (type == LIBSSH2_SFTP_S_IFDIR) {
+        scan->dirs++;
+        mrb_ary_push(mrb, scan->parents, mrb_fixnum_value(dir));
+        mrb_ary_push(mrb, scan->bytes, mrb_fixnum_value(0));
+        return;
+    }
+
+    if (type == LIBSSH2_SFTP_S_IFREG) {
+        scan->files++;
+    } else
+    if (type == LIBSSH2_SFTP_S_IFLNK) {
+        scan->links++;
+    } else {
+        scan->others++;
+    }
+
+    if (attrs->flags & LIBSSH2_SFTP_ATTR_SIZE) {
+        size = attrs->filesize;
+
+        for (bit = 0; size > 0; bit++) size >>= 1;
+
+        scan->sizes[bit]++;
+        scan->total += (mrb_int)attrs->filesize;
+
+        mrb_ary_set(mrb, scan->bytes, dir, mrb_fixnum_value(mrb_fixnum(mrb_ary_ref(mrb, scan->bytes, dir)) + (mrb_int)attrs->filesize));
+    }
+
+    if (attrs->flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
+        for (age = 0; age < 6 && attrs->mtime + mrb_sftp_scan_ages[age] < scan->now; age++);
+        scan->ages[age]++;
+    }
+}
+
+static void
+mrb_sftp_tree_readdir (mrb_state *mrb, mrb_sftp_pipe_t *pipe, mrb_sftp_tree_t *tree, mrb_int idx, mrb_value dir, mrb_sftp_reply_t *reply)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    uint32_t count, name_len, long_len;
+    const char *name, *longname;
+    mrb_value path;
+    mrb_bool is_dir;
+
+    if (!mrb_sftp_reply_u32(reply, &count)) return;
+
+    while (count-- > 0) {
+        if (!(mrb_sftp_reply_str(reply, &name, &name_len) && mrb_sftp_reply_str(reply, &longname, &long_len) && mrb_sftp_reply_attrs(reply, &attrs)))
+            break;
+
+        if ((name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.'))
+            continue;
+
+        is_dir = (attrs.permissions & LIBSSH2_SFTP_S_IFMT) == LIBSSH2_SFTP_S_IFDIR;
+
+        if (tree->scan) {
+            mrb_sftp_scan_add(mrb, tree->scan, tree->scan->base + idx, &attrs);
+            if (!is_dir) continue;
+        }
+
+        path = mrb_str_dup(mrb, dir);
+
+        if (RSTRING_LEN(dir) == 0 || RSTRING_PTR(dir)[RSTRING_LEN(dir) - 1] != '/') {
+            mrb_str_cat_lit(mrb, path, "/");
+        }
+
+        mrb_str_cat(mrb, path, name, name_len);
+
+        if (is_dir) {
+            mrb_ary_push(mrb, tree->subdirs, path);
+        } else {
+            mrb_ary_push(mrb, tree->files, path);
+        }
+    }
+}
+
+static void
+mrb_sftp_tree_handle_req (mrb_state *mrb, mrb_sftp_pipe_t *pipe, unsigned char type, mrb_value handle)
+{
+    mrb_sftp_pipe_begin(mrb, pipe, type);
+    mrb_sftp_pipe_put_str(mrb, pipe, RSTRING_PTR(handle), RSTRING_LEN(handle));
+    mrb_sftp_pipe_end(mrb, pipe);
+}
+
+static void
+mrb_sftp_tree_step (mrb_state *mrb, mrb_sftp_pipe_t *pipe, void *ctx, mrb_int idx, mrb_sftp_reply_t *reply)
+{
+    mrb_sftp_tree_t *tree = (mrb_sftp_tree_t *)ctx;
+    mrb_value dir         = mrb_ary_ref(mrb, tree->dirs, idx);
+    mrb_value handle      = mrb_ary_ref(mrb, tree->handles, idx);
+    int arena             = mrb_gc_arena_save(mrb);
+    const char *str;
+    uint32_t len;
+
+    if (!reply) {
+        mrb_sftp_pipe_begin(mrb, pipe, SSH_FXP_OPENDIR);
+        mrb_sftp_pipe_put_str(mrb, pipe, RSTRING_PTR(dir), RSTRING_LEN(dir));
+        mrb_sftp_pipe_end(mrb, pipe);
+    } else
+    if (reply->type == SSH_FXP_HANDLE && mrb_nil_p(handle) && mrb_sftp_reply_str(reply, &str, &len)) {
+        handle = mrb_str_new(mrb, str, len);
+        mrb_ary_set(mrb, tree->handles, idx, handle);
+        mrb_sftp_tree_handle_req(mrb, pipe, SSH_FXP_READDIR, handle);
+    } else
+    if (reply->type == SSH_FXP_NAME && mrb_string_p(handle)) {
+        mrb_sftp_tree_readdir(mrb, pipe, tree, idx, dir, reply);
+        mrb_sftp_tree_handle_req(mrb, pipe, SSH_FXP_READDIR, handle);
+    } else
+    if (mrb_string_p(handle)) {
+        mrb_sftp_tree_error(mrb, tree, mrb_sftp_reply_status(reply, NULL, NULL), "Failed to read the dir specified.");
+        mrb_sftp_tree_handle_req(mrb, pipe, SSH_FXP_CLOSE, handle);
+        mrb_ary_set(mrb, tree->handles, idx, mrb_true_value());
+    } else
+    if (mrb_nil_p(handle)) {
+        mrb_sftp_tree_error(mrb, tree, mrb_sftp_reply_status(reply, NULL, NULL), "Failed to open the dir specified.");
+    }
+
+    mrb_gc_arena_restore(mrb, arena);
+}
+
+static void
+mrb_sftp_tree_rep (mrb_state *mrb, void *ctx, mrb_int idx, mrb_sftp_reply_t *reply)
+{
+    mrb_sftp_tree_t *tree = (mrb_sftp_tree_t *)ctx;
+    int err               = mrb_sftp_reply_status(reply, NULL, NULL);
+
+    if (err == LIBSSH2_FX_OK) {
+        tree->removed++;
+    } else {
+        mrb_sftp_tree_error(mrb, tree, err, "Failed to remove the path specified.");
+    }
+}
+
+static void
+mrb_sftp_tree_remove (mrb_state *mrb, mrb_value self, mrb_sftp_tree_t *tree, mrb_value paths, unsigned char type)
+{
+    if (RARRAY_LEN(paths) == 0) return;
+
+    tree->many.paths = paths;
+    tree->many.type  = type;
+
+    mrb_sftp_pipe_batch(mrb, self, RARRAY_LEN(paths), mrb_sftp_path_req, mrb_sftp_tree_rep, tree);
+}
+
+static mrb_value
+mrb_sftp_f_rm_rf (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_many_t many;
+    mrb_sftp_tree_t tree;
+    mrb_value path, levels;
+    mrb_int i, kind;
+
+    mrb_sftp_raise_unless_connected(mrb, self);
+
+    mrb_get_args(mrb, "S", &path);
+
+    mrb_sftp_forget(mrb, self, path);
+
+    many.paths = mrb_ary_new_from_values(mrb, 1, &path);
+    many.type  = SSH_FXP_LSTAT;
+    kind       = mrb_fixnum(mrb_ary_ref(mrb, mrb_sftp_run_many(mrb, self, &many, mrb_sftp_path_req, mrb_sftp_kind_rep), 0));
+
+    tree.errs    = mrb_ary_new(mrb);
+    tree.scan    = NULL;
+    tree.removed = 0;
+
+    if (kind == -(mrb_int)LIBSSH2_FX_NO_SUCH_FILE)
+        return mrb_fixnum_value(0);
+
+    if (kind < 0) {
+        mrb_sftp_raise(mrb, -kind, "Failed to remove the path specified.");
+    }
+
+    if (kind == 2) {
+        mrb_sftp_tree_remove(mrb, self, &tree, many.paths, SSH_FXP_REMOVE);
+        goto done;
+    }
+
+    levels    = mrb_ary_new(mrb);
+    tree.dirs = many.paths;
+
+    while (RARRAY_LEN(tree.dirs) > 0) {
+        mrb_ary_push(mrb, levels, tree.dirs);
+
+        tree.handles = mrb_ary_new(mrb);
+        tree.files   = mrb_ary_new(mrb);
+        tree.subdirs = mrb_ary_new(mrb);
+
+        mrb_sftp_pipe_run(mrb, self, RARRAY_LEN(tree.dirs), mrb_sftp_tree_step, &tree);
+        mrb_sftp_tree_remove(mrb, self, &tree, tree.files, SSH_FXP_REMOVE);
+
+        tree.dirs = tree.subdirs;
+    }
+
+    for (i = RARRAY_LEN(levels) - 1; i >= 0; i--) {
+        mrb_sftp_tree_remove(mrb, self, &tree, mrb_ary_ref(mrb, levels, i), SSH_FXP_RMDIR);
+    }
+
+  done:
+
+    if (RARRAY_LEN(tree.errs) > 0) {
+        mrb_exc_raise(mrb, mrb_ary_ref(mrb, tree.errs, 0));
+    }
+
+    return mrb_fixnum_value(tree.removed);
+}
+
+static inline void
+mrb_sftp_scan_set (mrb_state *mrb, mrb_value hash, const char *key, mrb_value val)
+{
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_cstr(mrb, key)), val);
+}
+
+static mrb_value
+mrb_sftp_scan_hash (mrb_state *mrb, mrb_sftp_scan_t *scan, mrb_sftp_tree_t *tree, mrb_value levels, mrb_bool du)
+{
+    static const char *ages[] = { "hour", "day", "week", "month", "quarter", "year", "older" };
+    mrb_value res = mrb_hash_new(mrb);
+    mrb_value sizes, hist, dirs, level;
+    mrb_int i, j, k, parent, last = 0;
+
+    mrb_sftp_scan_set(mrb, res, "files", mrb_fixnum_value(scan->files));
+    mrb_sftp_scan_set(mrb, res, "dirs", mrb_fixnum_value(scan->dirs));
+    mrb_sftp_scan_set(mrb, res, "links", mrb_fixnum_value(scan->links));
+    mrb_sftp_scan_set(mrb, res, "others", mrb_fixnum_value(scan->others));
+    mrb_sftp_scan_set(mrb, res, "bytes", mrb_fixnum_value(scan->total));
+    mrb_sftp_scan_set(mrb, res, "errors", mrb_fixnum_value(RARRAY_LEN(tree->errs)));
+
+    for (i = 0; i < 65; i++) {
+        if (scan->sizes[i] > 0) last = i;
+    }
+
+    sizes = mrb_hash_new(mrb);
+
+    for (i = 0; i <= last; i++) {
+        mrb_hash_set(mrb, sizes, mrb_fixnum_value(i == 0 ? 0 : (mrb_int)1 << (i - 1)), mrb_fixnum_value(scan->sizes[i]));
+    }
+
+    hist = mrb_hash_new(mrb);
+
+    for (i = 0; i < 7; i++) {
+        mrb_sftp_scan_set(mrb, hist, ages[i], mrb_fixnum_value(scan->ages[i]));
+    }
+
+    mrb_sftp_scan_set(mrb, res, "sizes", sizes);
+    mrb_sftp_scan_set(mrb, res, "ages", hist);
+
+    if (!du) return res;
+
+    for (i = RARRAY_LEN(scan->parents) - 1; i > 0; i--) {
+        parent = mrb_fixnum(mrb_ary_ref(mrb, scan->parents, i));
+        mrb_ary_set(mrb, scan->bytes, parent, mrb_fixnum_value(mrb_fixnum(mrb_ary_ref(mrb, scan->bytes, parent)) + mrb_fixnum(mrb_ary_ref(mrb, scan->bytes, i))));
+    }
+
+    dirs = mrb_hash_new(mrb);
+
+    for (i = 0, k = 0; i < RARRAY_LEN(levels); i++) {
+        level = mrb_ary_ref(mrb, levels, i);
+
+        for (j = 0; j < RARRAY_LEN(level); j++, k++) {
+            mrb_hash_set(mrb, dirs, mrb_ary_ref(mrb, level, j), mrb_ary_ref(mrb, scan->bytes, k));
+        }
+    }
+
+    mrb_sftp_scan_set(mrb, res, "du", dirs);
+
+    return res;
+}
+
+static mrb_value
+mrb_sftp_f_scan (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_many_t many;
+    mrb_sftp_scan_t scan;
+    mrb_sftp_tree_t tree;
+    mrb_value path, levels;
+    mrb_bool du = FALSE;
+    mrb_int kind;
+
+    mrb_sftp_raise_unless_connected(mrb, self);
+
+    mrb_get_args(mrb, "S|b", &path, &du);
+
+    many.paths = mrb_ary_new_from_values(mrb, 1, &path);
+    many.type  = SSH_FXP_STAT;
+    kind       = mrb_fixnum(mrb_ary_ref(mrb, mrb_sftp_run_many(mrb, self, &many, mrb_sftp_path_req, mrb_sftp_kind_rep), 0));
+
+    if (kind < 0) {
+        mrb_sftp_raise(mrb, -kind, "Failed to scan the dir specified.");
+    }
+
+    if (kind == 2) {
+        mrb_sftp_raise(mrb, LIBSSH2_FX_NOT_A_DIRECTORY, "Failed to scan the dir specified.");
+    }
+
+    memset(&scan, 0, sizeof(mrb_sftp_scan_t));
+
+    scan.parents = mrb_ary_new(mrb);
+    scan.bytes   = mrb_ary_new(mrb);
+    scan.now     = (unsigned long)time(NULL);
+
+    mrb_ary_push(mrb, scan.parents, mrb_fixnum_value(-1));
+    mrb_ary_push(mrb, scan.bytes, mrb_fixnum_value(0));
+
+    tree.errs = mrb_ary_new(mrb);
+    tree.scan = &scan;
+    tree.dirs = many.paths;
+    levels    = mrb_ary_new(mrb);
+
+    while (RARRAY_LEN(tree.dirs) > 0) {
+        mrb_ary_push(mrb, levels, tree.dirs);
+
+        tree.handles = mrb_ary_new(mrb);
+        tree.files   = mrb_ary_new(mrb);
+        tree.subdirs = mrb_ary_new(mrb);
+
+        mrb_sftp_pipe_run(mrb, self, RARRAY_LEN(tree.dirs), mrb_sftp_tree_step, &tree);
+
+        scan.base += RARRAY_LEN(tree.dirs);
+        tree.dirs  = tree.subdirs;
+    }
+
+    return mrb_sftp_scan_hash(mrb, &scan, &tree, levels, du);
+}
+
+static void
+mrb_sftp_session_attach (mrb_state *mrb, mrb_value self, mrb_value session, LIBSSH2_SFTP *sftp)
+{
+    mrb_sftp_t *data = mrb_malloc(mrb, sizeof(mrb_sftp_t));
+
+    data->session  = mrb_ptr(session);
+    data->sftp     = sftp;
+    data->pipe     = NULL;
+    data->timeout  = 0;
+    data->deadline = 0;
+    data->transfer = NULL;
+
+    mrb_data_init(self, data, &mrb_sftp_session_type);
+}
+
+mrb_value
+mrb_sftp_session_new (mrb_state *mrb, mrb_value session, LIBSSH2_SFTP *sftp)
+{
+    struct RClass *cls = mrb_class_get_under(mrb, mrb_module_get(mrb, "SFTP"), "Session");
+    mrb_value self     = mrb_obj_value(mrb_data_object_alloc(mrb, cls, NULL, &mrb_sftp_session_type));
+
+    mrb_iv_set(mrb, self, mrb_intern_static(mrb, "@session", 8), session);
+    mrb_sftp_session_attach(mrb, self, session, sftp);
+
+    return self;
+}
+
 static mrb_value
 mrb_sftp_f_connect (mrb_state *mrb, mrb_value self)
 {
     LIBSSH2_SFTP *sftp;
-    mrb_sftp_t *data;
     mrb_ssh_t *ssh;
     mrb_value session;
 
@@ -144,11 +913,7 @@ mrb_sftp_f_connect (mrb_state *mrb, mrb_value self)
         }
     } while (!sftp);
 
-    data          = mrb_malloc(mrb, sizeof(mrb_sftp_t));
-    data->session = mrb_ptr(session);
-    data->sftp    = sftp;
-
-    mrb_data_init(self, data, &mrb_sftp_session_type);
+    mrb_sftp_session_attach(mrb, self, session, sftp);
 
     return mrb_nil_value();
 }
@@ -156,13 +921,8 @@ mrb_sftp_f_connect (mrb_state *mrb, mrb_value self)
 static mrb_value
 mrb_sftp_f_exist (mrb_state *mrb, mrb_value self)
 {
-    LIBSSH2_SFTP_ATTRIBUTES *attrs;
-    int err;
-
-    attrs = mrb_malloc(mrb, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
-    err   = mrb_sftp_stat(mrb, self, attrs, LIBSSH2_SFTP_STAT);
-
-    mrb_free(mrb, attrs);
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    int err = mrb_sftp_stat(mrb, self, &attrs, LIBSSH2_SFTP_STAT);
 
     switch(err) {
         case LIBSSH2_FX_OK:
@@ -184,12 +944,20 @@ mrb_sftp_f_rpath (mrb_state *mrb, mrb_value self)
     mrb_int len;
 
     LIBSSH2_SFTP *sftp = mrb_sftp_session(self);
+    struct mrb_sftp_transfer *turn;
+    int ret;
 
-    mrb_sftp_raise_unless_connected(mrb, sftp);
+    mrb_sftp_raise_if_closed(mrb, self);
 
     mrb_get_args(mrb, "s", &path, &len);
 
-    while (libssh2_sftp_symlink_ex(sftp, path, len, rpath, 256, LIBSSH2_SFTP_REALPATH) == LIBSSH2SFTP_EAGAIN);
+    turn = mrb_sftp_pause(self);
+
+    while ((ret = libssh2_sftp_symlink_ex(sftp, path, len, rpath, 256, LIBSSH2_SFTP_REALPATH)) == LIBSSH2SFTP_EAGAIN) {
+        if ((ret = mrb_sftp_poll(self)) < 0) break;
+    }
+
+    mrb_sftp_raise_poll_error(mrb, mrb_sftp_settle(self, turn, ret));
 
     return mrb_str_new_cstr(mrb, rpath);
 }
@@ -197,49 +965,28 @@ mrb_sftp_f_rpath (mrb_state *mrb, mrb_value self)
 static mrb_value
 mrb_sftp_f_stat (mrb_state *mrb, mrb_value self)
 {
-    LIBSSH2_SFTP_ATTRIBUTES *attrs;
-    mrb_value stat;
-    int ret;
-
-    attrs = mrb_malloc(mrb, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
-    ret   = mrb_sftp_stat(mrb, self, attrs, LIBSSH2_SFTP_STAT);
-    stat  = mrb_sftp_stat_obj(mrb, ret == LIBSSH2_FX_OK ? attrs : NULL);
-
-    mrb_free(mrb, attrs);
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    int ret = mrb_sftp_stat(mrb, self, &attrs, LIBSSH2_SFTP_STAT);
 
-    return stat;
+    return mrb_sftp_stat_obj(mrb, ret == LIBSSH2_FX_OK ? &attrs : NULL);
 }
 
 static mrb_value
 mrb_sftp_f_lstat (mrb_state *mrb, mrb_value self)
 {
-    LIBSSH2_SFTP_ATTRIBUTES *attrs;
-    mrb_value stat;
-    int ret;
-
-    attrs = mrb_malloc(mrb, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
-    ret   = mrb_sftp_stat(mrb, self, attrs, LIBSSH2_SFTP_LSTAT);
-    stat  = mrb_sftp_stat_obj(mrb, ret == LIBSSH2_FX_OK ? attrs : NULL);
-
-    mrb_free(mrb, attrs);
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    int ret = mrb_sftp_stat(mrb, self, &attrs, LIBSSH2_SFTP_LSTAT);
 
-    return stat;
+    return mrb_sftp_stat_obj(mrb, ret == LIBSSH2_FX_OK ? &attrs : NULL);
 }
 
 static mrb_value
 mrb_sftp_f_fstat (mrb_state *mrb, mrb_value self)
 {
-    LIBSSH2_SFTP_ATTRIBUTES *attrs;
-    mrb_value stat;
-    int ret;
-
-    attrs = mrb_malloc(mrb, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
-    ret   = mrb_sftp_stat(mrb, self, attrs, LIBSSH2_SFTP_STAT);
-    stat  = mrb_sftp_stat_obj(mrb, ret == LIBSSH2_FX_OK ? attrs : NULL);
-
-    mrb_free(mrb, attrs);
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    int ret = mrb_sftp_stat(mrb, self, &attrs, LIBSSH2_SFTP_STAT);
 
-    return stat;
+    return mrb_sftp_stat_obj(mrb, ret == LIBSSH2_FX_OK ? &attrs : NULL);
 }
 
 static mrb_value
@@ -250,24 +997,24 @@ mrb_sftp_f_setstat (mrb_state *mrb, mrb_value self)
     mrb_value opts;
     int ret;
 
-    LIBSSH2_SFTP_ATTRIBUTES *attrs;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
     LIBSSH2_SFTP *sftp = mrb_sftp_session(self);
-    mrb_sftp_raise_unless_connected(mrb, sftp);
+    struct mrb_sftp_transfer *turn;
 
-    mrb_get_args(mrb, "sH", &path, &path_len, &opts);
-
-    attrs = mrb_malloc(mrb, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
+    mrb_sftp_raise_if_closed(mrb, self);
 
-    mrb_sftp_hash_to_stat(mrb, opts, attrs);
+    mrb_get_args(mrb, "sH", &path, &path_len, &opts);
 
-    while ((ret = libssh2_sftp_stat_ex(sftp, path, path_len, LIBSSH2_SFTP_SETSTAT, attrs)) == LIBSSH2SFTP_EAGAIN);
+    mrb_sftp_hash_to_stat(mrb, opts, &attrs);
 
-    mrb_free(mrb, attrs);
+    turn = mrb_sftp_pause(self);
 
-    if (ret != 0) {
-        mrb_sftp_raise_last_error(mrb, sftp, "Failed to set the stats as specified.");
+    while ((ret = libssh2_sftp_stat_ex(sftp, path, path_len, LIBSSH2_SFTP_SETSTAT, &attrs)) == LIBSSH2SFTP_EAGAIN) {
+        if ((ret = mrb_sftp_poll(self)) < 0) break;
     }
 
+    mrb_sftp_raise_unless_ok(mrb, mrb_sftp_settle(self, turn, ret), "Failed to set the stats as specified.");
+
     return mrb_nil_value();
 }
 
@@ -280,16 +1027,23 @@ mrb_sftp_f_rename (mrb_state *mrb, mrb_value self)
     int ret;
 
     LIBSSH2_SFTP *sftp = mrb_sftp_session(self);
-    mrb_sftp_raise_unless_connected(mrb, sftp);
+    struct mrb_sftp_transfer *turn;
+
+    mrb_sftp_raise_if_closed(mrb, self);
 
     mrb_get_args(mrb, "ss|i", &source, &source_len, &dest, &dest_len, &flags);
 
-    while ((ret = libssh2_sftp_rename_ex(sftp, source, source_len, dest, dest_len, flags)) == LIBSSH2SFTP_EAGAIN);
+    mrb_sftp_forget(mrb, self, mrb_str_new(mrb, source, source_len));
+    mrb_sftp_forget(mrb, self, mrb_str_new(mrb, dest, dest_len));
+
+    turn = mrb_sftp_pause(self);
 
-    if (ret != 0) {
-        mrb_sftp_raise_last_error(mrb, sftp, "Failed to rename the file or dir as specified.");
+    while ((ret = libssh2_sftp_rename_ex(sftp, source, source_len, dest, dest_len, flags)) == LIBSSH2SFTP_EAGAIN) {
+        if ((ret = mrb_sftp_poll(self)) < 0) break;
     }
 
+    mrb_sftp_raise_unless_ok(mrb, mrb_sftp_settle(self, turn, ret), "Failed to rename the file or dir as specified.");
+
     return mrb_nil_value();
 }
 
@@ -302,16 +1056,20 @@ mrb_sftp_f_symlink (mrb_state *mrb, mrb_value self)
     int ret;
 
     LIBSSH2_SFTP *sftp = mrb_sftp_session(self);
-    mrb_sftp_raise_unless_connected(mrb, sftp);
+    struct mrb_sftp_transfer *turn;
+
+    mrb_sftp_raise_if_closed(mrb, self);
 
     mrb_get_args(mrb, "ss", &path, &path_len, &target, &target_len);
 
-    while ((ret = libssh2_sftp_symlink_ex(sftp, path, path_len, target, target_len, LIBSSH2_SFTP_SYMLINK)) == LIBSSH2SFTP_EAGAIN);
+    turn = mrb_sftp_pause(self);
 
-    if (ret != 0) {
-        mrb_sftp_raise_last_error(mrb, sftp, "Failed to create the symlink specified.");
+    while ((ret = libssh2_sftp_symlink_ex(sftp, path, path_len, target, target_len, LIBSSH2_SFTP_SYMLINK)) == LIBSSH2SFTP_EAGAIN) {
+        if ((ret = mrb_sftp_poll(self)) < 0) break;
     }
 
+    mrb_sftp_raise_unless_ok(mrb, mrb_sftp_settle(self, turn, ret), "Failed to create the symlink specified.");
+
     return mrb_nil_value();
 }
 
@@ -323,16 +1081,20 @@ mrb_sftp_f_rmdir (mrb_state *mrb, mrb_value self)
     int ret;
 
     LIBSSH2_SFTP *sftp = mrb_sftp_session(self);
-    mrb_sftp_raise_unless_connected(mrb, sftp);
+    struct mrb_sftp_transfer *turn;
+
+    mrb_sftp_raise_if_closed(mrb, self);
 
     mrb_get_args(mrb, "s", &path, &path_len);
 
-    while ((ret = libssh2_sftp_rmdir_ex(sftp, path, path_len)) == LIBSSH2SFTP_EAGAIN);
+    turn = mrb_sftp_pause(self);
 
-    if (ret != 0) {
-        mrb_sftp_raise_last_error(mrb, sftp, "Failed to remove the dir specified.");
+    while ((ret = libssh2_sftp_rmdir_ex(sftp, path, path_len)) == LIBSSH2SFTP_EAGAIN) {
+        if ((ret = mrb_sftp_poll(self)) < 0) break;
     }
 
+    mrb_sftp_raise_unless_ok(mrb, mrb_sftp_settle(self, turn, ret), "Failed to remove the dir specified.");
+
     return mrb_nil_value();
 }
 
@@ -344,16 +1106,20 @@ mrb_sftp_f_mkdir (mrb_state *mrb, mrb_value self)
     int ret;
 
     LIBSSH2_SFTP *sftp = mrb_sftp_session(self);
-    mrb_sftp_raise_unless_connected(mrb, sftp);
+    struct mrb_sftp_transfer *turn;
+
+    mrb_sftp_raise_if_closed(mrb, self);
 
     mrb_get_args(mrb, "s|i", &path, &path_len, &mode);
 
-    while ((ret = libssh2_sftp_mkdir_ex(sftp, path, path_len, mode)) == LIBSSH2SFTP_EAGAIN);
+    turn = mrb_sftp_pause(self);
 
-    if (ret != 0) {
-        mrb_sftp_raise_last_error(mrb, sftp, "Failed to create the dir specified.");
+    while ((ret = libssh2_sftp_mkdir_ex(sftp, path, path_len, mode)) == LIBSSH2SFTP_EAGAIN) {
+        if ((ret = mrb_sftp_poll(self)) < 0) break;
     }
 
+    mrb_sftp_raise_unless_ok(mrb, mrb_sftp_settle(self, turn, ret), "Failed to create the dir specified.");
+
     return mrb_nil_value();
 }
 
@@ -365,22 +1131,34 @@ mrb_sftp_f_delete (mrb_state *mrb, mrb_value self)
     int ret;
 
     LIBSSH2_SFTP *sftp = mrb_sftp_session(self);
-    mrb_sftp_raise_unless_connected(mrb, sftp);
+    struct mrb_sftp_transfer *turn;
+
+    mrb_sftp_raise_if_closed(mrb, self);
 
     mrb_get_args(mrb, "s", &path, &path_len);
 
-    while ((ret = libssh2_sftp_unlink_ex(sftp, path, path_len)) == LIBSSH2SFTP_EAGAIN);
+    mrb_sftp_forget(mrb, self, mrb_str_new(mrb, path, path_len));
+
+    turn = mrb_sftp_pause(self);
 
-    if (ret != 0) {
-        mrb_sftp_raise_last_error(mrb, sftp, "Failed to delete the file specified.");
+    while ((ret = libssh2_sftp_unlink_ex(sftp, path, path_len)) == LIBSSH2SFTP_EAGAIN) {
+        if ((ret = mrb_sftp_poll(self)) < 0) break;
     }
 
+    mrb_sftp_raise_unless_ok(mrb, mrb_sftp_settle(self, turn, ret), "Failed to delete the file specified.");
+
     return mrb_nil_value();
 }
 
 static mrb_value
 mrb_sftp_f_close (mrb_state *mrb, mrb_value self)
 {
+    mrb_value cache = mrb_attr_get(mrb, self, mrb_intern_static(mrb, "@handles", 8));
+
+    if (mrb_test(cache)) {
+        mrb_funcall(mrb, cache, "clear", 0);
+    }
+
     mrb_sftp_session_free(mrb, DATA_PTR(self));
 
     DATA_PTR(self)  = NULL;
@@ -413,6 +1191,131 @@ mrb_sftp_f_last_errno (mrb_state *mrb, mrb_value self)
     return mrb_fixnum_value(err);
 }
 
+typedef struct mrb_sftp_deadline
+{
+    mrb_value self;
+    mrb_value block;
+    int64_t prev;
+} mrb_sftp_deadline_t;
+
+static mrb_int
+mrb_sftp_secs_to_ms (mrb_state *mrb, mrb_value secs)
+{
+    mrb_int ms;
+
+    if (mrb_nil_p(secs))
+        return 0;
+
+#ifndef MRB_WITHOUT_FLOAT
+    if (mrb_float_p(secs)) {
+        ms = (mrb_int)(mrb_float(secs) * 1000);
+        return ms == 0 && mrb_float(secs) > 0 ? 1 : ms;
+    }
+#endif
+
+    return mrb_fixnum(mrb_Integer(mrb, secs)) * 1000;
+}
+
+static mrb_sftp_t *
+mrb_sftp_data_bang (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_t *data = DATA_PTR(self);
+
+    if (!data) {
+        mrb_raise(mrb, E_SFTP_NOT_CONNECTED_ERROR, "SFTP session not connected.");
+    }
+
+    return data;
+}
+
+static mrb_value
+mrb_sftp_f_timeout (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_t *data = DATA_PTR(self);
+
+    if (!(data && data->timeout > 0))
+        return mrb_nil_value();
+
+#ifndef MRB_WITHOUT_FLOAT
+    return mrb_float_value(mrb, data->timeout / 1000.0);
+#else
+    return mrb_fixnum_value(data->timeout / 1000);
+#endif
+}
+
+static mrb_value
+mrb_sftp_f_set_timeout (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_t *data = mrb_sftp_data_bang(mrb, self);
+    mrb_value secs;
+    mrb_int ms;
+
+    mrb_get_args(mrb, "o", &secs);
+
+    if ((ms = mrb_sftp_secs_to_ms(mrb, secs)) < 0) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Negative timeout.");
+    }
+
+    data->timeout = ms;
+
+    return secs;
+}
+
+static mrb_value
+mrb_sftp_deadline_yield (mrb_state *mrb, mrb_value ctx)
+{
+    mrb_sftp_deadline_t *deadline = mrb_cptr(ctx);
+    return mrb_yield(mrb, deadline->block, deadline->self);
+}
+
+static mrb_value
+mrb_sftp_deadline_restore (mrb_state *mrb, mrb_value ctx)
+{
+    mrb_sftp_deadline_t *deadline = mrb_cptr(ctx);
+    mrb_sftp_t *data              = DATA_PTR(deadline->self);
+
+    if (data) {
+        data->deadline = deadline->prev;
+    }
+
+    return mrb_nil_value();
+}
+
+static mrb_value
+mrb_sftp_f_with_timeout (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_t *data = mrb_sftp_data_bang(mrb, self);
+    mrb_sftp_deadline_t deadline;
+    mrb_value secs, block, ctx;
+    int64_t at;
+    mrb_int ms;
+
+    mrb_get_args(mrb, "o&", &secs, &block);
+
+    if (mrb_nil_p(block)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "No block given.");
+    }
+
+    if ((ms = mrb_sftp_secs_to_ms(mrb, secs)) < 0) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Negative timeout.");
+    }
+
+    deadline.self  = self;
+    deadline.block = block;
+    deadline.prev  = data->deadline;
+    ctx            = mrb_cptr_value(mrb, &deadline);
+
+    if (ms > 0) {
+        at = mrb_sftp_now() + ms;
+
+        if (data->deadline == 0 || at < data->deadline) {
+            data->deadline = at;
+        }
+    }
+
+    return mrb_ensure(mrb, mrb_sftp_deadline_yield, ctx, mrb_sftp_deadline_restore, ctx);
+}
+
 void
 mrb_mruby_sftp_session_init (mrb_state *mrb)
 {
@@ -430,6 +1333,14 @@ mrb_mruby_sftp_session_init (mrb_state *mrb)
     mrb_define_method(mrb, cls, "lstat",    mrb_sftp_f_lstat,   MRB_ARGS_REQ(1));
     mrb_define_method(mrb, cls, "fstat",    mrb_sftp_f_fstat,   MRB_ARGS_REQ(1));
     mrb_define_method(mrb, cls, "setstat",  mrb_sftp_f_setstat, MRB_ARGS_REQ(2));
+    mrb_define_method(mrb, cls, "stat_many",  mrb_sftp_f_stat_many,  MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "lstat_many", mrb_sftp_f_lstat_many, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "exist_many", mrb_sftp_f_exist_many, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "delete_many",  mrb_sftp_f_delete_many,  MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "setstat_many", mrb_sftp_f_setstat_many, MRB_ARGS_REQ(2));
+    mrb_define_method(mrb, cls, "mkdir_p",  mrb_sftp_f_mkdir_p, MRB_ARGS_ARG(1,1));
+    mrb_define_method(mrb, cls, "rm_rf",    mrb_sftp_f_rm_rf,   MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "scan",     mrb_sftp_f_scan,    MRB_ARGS_ARG(1,1));
     mrb_define_method(mrb, cls, "rename",   mrb_sftp_f_rename,  MRB_ARGS_ARG(2,1));
     mrb_define_method(mrb, cls, "symlink",  mrb_sftp_f_symlink, MRB_ARGS_REQ(2));
     mrb_define_method(mrb, cls, "rmdir",    mrb_sftp_f_rmdir,   MRB_ARGS_REQ(1));
@@ -438,4 +1349,7 @@ mrb_mruby_sftp_session_init (mrb_state *mrb)
     mrb_define_method(mrb, cls, "close",    mrb_sftp_f_close,   MRB_ARGS_NONE());
     mrb_define_method(mrb, cls, "closed?",  mrb_sftp_f_closed,  MRB_ARGS_NONE());
     mrb_define_method(mrb, cls, "last_errno", mrb_sftp_f_last_errno, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "timeout",  mrb_sftp_f_timeout, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "timeout=", mrb_sftp_f_set_timeout, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, cls, "with_timeout", mrb_sftp_f_with_timeout, MRB_ARGS_REQ(1)|MRB_ARGS_BLOCK());
 }
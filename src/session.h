@@ -22,9 +22,12 @@
  */
 
 #include "mruby.h"
+#include <libssh2_sftp.h>
 
 MRB_BEGIN_DECL
 
 void mrb_mruby_sftp_session_init (mrb_state *mrb);
 
+mrb_value mrb_sftp_session_new (mrb_state *mrb, mrb_value session, LIBSSH2_SFTP *sftp);
+
 MRB_END_DECL
\ No newline at end of file
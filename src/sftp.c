@@ -25,14 +25,35 @@
 #include "handle.h"
 #include "file.h"
 #include "stat.h"
+#include "snapshot.h"
+#include "listing.h"
+#include "transfer.h"
+#include "connection.h"
+#include "batch.h"
 
 #include "mruby.h"
+#include "mruby/data.h"
 #include "mruby/error.h"
 #include "mruby/variable.h"
 #include "mruby/ext/sftp.h"
 
+#include <limits.h>
 #include <libssh2_sftp.h>
 
+#ifdef _WIN32
+# include <winsock2.h>
+# include <windows.h>
+# define poll WSAPoll
+#else
+# include <errno.h>
+# include <poll.h>
+# include <time.h>
+#endif
+
+#ifndef MRB_SFTP_POLL_IDLE
+# define MRB_SFTP_POLL_IDLE 10
+#endif
+
 inline void
 mrb_sftp_raise_last_error (mrb_state *mrb, LIBSSH2_SFTP *sftp, const char* msg)
 {
@@ -43,13 +64,19 @@ mrb_sftp_raise_last_error (mrb_state *mrb, LIBSSH2_SFTP *sftp, const char* msg)
 
 inline void
 mrb_sftp_raise (mrb_state *mrb, int err, const char* msg)
+{
+    if (err == LIBSSH2_FX_OK) return;
+
+    mrb_exc_raise(mrb, mrb_sftp_error(mrb, err, msg));
+}
+
+mrb_value
+mrb_sftp_error (mrb_state *mrb, int err, const char* msg)
 {
     struct RClass *c;
     mrb_value exc;
 
     switch (err) {
-    case LIBSSH2_FX_OK:
-        return;
     case LIBSSH2_FX_PERMISSION_DENIED:
         c = E_SFTP_PERM_ERROR; break;
     case LIBSSH2_FX_NO_CONNECTION:
@@ -66,6 +93,8 @@ mrb_sftp_raise (mrb_state *mrb, int err, const char* msg)
         c = E_SFTP_DIR_ERROR; break;
     case LIBSSH2_FX_INVALID_FILENAME:
         c = E_SFTP_NAME_ERROR; break;
+    case LIBSSH2_ERROR_TIMEOUT:
+        c = E_SFTP_TIMEOUT_ERROR; break;
     default:
         c = E_SFTP_ERROR; break;
     }
@@ -73,7 +102,189 @@ mrb_sftp_raise (mrb_state *mrb, int err, const char* msg)
     exc = mrb_exc_new_str(mrb, c, mrb_str_new_cstr(mrb, msg));
     mrb_iv_set(mrb, exc, mrb_intern_static(mrb, "@errno", 6), mrb_fixnum_value(err));
 
-    mrb_exc_raise(mrb, exc);
+    return exc;
+}
+
+int64_t
+mrb_sftp_now (void)
+{
+#ifdef _WIN32
+    return (int64_t)GetTickCount64();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static short
+mrb_sftp_poll_events (mrb_ssh_t *ssh)
+{
+    int dirs     = libssh2_session_block_directions(ssh->session);
+    short events = 0;
+
+    if (dirs & LIBSSH2_SESSION_BLOCK_INBOUND)  events |= POLLIN;
+    if (dirs & LIBSSH2_SESSION_BLOCK_OUTBOUND) events |= POLLOUT;
+
+    return events;
+}
+
+static int
+mrb_sftp_poll_wait (mrb_value session, int64_t *wait)
+{
+    mrb_sftp_t *data = DATA_PTR(session);
+    int64_t left;
+
+    if (!(data && mrb_sftp_ssh_session(session)))
+        return LIBSSH2_ERROR_SOCKET_DISCONNECT;
+
+    if (data->timeout > 0 && (*wait < 0 || data->timeout < *wait)) {
+        *wait = data->timeout;
+    }
+
+    if (data->deadline > 0) {
+        if ((left = data->deadline - mrb_sftp_now()) <= 0)
+            return LIBSSH2_ERROR_TIMEOUT;
+
+        if (*wait < 0 || left < *wait) {
+            *wait = left;
+        }
+    }
+
+    return 0;
+}
+
+static int
+mrb_sftp_poll_fds (struct pollfd *fds, int len, int64_t wait, mrb_bool idle)
+{
+    int64_t until = wait < 0 ? -1 : mrb_sftp_now() + wait;
+    int rc;
+
+    if (idle && (wait < 0 || wait > MRB_SFTP_POLL_IDLE)) {
+        wait = MRB_SFTP_POLL_IDLE;
+    } else {
+        idle = FALSE;
+    }
+
+    for (;;) {
+        rc = poll(fds, len, wait > INT_MAX ? INT_MAX : (int)wait);
+
+        if (rc > 0)
+            return 0;
+
+        if (rc == 0)
+            return idle ? 0 : LIBSSH2_ERROR_TIMEOUT;
+
+#ifndef _WIN32
+        if (errno == EINTR) {
+            if (until >= 0 && !idle && (wait = until - mrb_sftp_now()) < 0) wait = 0;
+            continue;
+        }
+#endif
+        return LIBSSH2_ERROR_SOCKET_DISCONNECT;
+    }
+}
+
+int
+mrb_sftp_poll_sock (mrb_ssh_t *ssh, int64_t wait)
+{
+    struct pollfd fd;
+    mrb_bool idle;
+
+    fd.fd      = ssh->sock;
+    fd.events  = mrb_sftp_poll_events(ssh);
+    fd.revents = 0;
+    idle       = fd.events == 0;
+
+    if (idle) {
+        fd.events = POLLIN;
+    }
+
+    return mrb_sftp_poll_fds(&fd, 1, wait, idle);
+}
+
+int
+mrb_sftp_poll (mrb_value session)
+{
+    int64_t wait = -1;
+    int rc;
+
+    if ((rc = mrb_sftp_poll_wait(session, &wait)) < 0)
+        return rc;
+
+    return mrb_sftp_poll_sock(mrb_sftp_ssh_session(session), wait);
+}
+
+int
+mrb_sftp_poll_pair (mrb_value a, mrb_value b)
+{
+    mrb_value sessions[2];
+    struct pollfd fds[2];
+    mrb_bool idle = FALSE;
+    int64_t wait  = -1;
+    int i, rc;
+
+    sessions[0] = a;
+    sessions[1] = b;
+
+    for (i = 0; i < 2; i++) {
+        if ((rc = mrb_sftp_poll_wait(sessions[i], &wait)) < 0)
+            return rc;
+
+        fds[i].fd      = mrb_sftp_ssh_session(sessions[i])->sock;
+        fds[i].events  = mrb_sftp_poll_events(mrb_sftp_ssh_session(sessions[i]));
+        fds[i].revents = 0;
+
+        if (fds[i].events == 0) {
+            fds[i].events = POLLIN;
+            idle          = TRUE;
+        }
+    }
+
+    return mrb_sftp_poll_fds(fds, 2, wait, idle);
+}
+
+int
+mrb_sftp_poll_fd (mrb_value session, int fd, short events)
+{
+    struct pollfd pfd;
+    int64_t wait = -1;
+    int rc;
+
+    if ((rc = mrb_sftp_poll_wait(session, &wait)) < 0)
+        return rc;
+
+    pfd.fd      = fd;
+    pfd.events  = events;
+    pfd.revents = 0;
+
+    return mrb_sftp_poll_fds(&pfd, 1, wait, FALSE);
+}
+
+void
+mrb_sftp_wait (mrb_state *mrb, mrb_value session)
+{
+    mrb_sftp_raise_poll_error(mrb, mrb_sftp_poll(session));
+}
+
+void
+mrb_sftp_raise_poll_error (mrb_state *mrb, int rc)
+{
+    if (rc == LIBSSH2_ERROR_TIMEOUT) {
+        mrb_sftp_raise(mrb, rc, "SFTP operation timed out.");
+    }
+
+    if (rc == LIBSSH2_ERROR_SOCKET_DISCONNECT) {
+        mrb_raise(mrb, E_SFTP_NOT_CONNECTED_ERROR, "SFTP session not connected.");
+    }
+}
+
+static mrb_value
+mrb_sftp_f_clock (mrb_state *mrb, mrb_value self)
+{
+    return mrb_fixnum_value((mrb_int)mrb_sftp_now());
 }
 
 void
@@ -85,10 +296,17 @@ mrb_mruby_sftp_gem_init (mrb_state *mrb)
     mrb_define_const(mrb, ftp, "RENAME_ATOMIC",    mrb_fixnum_value(LIBSSH2_SFTP_RENAME_ATOMIC));
     mrb_define_const(mrb, ftp, "RENAME_NATIVE",    mrb_fixnum_value(LIBSSH2_SFTP_RENAME_NATIVE));
 
+    mrb_define_module_function(mrb, ftp, "clock", mrb_sftp_f_clock, MRB_ARGS_NONE());
+
     mrb_mruby_sftp_session_init(mrb);
     mrb_mruby_sftp_handle_init(mrb);
     mrb_mruby_sftp_file_init(mrb);
     mrb_mruby_sftp_stat_init(mrb);
+    mrb_mruby_sftp_snapshot_init(mrb);
+    mrb_mruby_sftp_listing_init(mrb);
+    mrb_mruby_sftp_transfer_init(mrb);
+    mrb_mruby_sftp_connection_init(mrb);
+    mrb_mruby_sftp_batch_init(mrb);
 }
 
 void
@@ -0,0 +1,453 @@
+/* MIT License
+ *
+ * Copyright (c) Sebastian Katzer 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "handle.h"
+#include "snapshot.h"
+
+#include "mruby.h"
+#include "mruby/data.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/string.h"
+#include "mruby/variable.h"
+#include "mruby/ext/sftp.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <libssh2_sftp.h>
+
+#define SYM(name, len) mrb_intern_static(mrb, name, len)
+
+#define MRB_SFTP_SNAPSHOT_MAGIC "SFTPSNP1"
+#define MRB_SFTP_SNAPSHOT_ENTRY_SIZE 24
+
+typedef struct mrb_sftp_snapshot_entry
+{
+    uint32_t name;
+    uint32_t name_len;
+    uint64_t size;
+    uint32_t mtime;
+    uint32_t mode;
+} mrb_sftp_snapshot_entry_t;
+
+typedef struct mrb_sftp_snapshot
+{
+    char *names;
+    size_t names_len;
+    size_t names_capa;
+    mrb_sftp_snapshot_entry_t *entries;
+    size_t len;
+    size_t capa;
+} mrb_sftp_snapshot_t;
+
+static void
+mrb_sftp_snapshot_free (mrb_state *mrb, void *p)
+{
+    mrb_sftp_snapshot_t *data;
+
+    if (!p) return;
+
+    data = (mrb_sftp_snapshot_t *)p;
+
+    mrb_free(mrb, data->names);
+    mrb_free(mrb, data->entries);
+    mrb_free(mrb, data);
+}
+
+static mrb_data_type const mrb_sftp_snapshot_type = { "SFTP::Snapshot", mrb_sftp_snapshot_free };
+
+static mrb_sftp_snapshot_t *
+mrb_sftp_snapshot (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_snapshot_t *data = mrb_data_get_ptr(mrb, self, &mrb_sftp_snapshot_type);
+
+    if (!data) {
+        mrb_raise(mrb, E_TYPE_ERROR, "Uninitialized SFTP::Snapshot.");
+    }
+
+    return data;
+}
+
+static void
+mrb_sftp_snapshot_push (mrb_state *mrb, mrb_sftp_snapshot_t *data, const char *name, size_t name_len, uint64_t size, uint32_t mtime, uint32_t mode)
+{
+    mrb_sftp_snapshot_entry_t *entry;
+
+    if (data->len == data->capa) {
+        data->capa    = data->capa ? data->capa * 2 : 64;
+        data->entries = mrb_realloc(mrb, data->entries, data->capa * sizeof(mrb_sftp_snapshot_entry_t));
+    }
+
+    if (data->names_len + name_len > data->names_capa) {
+        while (data->names_len + name_len > data->names_capa) {
+            data->names_capa = data->names_capa ? data->names_capa * 2 : 1024;
+        }
+        data->names = mrb_realloc(mrb, data->names, data->names_capa);
+    }
+
+    entry           = &data->entries[data->len++];
+    entry->name     = data->names_len;
+    entry->name_len = name_len;
+    entry->size     = size;
+    entry->mtime    = mtime;
+    entry->mode     = mode;
+
+    memcpy(data->names + data->names_len, name, name_len);
+    data->names_len += name_len;
+}
+
+static int
+mrb_sftp_snapshot_cmp (const char *names_a, const mrb_sftp_snapshot_entry_t *a, const char *names_b, const mrb_sftp_snapshot_entry_t *b)
+{
+    size_t len = a->name_len < b->name_len ? a->name_len : b->name_len;
+    int cmp    = memcmp(names_a + a->name, names_b + b->name, len);
+
+    if (cmp != 0) return cmp;
+    if (a->name_len == b->name_len) return 0;
+
+    return a->name_len < b->name_len ? -1 : 1;
+}
+
+static void
+mrb_sftp_snapshot_msort (const char *names, mrb_sftp_snapshot_entry_t *entries, mrb_sftp_snapshot_entry_t *tmp, size_t len)
+{
+    size_t mid = len / 2, i = 0, j = mid, k = 0;
+
+    if (len < 2) return;
+
+    mrb_sftp_snapshot_msort(names, entries, tmp, mid);
+    mrb_sftp_snapshot_msort(names, entries + mid, tmp, len - mid);
+
+    while (i < mid && j < len) {
+        if (mrb_sftp_snapshot_cmp(names, &entries[j], names, &entries[i]) < 0) {
+            tmp[k++] = entries[j++];
+        } else {
+            tmp[k++] = entries[i++];
+        }
+    }
+
+    while (i < mid) tmp[k++] = entries[i++];
+    while (j < len) tmp[k++] = entries[j++];
+
+    memcpy(entries, tmp, len * sizeof(mrb_sftp_snapshot_entry_t));
+}
+
+static void
+mrb_sftp_snapshot_sort (mrb_state *mrb, mrb_sftp_snapshot_t *data)
+{
+    mrb_sftp_snapshot_entry_t *tmp;
+
+    if (data->len < 2) return;
+
+    tmp = mrb_malloc(mrb, data->len * sizeof(mrb_sftp_snapshot_entry_t));
+    mrb_sftp_snapshot_msort(data->names, data->entries, tmp, data->len);
+    mrb_free(mrb, tmp);
+}
+
+static void
+mrb_sftp_snapshot_scan (mrb_state *mrb, mrb_sftp_snapshot_t *data, mrb_value handle)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    char name[512];
+    int rc;
+
+    while ((rc = mrb_sftp_readdir(mrb, handle, name, 512, NULL, 0, &attrs)) > 0) {
+        if ((rc == 1 && name[0] == '.') || (rc == 2 && name[0] == '.' && name[1] == '.'))
+            continue;
+
+        mrb_sftp_snapshot_push(mrb, data, name, rc,
+            attrs.flags & LIBSSH2_SFTP_ATTR_SIZE ? attrs.filesize : 0,
+            attrs.flags & LIBSSH2_SFTP_ATTR_ACMODTIME ? attrs.mtime : 0,
+            attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS ? attrs.permissions : 0);
+    }
+
+    if (rc < 0) {
+        mrb_sftp_raise_io_error(mrb, handle, rc, "Failed to read the remote dir.");
+    }
+
+    mrb_sftp_snapshot_sort(mrb, data);
+}
+
+static mrb_value
+mrb_sftp_snapshot_entry_ary (mrb_state *mrb, mrb_sftp_snapshot_t *data, size_t i)
+{
+    mrb_sftp_snapshot_entry_t *entry = &data->entries[i];
+    mrb_value args[4];
+
+    args[0] = mrb_str_new(mrb, data->names + entry->name, entry->name_len);
+    args[1] = mrb_fixnum_value(entry->size);
+    args[2] = mrb_fixnum_value(entry->mtime);
+    args[3] = mrb_fixnum_value(entry->mode);
+
+    return mrb_ary_new_from_values(mrb, 4, args);
+}
+
+static void
+mrb_sftp_put32 (unsigned char *buf, uint32_t val)
+{
+    buf[0] = val; buf[1] = val >> 8; buf[2] = val >> 16; buf[3] = val >> 24;
+}
+
+static uint32_t
+mrb_sftp_get32 (const unsigned char *buf)
+{
+    return (uint32_t)buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+static mrb_value
+mrb_sftp_f_snapshot_init (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_snapshot_t *data;
+    mrb_value handle = mrb_nil_value();
+
+    mrb_get_args(mrb, "|o", &handle);
+
+    if (DATA_PTR(self)) {
+        mrb_sftp_snapshot_free(mrb, DATA_PTR(self));
+    }
+
+    data = mrb_calloc(mrb, 1, sizeof(mrb_sftp_snapshot_t));
+    mrb_data_init(self, data, &mrb_sftp_snapshot_type);
+
+    if (!mrb_nil_p(handle)) {
+        mrb_sftp_snapshot_scan(mrb, data, handle);
+    }
+
+    return self;
+}
+
+static mrb_value
+mrb_sftp_f_snapshot_size (mrb_state *mrb, mrb_value self)
+{
+    return mrb_fixnum_value(mrb_sftp_snapshot(mrb, self)->len);
+}
+
+static mrb_value
+mrb_sftp_f_snapshot_each (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_snapshot_t *data = mrb_sftp_snapshot(mrb, self);
+    mrb_value block;
+    size_t i;
+    int arena;
+
+    mrb_get_args(mrb, "&", &block);
+
+    if (mrb_nil_p(block)) {
+        return mrb_funcall(mrb, self, "to_enum", 1, mrb_symbol_value(SYM("each", 4)));
+    }
+
+    for (i = 0; i < data->len; i++) {
+        arena = mrb_gc_arena_save(mrb);
+        mrb_yield(mrb, block, mrb_sftp_snapshot_entry_ary(mrb, data, i));
+        mrb_gc_arena_restore(mrb, arena);
+    }
+
+    return self;
+}
+
+static mrb_value
+mrb_sftp_f_snapshot_diff (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_snapshot_t *old = mrb_sftp_snapshot(mrb, self);
+    mrb_sftp_snapshot_t *cur;
+    mrb_sftp_snapshot_entry_t *a, *b;
+    mrb_value other, block, res, args[2];
+    size_t i = 0, j = 0;
+    int arena, cmp;
+
+    mrb_get_args(mrb, "o&", &other, &block);
+
+    cur = mrb_sftp_snapshot(mrb, other);
+    res = mrb_ary_new(mrb);
+
+    while (i < old->len || j < cur->len) {
+        arena = mrb_gc_arena_save(mrb);
+        a     = i < old->len ? &old->entries[i] : NULL;
+        b     = j < cur->len ? &cur->entries[j] : NULL;
+        cmp   = !a ? 1 : !b ? -1 : mrb_sftp_snapshot_cmp(old->names, a, cur->names, b);
+
+        if (cmp < 0) {
+            args[0] = mrb_symbol_value(SYM("removed", 7));
+            args[1] = mrb_str_new(mrb, old->names + a->name, a->name_len);
+            i++;
+        } else
+        if (cmp > 0) {
+            args[0] = mrb_symbol_value(SYM("added", 5));
+            args[1] = mrb_str_new(mrb, cur->names + b->name, b->name_len);
+            j++;
+        } else {
+            i++; j++;
+
+            if (a->size == b->size && a->mtime == b->mtime && a->mode == b->mode) {
+                mrb_gc_arena_restore(mrb, arena);
+                continue;
+            }
+
+            args[0] = mrb_symbol_value(SYM("changed", 7));
+            args[1] = mrb_str_new(mrb, cur->names + b->name, b->name_len);
+        }
+
+        if (mrb_nil_p(block)) {
+            mrb_ary_push(mrb, res, mrb_ary_new_from_values(mrb, 2, args));
+        } else {
+            mrb_yield_argv(mrb, block, 2, args);
+        }
+
+        mrb_gc_arena_restore(mrb, arena);
+    }
+
+    return mrb_nil_p(block) ? res : self;
+}
+
+static mrb_value
+mrb_sftp_f_snapshot_save (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_snapshot_t *data = mrb_sftp_snapshot(mrb, self);
+    unsigned char head[16], rec[MRB_SFTP_SNAPSHOT_ENTRY_SIZE];
+    mrb_sftp_snapshot_entry_t *entry;
+    const char *path;
+    mrb_bool ok;
+    FILE *file;
+    size_t i;
+
+    mrb_get_args(mrb, "z", &path);
+
+    if (!(file = fopen(path, "wb"))) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot open the path specified.");
+    }
+
+    memcpy(head, MRB_SFTP_SNAPSHOT_MAGIC, 8);
+    mrb_sftp_put32(head + 8, data->len);
+    mrb_sftp_put32(head + 12, data->names_len);
+
+    ok = fwrite(head, 1, 16, file) == 16;
+
+    for (i = 0; ok && i < data->len; i++) {
+        entry = &data->entries[i];
+
+        mrb_sftp_put32(rec, entry->name);
+        mrb_sftp_put32(rec + 4, entry->name_len);
+        mrb_sftp_put32(rec + 8, (uint32_t)entry->size);
+        mrb_sftp_put32(rec + 12, (uint32_t)(entry->size >> 32));
+        mrb_sftp_put32(rec + 16, entry->mtime);
+        mrb_sftp_put32(rec + 20, entry->mode);
+
+        ok = fwrite(rec, 1, MRB_SFTP_SNAPSHOT_ENTRY_SIZE, file) == MRB_SFTP_SNAPSHOT_ENTRY_SIZE;
+    }
+
+    if (ok && data->names_len > 0) {
+        ok = fwrite(data->names, 1, data->names_len, file) == data->names_len;
+    }
+
+    if (fclose(file) != 0 || !ok) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot write the snapshot.");
+    }
+
+    return mrb_fixnum_value(16 + data->len * MRB_SFTP_SNAPSHOT_ENTRY_SIZE + data->names_len);
+}
+
+static mrb_value
+mrb_sftp_f_snapshot_load (mrb_state *mrb, mrb_value self)
+{
+    unsigned char head[16], rec[MRB_SFTP_SNAPSHOT_ENTRY_SIZE];
+    mrb_sftp_snapshot_entry_t *entry;
+    mrb_sftp_snapshot_t *data;
+    const char *path;
+    mrb_value obj;
+    long fsize = 0;
+    mrb_bool ok;
+    FILE *file;
+    size_t i;
+
+    mrb_get_args(mrb, "z", &path);
+
+    obj  = mrb_obj_new(mrb, mrb_class_ptr(self), 0, NULL);
+    data = mrb_sftp_snapshot(mrb, obj);
+
+    if (!(file = fopen(path, "rb"))) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot open the path specified.");
+    }
+
+    ok = fseek(file, 0, SEEK_END) == 0 && (fsize = ftell(file)) >= 16 && fseek(file, 0, SEEK_SET) == 0;
+    ok = ok && fread(head, 1, 16, file) == 16 && memcmp(head, MRB_SFTP_SNAPSHOT_MAGIC, 8) == 0;
+    ok = ok && 16 + (uint64_t)mrb_sftp_get32(head + 8) * MRB_SFTP_SNAPSHOT_ENTRY_SIZE + mrb_sftp_get32(head + 12) == (uint64_t)fsize;
+
+    if (ok) {
+        data->len        = data->capa       = mrb_sftp_get32(head + 8);
+        data->names_len  = data->names_capa = mrb_sftp_get32(head + 12);
+        data->entries    = mrb_malloc(mrb, (data->capa ? data->capa : 1) * sizeof(mrb_sftp_snapshot_entry_t));
+        data->names      = mrb_malloc(mrb, data->names_capa ? data->names_capa : 1);
+    }
+
+    for (i = 0; ok && i < data->len; i++) {
+        entry = &data->entries[i];
+        ok    = fread(rec, 1, MRB_SFTP_SNAPSHOT_ENTRY_SIZE, file) == MRB_SFTP_SNAPSHOT_ENTRY_SIZE;
+
+        entry->name     = mrb_sftp_get32(rec);
+        entry->name_len = mrb_sftp_get32(rec + 4);
+        entry->size     = mrb_sftp_get32(rec + 8) | (uint64_t)mrb_sftp_get32(rec + 12) << 32;
+        entry->mtime    = mrb_sftp_get32(rec + 16);
+        entry->mode     = mrb_sftp_get32(rec + 20);
+
+        ok = ok && (size_t)entry->name + entry->name_len <= data->names_len;
+    }
+
+    if (ok && data->names_len > 0) {
+        ok = fread(data->names, 1, data->names_len, file) == data->names_len;
+    }
+
+    fclose(file);
+
+    if (!ok) {
+        data->len = data->names_len = 0;
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Invalid snapshot file.");
+    }
+
+    for (i = 1; i < data->len; i++) {
+        if (mrb_sftp_snapshot_cmp(data->names, &data->entries[i - 1], data->names, &data->entries[i]) > 0) {
+            mrb_sftp_snapshot_sort(mrb, data);
+            break;
+        }
+    }
+
+    return obj;
+}
+
+void
+mrb_mruby_sftp_snapshot_init (mrb_state *mrb)
+{
+    struct RClass *ftp, *cls;
+
+    ftp = mrb_module_get(mrb, "SFTP");
+    cls = mrb_define_class_under(mrb, ftp, "Snapshot", mrb->object_class);
+
+    MRB_SET_INSTANCE_TT(cls, MRB_TT_DATA);
+
+    mrb_define_class_method(mrb, cls, "load", mrb_sftp_f_snapshot_load, MRB_ARGS_REQ(1));
+
+    mrb_define_method(mrb, cls, "initialize", mrb_sftp_f_snapshot_init, MRB_ARGS_OPT(1));
+    mrb_define_method(mrb, cls, "size",       mrb_sftp_f_snapshot_size, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "each",       mrb_sftp_f_snapshot_each, MRB_ARGS_BLOCK());
+    mrb_define_method(mrb, cls, "diff",       mrb_sftp_f_snapshot_diff, MRB_ARGS_REQ(1)|MRB_ARGS_BLOCK());
+    mrb_define_method(mrb, cls, "save",       mrb_sftp_f_snapshot_save, MRB_ARGS_REQ(1));
+}
\ No newline at end of file
@@ -0,0 +1,787 @@
+/* MIT License
+ *
+ * Copyright (c) Sebastian Katzer 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "transfer.h"
+
+#include "mruby.h"
+#include "mruby/data.h"
+#include "mruby/hash.h"
+#include "mruby/class.h"
+#include "mruby/error.h"
+#include "mruby/variable.h"
+#include "mruby/ext/ssh.h"
+#include "mruby/ext/sftp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libssh2_sftp.h>
+
+#ifdef MRB_SFTP_THREADS
+# include <errno.h>
+# include <pthread.h>
+# include <time.h>
+# include <sys/stat.h>
+#endif
+
+#define SYM(name, len) mrb_intern_static(mrb, name, len)
+
+#ifndef MRB_SFTP_TRANSFER_BUFFER_SIZE
+# define MRB_SFTP_TRANSFER_BUFFER_SIZE 3200000
+#endif
+
+#ifndef MRB_SFTP_TRANSFER_SHARE
+# define MRB_SFTP_TRANSFER_SHARE 0.25
+#endif
+
+#ifndef MRB_SFTP_TRANSFER_CALM
+# define MRB_SFTP_TRANSFER_CALM 1000
+#endif
+
+#define MRB_SFTP_TRANSFER_IO_ERROR -1001
+#define MRB_SFTP_TRANSFER_CANCELED -1002
+
+#ifdef MRB_SFTP_THREADS
+
+typedef struct mrb_sftp_transfer
+{
+    mrb_sftp_t *owner;
+    mrb_ssh_t *ssh;
+    LIBSSH2_SFTP *sftp;
+    LIBSSH2_SFTP_HANDLE *handle;
+    FILE *file;
+    mrb_bool upload;
+    mrb_int timeout;
+    int64_t size;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t turn;
+    int waiting;
+    mrb_bool inside;
+    int64_t touched;
+    size_t share;
+    mrb_bool started;
+    mrb_bool joined;
+    mrb_bool finished;
+    mrb_bool canceled;
+    int64_t bytes;
+    int err;
+    char msg[256];
+    LIBSSH2_SFTP_HANDLE **orphans;
+    size_t orphans_len;
+} mrb_sftp_transfer_t;
+
+static mrb_bool
+mrb_sftp_transfer_canceled (mrb_sftp_transfer_t *t)
+{
+    mrb_bool canceled;
+
+    pthread_mutex_lock(&t->lock);
+    canceled = t->canceled;
+    pthread_mutex_unlock(&t->lock);
+
+    return canceled;
+}
+
+static mrb_bool
+mrb_sftp_transfer_finished (mrb_sftp_transfer_t *t)
+{
+    mrb_bool finished;
+
+    pthread_mutex_lock(&t->lock);
+    finished = t->finished;
+    pthread_mutex_unlock(&t->lock);
+
+    return finished;
+}
+
+static void
+mrb_sftp_transfer_cancel (mrb_sftp_transfer_t *t)
+{
+    pthread_mutex_lock(&t->lock);
+    t->canceled = TRUE;
+    pthread_cond_broadcast(&t->turn);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void
+mrb_sftp_transfer_enter (mrb_sftp_transfer_t *t)
+{
+    pthread_mutex_lock(&t->lock);
+    while (t->waiting > 0 && !t->canceled) pthread_cond_wait(&t->turn, &t->lock);
+    t->inside = TRUE;
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void
+mrb_sftp_transfer_leave (mrb_sftp_transfer_t *t)
+{
+    pthread_mutex_lock(&t->lock);
+    t->inside = FALSE;
+    pthread_cond_broadcast(&t->turn);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static size_t
+mrb_sftp_transfer_window (mrb_sftp_transfer_t *t)
+{
+    int64_t touched;
+
+    pthread_mutex_lock(&t->lock);
+    touched = t->touched;
+    pthread_mutex_unlock(&t->lock);
+
+    if (touched && mrb_sftp_now() - touched < MRB_SFTP_TRANSFER_CALM)
+        return t->share;
+
+    return MRB_SFTP_TRANSFER_BUFFER_SIZE;
+}
+
+static void
+mrb_sftp_transfer_reap (mrb_sftp_transfer_t *t)
+{
+    mrb_sftp_t *data = t->owner;
+    size_t i;
+
+    for (i = 0; i < t->orphans_len; i++) {
+        if (!(data->sftp && data->session->data && mrb_ssh_initialized()))
+            break;
+
+        while (libssh2_sftp_close_handle(t->orphans[i]) == LIBSSH2SFTP_EAGAIN) {
+            if (mrb_sftp_poll_sock(t->ssh, data->timeout > 0 ? data->timeout : -1) < 0) break;
+        }
+    }
+
+    free(t->orphans);
+
+    t->orphans     = NULL;
+    t->orphans_len = 0;
+}
+
+static void
+mrb_sftp_transfer_join (mrb_sftp_transfer_t *t)
+{
+    if (t->started && !t->joined) {
+        pthread_join(t->thread, NULL);
+        t->joined = TRUE;
+    }
+
+    if (t->owner) {
+        mrb_sftp_transfer_reap(t);
+        t->owner->transfer = NULL;
+        t->owner = NULL;
+    }
+}
+
+static int
+mrb_sftp_transfer_wait (mrb_sftp_transfer_t *t)
+{
+    int64_t since = mrb_sftp_now();
+    int64_t slice = t->timeout > 0 && t->timeout < 250 ? t->timeout : 250;
+    mrb_bool yield = !(libssh2_session_block_directions(t->ssh->session) & LIBSSH2_SESSION_BLOCK_OUTBOUND);
+    int rc;
+
+    if (yield) {
+        mrb_sftp_transfer_leave(t);
+    }
+
+    while ((rc = mrb_sftp_poll_sock(t->ssh, slice)) == LIBSSH2_ERROR_TIMEOUT) {
+        if (mrb_sftp_transfer_canceled(t)) {
+            rc = MRB_SFTP_TRANSFER_CANCELED;
+            break;
+        }
+
+        if (t->timeout > 0 && mrb_sftp_now() - since >= t->timeout)
+            break;
+    }
+
+    if (yield) {
+        mrb_sftp_transfer_enter(t);
+    }
+
+    return rc;
+}
+
+static int
+mrb_sftp_transfer_error (mrb_sftp_transfer_t *t, int rc)
+{
+    char *msg = NULL;
+
+    switch (rc) {
+    case LIBSSH2_ERROR_SFTP_PROTOCOL:
+        rc = (int)libssh2_sftp_last_error(t->sftp);
+        msg = t->upload ? "Failed to write to the SFTP handle." : "Failed to read from the SFTP handle.";
+        break;
+    case LIBSSH2_ERROR_TIMEOUT:
+        msg = "SFTP operation timed out."; break;
+    case MRB_SFTP_TRANSFER_CANCELED:
+        msg = "SFTP transfer canceled."; break;
+    case MRB_SFTP_TRANSFER_IO_ERROR:
+        msg = "Cannot access the path specified."; break;
+    default:
+        libssh2_session_last_error(t->ssh->session, &msg, NULL, 0);
+    }
+
+    snprintf(t->msg, sizeof(t->msg), "%s", msg ? msg : "SFTP transfer failed.");
+
+    return rc;
+}
+
+static ssize_t
+mrb_sftp_transfer_read (mrb_sftp_transfer_t *t, char *mem)
+{
+    size_t len = mrb_sftp_transfer_window(t);
+    ssize_t rc;
+
+    mrb_sftp_transfer_enter(t);
+
+    while ((rc = libssh2_sftp_read(t->handle, mem, len)) == LIBSSH2SFTP_EAGAIN) {
+        if ((rc = mrb_sftp_transfer_wait(t)) < 0) break;
+    }
+
+    mrb_sftp_transfer_leave(t);
+
+    if (rc > 0 && fwrite(mem, sizeof(char), rc, t->file) != (size_t)rc)
+        return MRB_SFTP_TRANSFER_IO_ERROR;
+
+    return rc;
+}
+
+static ssize_t
+mrb_sftp_transfer_write (mrb_sftp_transfer_t *t, char *mem)
+{
+    size_t len = fread(mem, sizeof(char), mrb_sftp_transfer_window(t), t->file);
+    size_t off = 0;
+    ssize_t rc = 0;
+
+    if (len == 0)
+        return ferror(t->file) ? MRB_SFTP_TRANSFER_IO_ERROR : 0;
+
+    mrb_sftp_transfer_enter(t);
+
+    while (off < len) {
+        while ((rc = libssh2_sftp_write(t->handle, mem + off, len - off)) == LIBSSH2SFTP_EAGAIN) {
+            if ((rc = mrb_sftp_transfer_wait(t)) < 0) break;
+        }
+
+        if (rc < 0) break;
+
+        off += rc;
+    }
+
+    mrb_sftp_transfer_leave(t);
+
+    return rc < 0 ? rc : (ssize_t)len;
+}
+
+static void *
+mrb_sftp_transfer_run (void *p)
+{
+    mrb_sftp_transfer_t *t = p;
+    char *mem              = malloc(MRB_SFTP_TRANSFER_BUFFER_SIZE);
+    ssize_t rc             = MRB_SFTP_TRANSFER_IO_ERROR;
+    int closed;
+
+    while (mem) {
+        if (mrb_sftp_transfer_canceled(t)) {
+            rc = MRB_SFTP_TRANSFER_CANCELED;
+            break;
+        }
+
+        if ((rc = t->upload ? mrb_sftp_transfer_write(t, mem) : mrb_sftp_transfer_read(t, mem)) <= 0)
+            break;
+
+        pthread_mutex_lock(&t->lock);
+        t->bytes += rc;
+        pthread_mutex_unlock(&t->lock);
+    }
+
+    mrb_sftp_transfer_enter(t);
+
+    while ((closed = libssh2_sftp_close_handle(t->handle)) == LIBSSH2SFTP_EAGAIN) {
+        if ((closed = mrb_sftp_transfer_wait(t)) < 0) break;
+    }
+
+    mrb_sftp_transfer_leave(t);
+
+    if (rc == 0 && closed < 0) {
+        rc = closed;
+    }
+
+    if (fclose(t->file) != 0 && rc == 0) {
+        rc = MRB_SFTP_TRANSFER_IO_ERROR;
+    }
+
+    if (rc < 0) {
+        rc = mrb_sftp_transfer_error(t, (int)rc);
+    }
+
+    free(mem);
+
+    pthread_mutex_lock(&t->lock);
+    t->handle   = NULL;
+    t->file     = NULL;
+    t->err      = (int)rc;
+    t->finished = TRUE;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+static void
+mrb_sftp_transfer_free (mrb_state *mrb, void *p)
+{
+    mrb_sftp_transfer_t *t = p;
+
+    if (!t) return;
+
+    if (t->started) {
+        mrb_sftp_transfer_cancel(t);
+        mrb_sftp_transfer_join(t);
+    }
+
+    if (t->file) {
+        fclose(t->file);
+    }
+
+    free(t->orphans);
+
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->cond);
+    pthread_cond_destroy(&t->turn);
+
+    mrb_free(mrb, t);
+}
+
+static mrb_data_type const mrb_sftp_transfer_type = { "SFTP::Transfer", mrb_sftp_transfer_free };
+
+static mrb_sftp_transfer_t *
+mrb_sftp_transfer_bang (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_transfer_t *t = DATA_PTR(self);
+
+    if (!(t && t->started)) {
+        mrb_raise(mrb, E_SFTP_ERROR, "SFTP transfer not started.");
+    }
+
+    return t;
+}
+
+static void
+mrb_sftp_transfer_close_handle (mrb_value session, mrb_sftp_transfer_t *t)
+{
+    if (!t->handle) return;
+
+    while (libssh2_sftp_close_handle(t->handle) == LIBSSH2SFTP_EAGAIN) {
+        if (mrb_sftp_poll(session) < 0) break;
+    }
+
+    t->handle = NULL;
+}
+
+static void
+mrb_sftp_transfer_open (mrb_state *mrb, mrb_value session, mrb_sftp_transfer_t *t, const char *path, mrb_int len, mrb_int mode)
+{
+    long flags = t->upload ? (LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC) : LIBSSH2_FXF_READ;
+    int err;
+
+    do {
+        t->handle = libssh2_sftp_open_ex(t->sftp, path, len, flags, mode, LIBSSH2_SFTP_OPENFILE);
+
+        if (t->handle) break;
+
+        err = libssh2_session_last_errno(t->ssh->session);
+
+        if (err == LIBSSH2SFTP_EAGAIN)
+        {
+            mrb_sftp_wait(mrb, session);
+        }
+        else if (err == LIBSSH2_ERROR_SFTP_PROTOCOL)
+        {
+            mrb_sftp_raise_last_error(mrb, t->sftp, "Unable to open the remote path.");
+        }
+        else
+        {
+            mrb_ssh_raise_last_error(mrb, t->ssh);
+        }
+    } while (!t->handle);
+}
+
+static int64_t
+mrb_sftp_transfer_size (mrb_value session, mrb_sftp_transfer_t *t)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    struct stat st;
+    int rc;
+
+    if (t->upload)
+        return fstat(fileno(t->file), &st) == 0 ? (int64_t)st.st_size : -1;
+
+    while ((rc = libssh2_sftp_fstat_ex(t->handle, &attrs, 0)) == LIBSSH2SFTP_EAGAIN) {
+        if (mrb_sftp_poll(session) < 0) return -1;
+    }
+
+    if (rc != 0 || !(attrs.flags & LIBSSH2_SFTP_ATTR_SIZE))
+        return -1;
+
+    return (int64_t)attrs.filesize;
+}
+
+static size_t
+mrb_sftp_transfer_share (mrb_state *mrb, mrb_value opts)
+{
+    mrb_value val = mrb_hash_p(opts) ? mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("share", 5))) : mrb_nil_value();
+    double share  = MRB_SFTP_TRANSFER_SHARE;
+
+#ifndef MRB_WITHOUT_FLOAT
+    if (!mrb_nil_p(val)) {
+        share = mrb_to_flo(mrb, val);
+    }
+#endif
+
+    if (!(share > 0 && share <= 1)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Share must be greater than 0 and at most 1.");
+    }
+
+    return share * MRB_SFTP_TRANSFER_BUFFER_SIZE < 1 ? 1 : (size_t)(share * MRB_SFTP_TRANSFER_BUFFER_SIZE);
+}
+
+static mrb_value
+mrb_sftp_transfer_f_init (mrb_state *mrb, mrb_value self)
+{
+    struct RClass *cls = mrb_class_get_under(mrb, mrb_module_get(mrb, "SFTP"), "Session");
+    mrb_value opts     = mrb_nil_value();
+    mrb_int mode       = 0000644;
+    mrb_sftp_transfer_t *t;
+    mrb_value session;
+    mrb_sftp_t *data;
+    const char *remote, *local;
+    mrb_int remote_len;
+    size_t share;
+    mrb_sym dir;
+
+    mrb_get_args(mrb, "onsz|iH!", &session, &dir, &remote, &remote_len, &local, &mode, &opts);
+
+    if (!mrb_obj_is_kind_of(mrb, session, cls)) {
+        mrb_raise(mrb, E_TYPE_ERROR, "SFTP::Session expected.");
+    }
+
+    if (dir != SYM("download", 8) && dir != SYM("upload", 6)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Unknown transfer direction.");
+    }
+
+    if (mrb_hash_p(opts) && (mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("compress", 8)))) ||
+                             mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("decompress", 10)))))) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Transform stages are not supported by async transfers.");
+    }
+
+    if (mrb_hash_p(opts) && mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("sparse", 6))))) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Sparse mode is not supported by async transfers.");
+    }
+
+    if (mrb_hash_p(opts) && (mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("direct", 6)))) ||
+                             mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("cache", 5)))))) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Cache options are not supported by async transfers.");
+    }
+
+    share = mrb_sftp_transfer_share(mrb, opts);
+
+    mrb_sftp_raise_if_busy(mrb, session);
+
+    if (!((data = DATA_PTR(session)) && data->sftp && mrb_sftp_ssh_session(session) && mrb_ssh_initialized())) {
+        mrb_raise(mrb, E_SFTP_NOT_CONNECTED_ERROR, "SFTP session not connected.");
+    }
+
+    t = mrb_malloc(mrb, sizeof(mrb_sftp_transfer_t));
+
+    memset(t, 0, sizeof(mrb_sftp_transfer_t));
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    pthread_cond_init(&t->turn, NULL);
+
+    t->ssh     = mrb_sftp_ssh_session(session);
+    t->sftp    = data->sftp;
+    t->upload  = dir == SYM("upload", 6);
+    t->timeout = data->timeout;
+    t->share   = share;
+
+    mrb_data_init(self, t, &mrb_sftp_transfer_type);
+    mrb_iv_set(mrb, self, SYM("@session", 8), session);
+
+    mrb_sftp_transfer_open(mrb, session, t, remote, remote_len, mode);
+
+    if (!(t->file = fopen(local, t->upload ? "rb" : "wb"))) {
+        mrb_sftp_transfer_close_handle(session, t);
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot open the path specified.");
+    }
+
+    t->size  = mrb_sftp_transfer_size(session, t);
+    t->owner = data;
+
+    data->transfer = t;
+
+    if (pthread_create(&t->thread, NULL, mrb_sftp_transfer_run, t) != 0) {
+        data->transfer = NULL;
+        t->owner       = NULL;
+        mrb_sftp_transfer_close_handle(session, t);
+        mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot start the transfer thread.");
+    }
+
+    t->started = TRUE;
+
+    return self;
+}
+
+static mrb_value
+mrb_sftp_transfer_f_done (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_transfer_t *t = mrb_sftp_transfer_bang(mrb, self);
+
+    if (!mrb_sftp_transfer_finished(t))
+        return mrb_false_value();
+
+    mrb_sftp_transfer_join(t);
+
+    return mrb_true_value();
+}
+
+static mrb_value
+mrb_sftp_transfer_f_progress (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_transfer_t *t = mrb_sftp_transfer_bang(mrb, self);
+    int64_t bytes;
+
+    pthread_mutex_lock(&t->lock);
+    bytes = t->bytes;
+    pthread_mutex_unlock(&t->lock);
+
+    return mrb_fixnum_value((mrb_int)bytes);
+}
+
+static mrb_value
+mrb_sftp_transfer_f_size (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_transfer_t *t = mrb_sftp_transfer_bang(mrb, self);
+
+    if (t->size < 0)
+        return mrb_nil_value();
+
+    return mrb_fixnum_value((mrb_int)t->size);
+}
+
+static mrb_value
+mrb_sftp_transfer_f_cancel (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_transfer_cancel(mrb_sftp_transfer_bang(mrb, self));
+    return self;
+}
+
+static mrb_value
+mrb_sftp_transfer_f_wait (mrb_state *mrb, mrb_value self)
+{
+    mrb_sftp_transfer_t *t = mrb_sftp_transfer_bang(mrb, self);
+    mrb_value secs         = mrb_nil_value();
+    mrb_bool finished;
+    struct timespec at;
+    int64_t ms             = 0;
+
+    mrb_get_args(mrb, "|o", &secs);
+
+    if (!mrb_nil_p(secs)) {
+#ifndef MRB_WITHOUT_FLOAT
+        ms = (int64_t)(mrb_to_flo(mrb, secs) * 1000);
+#else
+        ms = (int64_t)mrb_fixnum(mrb_Integer(mrb, secs)) * 1000;
+#endif
+    }
+
+    pthread_mutex_lock(&t->lock);
+
+    if (mrb_nil_p(secs)) {
+        while (!t->finished) pthread_cond_wait(&t->cond, &t->lock);
+    } else {
+        clock_gettime(CLOCK_REALTIME, &at);
+
+        at.tv_sec  += ms / 1000 + (at.tv_nsec + (ms % 1000) * 1000000) / 1000000000;
+        at.tv_nsec  = (at.tv_nsec + (ms % 1000) * 1000000) % 1000000000;
+
+        while (!t->finished && pthread_cond_timedwait(&t->cond, &t->lock, &at) != ETIMEDOUT);
+    }
+
+    finished = t->finished;
+
+    pthread_mutex_unlock(&t->lock);
+
+    if (!finished)
+        return mrb_nil_value();
+
+    mrb_sftp_transfer_join(t);
+
+    switch (t->err) {
+    case 0:
+        return mrb_fixnum_value((mrb_int)t->bytes);
+    case MRB_SFTP_TRANSFER_IO_ERROR:
+        mrb_raise(mrb, E_RUNTIME_ERROR, t->msg);
+    case MRB_SFTP_TRANSFER_CANCELED:
+        mrb_raise(mrb, E_SFTP_ERROR, t->msg);
+    default:
+        mrb_exc_raise(mrb, mrb_sftp_error(mrb, t->err, t->msg));
+    }
+
+    return mrb_nil_value();
+}
+
+void
+mrb_sftp_transfer_release (mrb_sftp_t *data)
+{
+    if (!data->transfer) return;
+
+    mrb_sftp_transfer_cancel(data->transfer);
+    mrb_sftp_transfer_join(data->transfer);
+}
+
+mrb_bool
+mrb_sftp_transfer_defer (mrb_sftp_t *data, LIBSSH2_SFTP_HANDLE *handle)
+{
+    mrb_sftp_transfer_t *t = data->transfer;
+    LIBSSH2_SFTP_HANDLE **orphans;
+
+    if (!t) return FALSE;
+
+    if (!(orphans = realloc(t->orphans, (t->orphans_len + 1) * sizeof(LIBSSH2_SFTP_HANDLE *))))
+        return FALSE;
+
+    t->orphans = orphans;
+    t->orphans[t->orphans_len++] = handle;
+
+    return TRUE;
+}
+
+void
+mrb_sftp_raise_if_busy (mrb_state *mrb, mrb_value session)
+{
+    mrb_sftp_t *data = DATA_PTR(session);
+
+    if (!(data && data->transfer)) return;
+
+    if (mrb_sftp_transfer_finished(data->transfer)) {
+        mrb_sftp_transfer_join(data->transfer);
+        return;
+    }
+
+    mrb_raise(mrb, E_SFTP_ERROR, "SFTP session is busy with a transfer.");
+}
+
+struct mrb_sftp_transfer *
+mrb_sftp_pause (mrb_value session)
+{
+    mrb_sftp_t *data = DATA_PTR(session);
+    mrb_sftp_transfer_t *t;
+
+    if (!(data && (t = data->transfer))) return NULL;
+
+    pthread_mutex_lock(&t->lock);
+
+    t->waiting++;
+    t->touched = mrb_sftp_now();
+
+    while (t->inside && !t->finished) pthread_cond_wait(&t->turn, &t->lock);
+
+    pthread_mutex_unlock(&t->lock);
+
+    return t;
+}
+
+void
+mrb_sftp_resume (struct mrb_sftp_transfer *t)
+{
+    if (!t) return;
+
+    pthread_mutex_lock(&t->lock);
+    t->waiting--;
+    pthread_cond_broadcast(&t->turn);
+    pthread_mutex_unlock(&t->lock);
+}
+
+#else
+
+static mrb_value
+mrb_sftp_transfer_f_init (mrb_state *mrb, mrb_value self)
+{
+    mrb_raise(mrb, E_SFTP_UNSUPPORTED_ERROR, "Async transfers require the MRB_SFTP_THREADS build flag.");
+    return self;
+}
+
+void
+mrb_sftp_transfer_release (mrb_sftp_t *data)
+{
+
+}
+
+mrb_bool
+mrb_sftp_transfer_defer (mrb_sftp_t *data, LIBSSH2_SFTP_HANDLE *handle)
+{
+    return FALSE;
+}
+
+void
+mrb_sftp_raise_if_busy (mrb_state *mrb, mrb_value session)
+{
+
+}
+
+struct mrb_sftp_transfer *
+mrb_sftp_pause (mrb_value session)
+{
+    return NULL;
+}
+
+void
+mrb_sftp_resume (struct mrb_sftp_transfer *t)
+{
+
+}
+
+#endif
+
+void
+mrb_mruby_sftp_transfer_init (mrb_state *mrb)
+{
+    struct RClass *ftp, *cls;
+
+    ftp = mrb_module_get(mrb, "SFTP");
+    cls = mrb_define_class_under(mrb, ftp, "Transfer", mrb->object_class);
+
+    MRB_SET_INSTANCE_TT(cls, MRB_TT_DATA);
+
+    mrb_define_method(mrb, cls, "initialize", mrb_sftp_transfer_f_init, MRB_ARGS_ARG(4,2));
+#ifdef MRB_SFTP_THREADS
+    mrb_define_method(mrb, cls, "done?",      mrb_sftp_transfer_f_done,     MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "wait",       mrb_sftp_transfer_f_wait,     MRB_ARGS_OPT(1));
+    mrb_define_method(mrb, cls, "progress",   mrb_sftp_transfer_f_progress, MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "size",       mrb_sftp_transfer_f_size,     MRB_ARGS_NONE());
+    mrb_define_method(mrb, cls, "cancel",     mrb_sftp_transfer_f_cancel,   MRB_ARGS_NONE());
+#endif
+}
\ No newline at end of file
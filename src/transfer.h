@@ -0,0 +1,38 @@
+/* MIT License
+ *
+ * Copyright (c) Sebastian Katzer 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "mruby.h"
+#include "mruby/ext/sftp.h"
+
+MRB_BEGIN_DECL
+
+void mrb_mruby_sftp_transfer_init (mrb_state *mrb);
+
+void mrb_sftp_transfer_release (mrb_sftp_t *data);
+mrb_bool mrb_sftp_transfer_defer (mrb_sftp_t *data, LIBSSH2_SFTP_HANDLE *handle);
+void mrb_sftp_raise_if_busy (mrb_state *mrb, mrb_value session);
+
+struct mrb_sftp_transfer* mrb_sftp_pause (mrb_value session);
+void mrb_sftp_resume (struct mrb_sftp_transfer *t);
+
+MRB_END_DECL
\ No newline at end of file
@@ -0,0 +1,320 @@
+/* MIT License
+ *
+ * Copyright (c) Sebastian Katzer 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "transform.h"
+
+#include "mruby.h"
+#include "mruby/data.h"
+#include "mruby/hash.h"
+#include "mruby/ext/sftp.h"
+
+#include <string.h>
+
+#ifdef LIBSSH2_HAVE_ZLIB
+# include <zlib.h>
+#endif
+
+#ifdef MRB_SFTP_ZSTD
+# include <zstd.h>
+#endif
+
+#define SYM(name, len) mrb_intern_static(mrb, name, len)
+
+#define MRB_SFTP_CODEC_GZIP 1
+#define MRB_SFTP_CODEC_ZSTD 2
+
+typedef struct mrb_sftp_transform
+{
+    int codec;
+    mrb_bool compress;
+    mrb_bool done;
+    char *out;
+    size_t capa;
+#ifdef LIBSSH2_HAVE_ZLIB
+    z_stream *zs;
+#endif
+#ifdef MRB_SFTP_ZSTD
+    ZSTD_CCtx *zc;
+    ZSTD_DCtx *zd;
+#endif
+} mrb_sftp_transform_t;
+
+static void
+mrb_sftp_transform_free (mrb_state *mrb, void *p)
+{
+    mrb_sftp_transform_t *data;
+
+    if (!p) return;
+
+    data = (mrb_sftp_transform_t *)p;
+
+#ifdef LIBSSH2_HAVE_ZLIB
+    if (data->zs) {
+        if (data->compress) {
+            deflateEnd(data->zs);
+        } else {
+            inflateEnd(data->zs);
+        }
+
+        mrb_free(mrb, data->zs);
+    }
+#endif
+
+#ifdef MRB_SFTP_ZSTD
+    if (data->zc) ZSTD_freeCCtx(data->zc);
+    if (data->zd) ZSTD_freeDCtx(data->zd);
+#endif
+
+    mrb_free(mrb, data->out);
+    mrb_free(mrb, data);
+}
+
+static mrb_data_type const mrb_sftp_transform_type = { "SFTP::Transform", mrb_sftp_transform_free };
+
+static int
+mrb_sftp_codec (mrb_state *mrb, mrb_value name)
+{
+    mrb_sym sym;
+
+    if (!mrb_symbol_p(name)) {
+        mrb_raise(mrb, E_TYPE_ERROR, "Codec must be a symbol.");
+    }
+
+    sym = mrb_symbol(name);
+
+    if (sym == SYM("gzip", 4)) {
+#ifdef LIBSSH2_HAVE_ZLIB
+        return MRB_SFTP_CODEC_GZIP;
+#else
+        mrb_raise(mrb, E_SFTP_UNSUPPORTED_ERROR, "Compiled without zlib support.");
+#endif
+    }
+
+    if (sym == SYM("zstd", 4)) {
+#ifdef MRB_SFTP_ZSTD
+        return MRB_SFTP_CODEC_ZSTD;
+#else
+        mrb_raise(mrb, E_SFTP_UNSUPPORTED_ERROR, "Compiled without zstd support.");
+#endif
+    }
+
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "Unknown codec: %S", name);
+
+    return 0;
+}
+
+struct RData *
+mrb_sftp_transform (mrb_state *mrb, mrb_value opts, size_t capa)
+{
+    mrb_value compress, decompress, level;
+    mrb_sftp_transform_t *data;
+    struct RData *obj;
+    int rc = 0;
+
+    if (!mrb_hash_p(opts))
+        return NULL;
+
+    compress   = mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("compress", 8)));
+    decompress = mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("decompress", 10)));
+    level      = mrb_hash_get(mrb, opts, mrb_symbol_value(SYM("level", 5)));
+
+    if (mrb_nil_p(compress) && mrb_nil_p(decompress))
+        return NULL;
+
+    if (!mrb_nil_p(compress) && !mrb_nil_p(decompress)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "Cannot compress and decompress at once.");
+    }
+
+    if (!mrb_nil_p(level)) {
+        level = mrb_Integer(mrb, level);
+    }
+
+    obj  = mrb_data_object_alloc(mrb, mrb->object_class, NULL, &mrb_sftp_transform_type);
+    data = mrb_malloc(mrb, sizeof(mrb_sftp_transform_t));
+
+    memset(data, 0, sizeof(mrb_sftp_transform_t));
+    obj->data = data;
+
+    data->compress = !mrb_nil_p(compress);
+    data->codec    = mrb_sftp_codec(mrb, data->compress ? compress : decompress);
+    data->capa     = capa;
+    data->out      = mrb_malloc(mrb, capa);
+
+#ifdef LIBSSH2_HAVE_ZLIB
+    if (data->codec == MRB_SFTP_CODEC_GZIP) {
+        data->zs = mrb_malloc(mrb, sizeof(z_stream));
+        memset(data->zs, 0, sizeof(z_stream));
+
+        if (data->compress) {
+            rc = deflateInit2(data->zs, mrb_nil_p(level) ? Z_DEFAULT_COMPRESSION : (int)mrb_fixnum(level), Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        } else {
+            rc = inflateInit2(data->zs, 15 + 32);
+        }
+
+        if (rc != Z_OK) {
+            mrb_free(mrb, data->zs);
+            data->zs = NULL;
+        }
+    }
+#endif
+
+#ifdef MRB_SFTP_ZSTD
+    if (data->codec == MRB_SFTP_CODEC_ZSTD) {
+        if (data->compress) {
+            data->zc = ZSTD_createCCtx();
+            rc       = data->zc ? 0 : -1;
+
+            if (data->zc && !mrb_nil_p(level)) {
+                rc = ZSTD_isError(ZSTD_CCtx_setParameter(data->zc, ZSTD_c_compressionLevel, (int)mrb_fixnum(level))) ? -1 : 0;
+            }
+        } else {
+            data->zd = ZSTD_createDCtx();
+            rc       = data->zd ? 0 : -1;
+        }
+    }
+#endif
+
+    if (rc != 0) {
+        mrb_raise(mrb, E_SFTP_ERROR, "Failed to initialize the codec.");
+    }
+
+    return obj;
+}
+
+#ifdef LIBSSH2_HAVE_ZLIB
+static int
+mrb_sftp_gzip_push (mrb_state *mrb, mrb_sftp_transform_t *data, const char *mem, size_t len, mrb_bool last, mrb_sftp_sink_f sink, void *ctx)
+{
+    z_stream *zs = data->zs;
+    size_t produced;
+    uInt avail;
+    int rc, err;
+
+    zs->next_in  = (Bytef *)mem;
+    zs->avail_in = (uInt)len;
+
+    for (;;) {
+        if (data->done && zs->avail_in == 0) break;
+
+        if (data->done) {
+            inflateReset(zs);
+            data->done = FALSE;
+        }
+
+        avail         = zs->avail_in;
+        zs->next_out  = (Bytef *)data->out;
+        zs->avail_out = (uInt)data->capa;
+
+        if (data->compress) {
+            rc = deflate(zs, last ? Z_FINISH : Z_NO_FLUSH);
+        } else {
+            rc = inflate(zs, Z_NO_FLUSH);
+        }
+
+        if (rc == Z_STREAM_ERROR || rc == Z_DATA_ERROR || rc == Z_MEM_ERROR || rc == Z_NEED_DICT)
+            return MRB_SFTP_TRANSFORM_ERROR;
+
+        produced = data->capa - zs->avail_out;
+
+        if (produced > 0 && (err = sink(mrb, ctx, data->out, produced)) < 0)
+            return err;
+
+        if (rc == Z_STREAM_END) {
+            data->done = TRUE;
+            if (data->compress) break;
+            continue;
+        }
+
+        if (zs->avail_out > 0 && (!data->compress || !last) && zs->avail_in == 0) break;
+        if (produced == 0 && avail == zs->avail_in) break;
+    }
+
+    if (last && !data->done)
+        return MRB_SFTP_TRANSFORM_ERROR;
+
+    return 0;
+}
+#endif
+
+#ifdef MRB_SFTP_ZSTD
+static int
+mrb_sftp_zstd_push (mrb_state *mrb, mrb_sftp_transform_t *data, const char *mem, size_t len, mrb_bool last, mrb_sftp_sink_f sink, void *ctx)
+{
+    ZSTD_inBuffer in = { mem, len, 0 };
+    ZSTD_outBuffer out;
+    size_t rc;
+    int err;
+
+    for (;;) {
+        out.dst  = data->out;
+        out.size = data->capa;
+        out.pos  = 0;
+
+        if (data->compress) {
+            rc = ZSTD_compressStream2(data->zc, &out, &in, last ? ZSTD_e_end : ZSTD_e_continue);
+        } else {
+            rc = ZSTD_decompressStream(data->zd, &out, &in);
+        }
+
+        if (ZSTD_isError(rc))
+            return MRB_SFTP_TRANSFORM_ERROR;
+
+        if (out.pos > 0 && (err = sink(mrb, ctx, data->out, out.pos)) < 0)
+            return err;
+
+        data->done = !data->compress && rc == 0;
+
+        if (data->compress && last) {
+            if (rc == 0) break;
+        } else if (in.pos == in.size && out.pos < out.size) {
+            break;
+        }
+    }
+
+    if (last && !data->compress && !data->done)
+        return MRB_SFTP_TRANSFORM_ERROR;
+
+    return 0;
+}
+#endif
+
+int
+mrb_sftp_transform_push (mrb_state *mrb, struct RData *obj, const char *mem, size_t len, mrb_bool last, mrb_sftp_sink_f sink, void *ctx)
+{
+    mrb_sftp_transform_t *data = (mrb_sftp_transform_t *)obj->data;
+
+    switch (data->codec) {
+#ifdef LIBSSH2_HAVE_ZLIB
+    case MRB_SFTP_CODEC_GZIP:
+        return mrb_sftp_gzip_push(mrb, data, mem, len, last, sink, ctx);
+#endif
+#ifdef MRB_SFTP_ZSTD
+    case MRB_SFTP_CODEC_ZSTD:
+        return mrb_sftp_zstd_push(mrb, data, mem, len, last, sink, ctx);
+#endif
+    default:
+        break;
+    }
+
+    return MRB_SFTP_TRANSFORM_ERROR;
+}
\ No newline at end of file
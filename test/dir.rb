@@ -60,4 +60,62 @@ SFTP.start('test.rebex.net', 'demo', password: 'password') do |sftp|
     assert_equal 4, sftp.dir.entries('/').size
     assert_include sftp.dir.entries('/').map! { |e| e.name }, 'readme.txt'
   end
+
+  assert 'SFTP::Dir#entries', 'filters' do
+    size = sftp.stat('readme.txt').size
+
+    assert_equal ['readme.txt'], sftp.dir.entries('/', match: '*.txt').map! { |e| e.name }
+    assert_equal ['readme.txt'], sftp.dir.entries('/', match: 'r?ad[a-z]e.*').map! { |e| e.name }
+    assert_equal [], sftp.dir.entries('/', match: '[!r]*.txt')
+    assert_true sftp.dir.entries('/', type: :file).all?(&:file?)
+    assert_true sftp.dir.entries('/', type: :directory).all?(&:directory?)
+    assert_include sftp.dir.entries('/', size: size).map! { |e| e.name }, 'readme.txt'
+    assert_include sftp.dir.entries('/', size: size..size).map! { |e| e.name }, 'readme.txt'
+    assert_not_include sftp.dir.entries('/', size: 0...size).map! { |e| e.name }, 'readme.txt'
+    assert_equal 4, sftp.dir.entries('/', mtime: 0..0x7fffffff).size
+    assert_equal 0, sftp.dir.entries('/', mtime: 0..1).size
+    assert_raise(ArgumentError) { sftp.dir.entries('/', type: :bad) }
+  end
+
+  assert 'SFTP::Dir#count' do
+    count = sftp.dir.count('/pub')
+
+    assert_raise(SFTP::FileError) { sftp.dir.count('i/am/bad') }
+    assert_raise(SFTP::Exception) { sftp.dir.count('readme.txt') }
+    assert_true count[:files] > 0
+    assert_true count[:dirs] > 0
+    assert_true sftp.dir.count('/')[:dirs] > count[:dirs]
+    assert_true sftp.dir.count('/')[:files] > count[:files]
+  end
+
+  assert 'SFTP::Dir#du' do
+    du = sftp.dir.du('/pub')
+
+    assert_include du.keys, '/pub'
+    assert_true du.keys.size > 1
+    assert_equal du['/pub'], sftp.dir.summary('/pub')[:bytes]
+    assert_true du.values.all? { |bytes| bytes <= du['/pub'] }
+  end
+
+  assert 'SFTP::Dir#histogram' do
+    summary = sftp.dir.summary('/pub')
+    files   = summary[:files] + summary[:links] + summary[:others]
+    sum     = ->(hist) { hist.values.inject(0) { |a, b| a + b } }
+
+    assert_equal files, sum[sftp.dir.histogram('/pub')]
+    assert_equal files, sum[sftp.dir.histogram('/pub', :age)]
+    assert_equal [:hour, :day, :week, :month, :quarter, :year, :older], sftp.dir.histogram('/pub', :age).keys
+    assert_raise(ArgumentError) { sftp.dir.histogram('/pub', :bad) }
+  end
+
+  assert 'SFTP::Dir#summary' do
+    res = sftp.dir.summary('/pub', du: true)
+
+    assert_nil sftp.dir.summary('/pub')[:du]
+    assert_equal sftp.dir.du('/pub'), sftp.dir.du(res)
+    assert_equal sftp.dir.count('/pub'), sftp.dir.count(res)
+    assert_equal sftp.dir.histogram('/pub', :age), sftp.dir.histogram(res, :age)
+    assert_equal res[:sizes], sftp.dir.histogram(res)
+    assert_raise(ArgumentError) { sftp.dir.du(sftp.dir.summary('/pub')) }
+  end
 end
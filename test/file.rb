@@ -132,6 +132,162 @@ SFTP.start('test.rebex.net', 'demo', password: 'password') do |sftp|
     assert_kind_of String, lines.last
   end
 
+  assert 'SFTP::File#each_chunk' do
+    assert_raise(SFTP::HandleNotOpened) { dummy.each_chunk {} }
+
+    file.open
+    file.rewind
+
+    content = file.gets(nil)
+    chunks  = []
+    ids     = []
+
+    file.rewind
+    assert_raise(ArgumentError) { file.each_chunk(0) {} }
+
+    file.each_chunk(100) { |chunk| chunks << chunk.dup && ids << chunk.object_id }
+
+    assert_equal content, chunks.join
+    assert_equal 1, ids.uniq.size
+    assert_equal 100, chunks[0].size
+    assert_true file.eof?
+
+    file.rewind
+    ids.clear
+    file.each_chunk(100, reuse: false) { |chunk| ids << chunk.object_id }
+    assert_equal chunks.size, ids.uniq.size
+
+    file.rewind
+    line = file.gets
+    rest = ''
+    file.each_chunk(100) { |chunk| rest << chunk }
+    assert_equal content, line + rest
+  end
+
+  assert 'SFTP::File#each_chunk with transform' do
+    file.open
+    file.rewind
+
+    assert_raise(ArgumentError) { file.each_chunk(100, compress: :lzma) {} }
+    assert_raise(ArgumentError) { file.each_chunk(100, compress: :gzip, decompress: :gzip) {} }
+
+    begin
+      gzip = ''
+      file.each_chunk(100, compress: :gzip) { |chunk| gzip << chunk }
+      assert_equal [0x1F, 0x8B], gzip.bytes[0, 2]
+      assert_true file.eof?
+    rescue SFTP::Unsupported => e
+      skip(e)
+    end
+  end
+
+  assert 'SFTP::File#download' do
+    assert_raise(SFTP::HandleNotOpened) { dummy.download(nil) }
+
+    file.open
+    file.rewind
+
+    content = file.gets(nil)
+    file.gets
+
+    assert_equal content, file.download(nil)
+    assert_true file.eof?
+  end
+
+  assert 'SFTP::File#copy_to' do
+    assert_raise(SFTP::HandleNotOpened) { dummy.copy_to(1) }
+
+    file.open
+
+    assert_raise(ArgumentError) { file.copy_to(-1) }
+    assert_raise(NoMethodError) { file.copy_to(Object.new) }
+
+    next unless Object.const_defined?(:IO) && IO.respond_to?(:pipe)
+
+    content = file.download(nil)
+    r, w    = IO.pipe
+
+    file.rewind
+    assert_equal content.size, file.copy_to(w)
+    assert_true file.eof?
+    w.close
+    assert_equal content, r.read
+    r.close
+  end
+
+  assert 'SFTP::File#copy_from' do
+    assert_raise(SFTP::HandleNotOpened) { dummy.copy_from(0) }
+
+    file.open
+
+    assert_raise(ArgumentError) { file.copy_from(-1) }
+    assert_raise(ArgumentError) { file.copy_from(file) }
+
+    next unless Object.const_defined?(:IO) && IO.respond_to?(:pipe)
+
+    r, w = IO.pipe
+    w.write('123')
+    w.close
+
+    begin
+      sftp.file.open("#{TEST_ARGS['RAND']}.txt", 'w') do |f|
+        assert_equal 3, f.copy_from(r)
+      end
+      assert_equal '123', sftp.read("#{TEST_ARGS['RAND']}.txt")
+    rescue SFTP::PermissionError => e
+      skip(e)
+    ensure
+      r.close
+    end
+  end
+
+  assert 'SFTP::File#buffer_size' do
+    assert_raise(SFTP::HandleNotOpened) { dummy.buffer_size }
+    assert_raise(SFTP::HandleNotOpened) { dummy.buffer_size = 1 }
+
+    file.open
+
+    assert_true file.buffer_size > 0
+    assert_raise(ArgumentError) { file.buffer_size = -1 }
+
+    file.buffer_size = 0
+    assert_equal 0, file.buffer_size
+  end
+
+  assert 'SFTP::File#flush' do
+    assert_raise(SFTP::HandleNotOpened) { dummy.flush }
+
+    file.open
+    assert_equal file, file.flush
+  end
+
+  assert 'SFTP::File#follow' do
+    assert_raise(SFTP::HandleNotOpened) { dummy.follow {} }
+
+    file.open
+    file.rewind
+
+    lines = []
+    file.follow(idle: 0) { |line| lines << line }
+
+    assert_equal 11, lines.size
+    assert_equal "\n", lines[0][-1]
+
+    file.rewind
+    lines.clear
+    file.follow(idle: 0, chomp: true) { |line| lines << line }
+
+    assert_equal 11, lines.size
+    assert_not_equal "\n", lines[0][-1]
+
+    file.seek(-5, :END)
+    lines.clear
+    file.follow(interval: 0, idle: 0) { |line| lines << line }
+
+    assert_equal 1, lines.size
+    assert_equal 5, lines[0].size
+  end
+
   assert 'SFTP::File#sync' do
     file.close
     assert_raise(SFTP::HandleNotOpened) { file.sync }
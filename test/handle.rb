@@ -143,6 +143,51 @@ SFTP.start('test.rebex.net', 'demo', password: 'password') do |ftp|
     assert_nil file.gets
   end
 
+  assert 'SFTP::Handle#pread' do
+    assert_raise(SFTP::HandleNotOpened) { dummy.pread(0, 1) }
+
+    file.open_file
+    file.rewind
+
+    head = file.gets(10)
+    buf  = ''
+
+    assert_raise(ArgumentError) { file.pread(-1, 1) }
+    assert_equal head, file.pread(0, 10)
+    assert_same buf, file.pread(0, 10, buf)
+    assert_equal head, buf
+    assert_equal head[5, 5], file.pread(5, 5, buf)
+    assert_equal 5, buf.size
+    assert_nil file.pread(file.stat.size, 10)
+    assert_equal 10, file.pos
+    assert_not_equal head, file.gets(10)
+  end
+
+  assert 'SFTP::Handle#read_ranges' do
+    assert_raise(SFTP::HandleNotOpened) { dummy.read_ranges([[0, 1]]) }
+
+    file.open_file
+    file.rewind
+
+    content = file.gets(nil)
+    ranges  = [[100, 10], [0, 5], [3, 4], [content.size, 1]]
+    yielded = []
+
+    assert_raise(TypeError) { file.read_ranges([1]) }
+    assert_raise(ArgumentError) { file.read_ranges([[-1, 1]]) }
+    assert_raise(ArgumentError) { file.read_ranges([[0, 1]], gap: -1) }
+    assert_raise(TypeError) { file.read_ranges([[0, 1]], gap: 'x') }
+    assert_equal [], file.read_ranges([])
+
+    res = file.read_ranges(ranges) { |str, i| yielded << i }
+
+    assert_equal [content[100, 10], content[0, 5], content[3, 4], nil], res
+    assert_equal [0, 1, 2, 3], yielded.sort
+    assert_equal res, file.read_ranges(ranges, gap: 128)
+    assert_equal [content], file.read_ranges([[0, 1 << 30]])
+    assert_true file.eof?
+  end
+
   assert 'SFTP::Handle#stat' do
     assert_raise(SFTP::NotConnected) { dummy.stat }
     assert_kind_of SFTP::Stat, file.stat
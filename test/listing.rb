@@ -0,0 +1,79 @@
+# MIT License
+#
+# Copyright (c) Sebastian Katzer 2017
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+assert 'SFTP::Listing' do
+  assert_kind_of Class, SFTP::Listing
+end
+
+assert 'SFTP::Listing#initialize' do
+  assert_nothing_raised { SFTP::Listing.new }
+  assert_equal 0, SFTP::Listing.new.size
+  assert_true SFTP::Listing.new.empty?
+  assert_nil SFTP::Listing.new.name(0)
+end
+
+SFTP.start('test.rebex.net', 'demo', password: 'password') do |sftp|
+  list = sftp.dir.list_columnar('/')
+
+  assert 'SFTP::Dir#list_columnar' do
+    assert_raise(ArgumentError) { sftp.dir.list_columnar }
+    assert_raise(SFTP::FileError) { sftp.dir.list_columnar 'i am bad' }
+    assert_kind_of SFTP::Listing, list
+    assert_equal 4, list.size
+    assert_equal ['readme.txt'], sftp.dir.list_columnar('/', match: '*.txt').names
+  end
+
+  assert 'SFTP::Listing#[]' do
+    idx = list.names.index('readme.txt')
+
+    assert_equal 'readme.txt', list.name(idx)
+    assert_equal sftp.stat('readme.txt').size, list.filesize(idx)
+    assert_equal sftp.stat('readme.txt').mtime, list.mtime(idx)
+    assert_equal ['readme.txt', list.filesize(idx), list.mtime(idx), list.mode(idx)], list[idx]
+    assert_equal list[-1], list[list.size - 1]
+    assert_nil list[list.size]
+    assert_equal list.names, list.map { |item| item[0] }
+  end
+
+  assert 'SFTP::Listing#sort!' do
+    names = list.sort.names
+    sizes = list.sort(:size, true).map { |item| item[1] }
+
+    assert_equal names.sort, names
+    assert_equal sizes.sort.reverse, sizes
+    assert_equal list.size, list.sort(:mtime).size
+    assert_raise(ArgumentError) { list.sort(:bad) }
+    assert_equal list, list.sort!
+    assert_equal names, list.names
+  end
+
+  assert 'SFTP::Listing#filter' do
+    size = sftp.stat('readme.txt').size
+
+    assert_equal ['readme.txt'], list.filter(match: 'r?ad*.txt').names
+    assert_include list.filter(size: size).names, 'readme.txt'
+    assert_equal list.size, list.filter({}).size
+    assert_equal 0, list.filter(mtime: 0..1).size
+    assert_raise(ArgumentError) { list.filter(type: :bad) }
+    assert_true list.memsize > 0
+  end
+end
@@ -103,6 +103,14 @@ SSH.start('test.rebex.net', 'demo', password: 'password') do |ssh|
     assert_false sftp.exist? 'I am wrong'
   end
 
+  assert 'SFTP::Session#exist_many' do
+    assert_raise(SFTP::NotConnected) { dummy.exist_many ['/pub'] }
+    assert_raise(ArgumentError) { sftp.exist_many }
+    assert_raise(TypeError) { sftp.exist_many [1] }
+    assert_equal [], sftp.exist_many([])
+    assert_equal [true, true, false], sftp.exist_many(['/pub', 'readme.txt', 'I am wrong'])
+  end
+
   assert 'SFTP::Session#realpath' do
     assert_raise(SFTP::NotConnected) { dummy.realpath('pub') }
     assert_raise(ArgumentError) { sftp.realpath }
@@ -121,6 +129,24 @@ SSH.start('test.rebex.net', 'demo', password: 'password') do |ssh|
     assert_kind_of SFTP::Stat, sftp.lstat('/pub')
   end
 
+  assert 'SFTP::Session#stat_many' do
+    assert_raise(SFTP::NotConnected) { dummy.stat_many ['/pub'] }
+    assert_raise(ArgumentError) { sftp.stat_many }
+
+    stats = sftp.stat_many(['/pub', 'readme.txt', 'I am wrong'])
+
+    assert_equal 3, stats.size
+    assert_true stats[0].directory?
+    assert_equal sftp.stat('readme.txt').size, stats[1].size
+    assert_kind_of SFTP::FileError, stats[2]
+    assert_equal 2, stats[2].errno
+  end
+
+  assert 'SFTP::Session#lstat_many' do
+    assert_raise(SFTP::NotConnected) { dummy.lstat_many ['/pub'] }
+    assert_kind_of SFTP::Stat, sftp.lstat_many(['/pub'])[0]
+  end
+
   assert 'SFTP::Session#fstat' do
     assert_raise(SFTP::NotConnected) { dummy.fstat('/pub') }
     assert_raise(ArgumentError) { sftp.fstat }
@@ -185,6 +211,58 @@ SSH.start('test.rebex.net', 'demo', password: 'password') do |ssh|
     skip(e)
   end
 
+  assert 'SFTP::Session#delete_many' do
+    assert_raise(SFTP::NotConnected) { dummy.delete_many(['readme.txt']) }
+    assert_raise(ArgumentError) { sftp.delete_many }
+    assert_equal [], sftp.delete_many([])
+
+    res = sftp.delete_many(['I am wrong'])
+    assert_kind_of SFTP::Exception, res[0]
+  end
+
+  assert 'SFTP::Session#setstat_many' do
+    assert_raise(SFTP::NotConnected) { dummy.setstat_many(['readme.txt'], uid: 1) }
+    assert_raise(ArgumentError) { sftp.setstat_many(['readme.txt'], [{}, {}]) }
+    assert_raise(TypeError) { sftp.setstat_many(['readme.txt'], [1]) }
+
+    res = sftp.setstat_many(['readme.txt', 'I am wrong'], mode: 0o644)
+    assert_equal 2, res.size
+    assert_kind_of SFTP::Exception, res[1]
+  end
+
+  assert 'SFTP::Session#mkdir_p' do
+    assert_raise(SFTP::NotConnected) { dummy.mkdir_p('/dir') }
+    assert_raise(ArgumentError) { sftp.mkdir_p }
+    assert_equal 0, sftp.mkdir_p('/pub/example/')
+    assert_raise(SFTP::DirError) { sftp.mkdir_p('readme.txt/dir') }
+
+    path = "#{rand}/a/b"
+
+    assert_equal 3, sftp.mkdir_p(path)
+    assert_true sftp.stat(path).directory?
+    assert_equal 0, sftp.mkdir_p(path)
+    assert_equal 3, sftp.rm_rf(path.split('/')[0])
+  rescue SFTP::PermissionError => e
+    skip(e)
+  end
+
+  assert 'SFTP::Session#rm_rf' do
+    assert_raise(SFTP::NotConnected) { dummy.rm_rf('/dir') }
+    assert_raise(ArgumentError) { sftp.rm_rf }
+    assert_equal 0, sftp.rm_rf('I am wrong')
+
+    path = rand.to_s
+
+    sftp.mkdir_p("#{path}/a/b")
+    sftp.write("#{path}/a/b/file.txt", 'Hello')
+    sftp.write("#{path}/file.txt", 'Hello')
+
+    assert_equal 5, sftp.rm_rf(path)
+    assert_false sftp.exist? path
+  rescue SFTP::PermissionError => e
+    skip(e)
+  end
+
   assert 'SFTP::Session#symlink' do
     assert_raise(SFTP::NotConnected) { dummy.symlink('readme.txt', 'link') }
     assert_raise(ArgumentError) { sftp.symlink }
@@ -232,6 +310,7 @@ SSH.start('test.rebex.net', 'demo', password: 'password') do |ssh|
     assert_raise(ArgumentError) { sftp.download }
     assert_raise(RuntimeError) { sftp.download('bad path', 'readme.txt') }
     assert_raise(RuntimeError) { sftp.download('readme.txt', 'bad/path') }
+    assert_raise(ArgumentError) { sftp.download('readme.txt', nil, decompress: :lzma) }
 
     content = sftp.download('readme.txt')
     size    = sftp.stat('readme.txt').size
@@ -239,6 +318,65 @@ SSH.start('test.rebex.net', 'demo', password: 'password') do |ssh|
     assert_kind_of String, content
     assert_equal size, content.size
     assert_equal size, sftp.download('readme.txt', "#{tmp_dir}/readme.tmp")
+    assert_equal size, sftp.download('readme.txt', "#{tmp_dir}/readme.tmp", sparse: true)
+    assert_equal size, sftp.download('readme.txt', "#{tmp_dir}/readme.tmp", cache: :dontneed)
+    assert_raise(ArgumentError) { sftp.download('readme.txt', "#{tmp_dir}/readme.tmp", cache: :none) }
+    assert_raise(ArgumentError) { sftp.download('readme.txt', "#{tmp_dir}/readme.tmp", direct: true, sparse: true) }
+  end
+
+  assert 'SFTP::Session#download with direct I/O' do
+    content = sftp.download('readme.txt')
+    path    = "#{tmp_dir}/readme.tmp"
+
+    assert_equal content.size, sftp.download('readme.txt', path, direct: true)
+
+    next unless Object.const_defined?(:File) && File.respond_to?(:size)
+
+    assert_equal content.size, File.size(path)
+    assert_equal content, File.open(path, 'rb', &:read) if File.respond_to?(:open)
+  rescue SFTP::Unsupported => e
+    skip(e)
+  end
+
+  assert 'SFTP::Session#download_many' do
+    assert_raise(SFTP::NotConnected) { dummy.download_many [['readme.txt', "#{tmp_dir}/readme.tmp"]] }
+    assert_raise(ArgumentError) { sftp.download_many }
+    assert_raise(TypeError) { sftp.download_many ['readme.txt'] }
+    assert_raise(ArgumentError) { sftp.download_many [], concurrency: 0 }
+
+    size = sftp.stat('readme.txt').size
+    res  = sftp.download_many([['readme.txt', "#{tmp_dir}/readme.tmp"],
+                               ['I am wrong', "#{tmp_dir}/wrong.tmp"],
+                               ['readme.txt', 'bad/path']], concurrency: 2)
+
+    assert_equal 3, res.size
+    assert_equal size, res[0]
+    assert_kind_of SFTP::FileError, res[1]
+    assert_kind_of RuntimeError, res[2]
+    assert_equal [], sftp.download_many([])
+
+    res = sftp.download_many([['I am wrong', "#{tmp_dir}/readme.tmp"]])
+
+    assert_kind_of SFTP::FileError, res[0]
+    assert_equal size, File.size("#{tmp_dir}/readme.tmp") if Object.const_defined?(:File) && File.respond_to?(:size)
+  end
+
+  assert 'SFTP::Session#upload_many' do
+    assert_raise(SFTP::NotConnected) { dummy.upload_many [["#{tmp_dir}/readme.tmp", 'readme.txt']] }
+    assert_raise(ArgumentError) { sftp.upload_many }
+    assert_raise(TypeError) { sftp.upload_many [['readme.txt']] }
+
+    res = sftp.upload_many([["#{tmp_dir}/readme.tmp", "#{rand}.txt"],
+                            ['bad/path', "#{rand}.bad"]])
+
+    assert_equal 2, res.size
+    assert_kind_of RuntimeError, res[1]
+    raise res[0] if res[0].is_a? Exception
+
+    assert_equal sftp.stat('readme.txt').size, res[0]
+    sftp.delete("#{rand}.txt")
+  rescue SFTP::PermissionError => e
+    skip(e)
   end
 
   assert 'SFTP::Session#read' do
@@ -256,6 +394,78 @@ SSH.start('test.rebex.net', 'demo', password: 'password') do |ssh|
     assert_equal content[1, 5],  sftp.read('readme.txt', 5, 1, mode: 'r')
   end
 
+  assert 'SFTP::Session#cache_handles' do
+    assert_raise(ArgumentError) { sftp.cache_handles(max: 0) }
+
+    cache   = sftp.cache_handles(max: 1, idle: 60)
+    content = sftp.read('readme.txt')
+
+    assert_kind_of SFTP::HandleCache, cache
+    assert_equal cache, sftp.handles
+    assert_equal 1, cache.size
+    assert_equal content, sftp.read('readme.txt')
+    assert_equal content[1, 5], sftp.read('readme.txt', 5, 1)
+    assert_equal content, sftp.download('readme.txt')
+    assert_equal 1, cache.size
+
+    cache.invalidate('readme.txt')
+    assert_equal 0, cache.size
+
+    sftp.read('readme.txt')
+    assert_equal content, sftp.read('/readme.txt')
+    assert_equal 1, cache.size
+
+    assert_nil sftp.cache_handles(false)
+    assert_equal 0, cache.size
+    assert_nil sftp.handles
+  end
+
+  assert 'SFTP::Session#write with cached handles' do
+    path = "#{rand}.cache"
+
+    sftp.cache_handles(max: 2, idle: 60)
+
+    assert_equal 6, sftp.write(path, 'abcdef')
+    assert_equal 'abcdef', sftp.read(path)
+    assert_equal 2, sftp.write(path, 'xy')
+    assert_equal 'xy', sftp.read(path)
+
+    sftp.cache_handles(false)
+    sftp.delete(path)
+  rescue SFTP::PermissionError => e
+    sftp.cache_handles(false)
+    skip(e)
+  end
+
+  assert 'SFTP::Session#timeout' do
+    assert_raise(SFTP::NotConnected) { dummy.timeout = 1 }
+    assert_raise(ArgumentError) { sftp.timeout = -1 }
+    assert_nil dummy.timeout
+    assert_nil sftp.timeout
+
+    sftp.timeout = 30
+    assert_equal 30.0, sftp.timeout
+    assert_true sftp.exist? 'readme.txt'
+
+    sftp.timeout = 0.5
+    assert_equal 0.5, sftp.timeout
+
+    sftp.timeout = nil
+    assert_nil sftp.timeout
+  end
+
+  assert 'SFTP::Session#with_timeout' do
+    assert_kind_of Class, SFTP::Timeout
+    assert_true SFTP::Timeout < SFTP::Exception
+    assert_raise(SFTP::NotConnected) { dummy.with_timeout(1) {} }
+    assert_raise(ArgumentError) { sftp.with_timeout(1) }
+    assert_raise(ArgumentError) { sftp.with_timeout(-1) {} }
+
+    assert_equal sftp, sftp.with_timeout(30) { |s| s }
+    assert_true sftp.with_timeout(30) { sftp.with_timeout(10) { sftp.exist? 'readme.txt' } }
+    assert_raise(SFTP::Timeout) { sftp.with_timeout(0.001) { loop { sftp.stat('readme.txt') } } }
+  end
+
   assert 'SFTP#close' do
     ssh.close
     assert_false sftp.connected?
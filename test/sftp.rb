@@ -28,6 +28,50 @@ assert 'SFTP.start' do
   assert_kind_of SFTP::Session, SFTP.start
 end
 
+assert 'SFTP.start_many' do
+  assert_raise(ArgumentError) { SFTP.start_many(['test.rebex.net'], 'demo') }
+  assert_raise(ArgumentError) { SFTP.start_many(['test.rebex.net'], 'demo', password: 'password', concurrency: 0) }
+  assert_raise(TypeError) { SFTP.start_many([1], 'demo', password: 'password') }
+
+  hosts = ['test.rebex.net', 'test.rebex.net:22', 'I am bad', 'test.rebex.net:0']
+
+  opened = nil
+
+  SFTP.start_many(hosts, 'demo', password: 'password', timeout: 30, concurrency: 2) do |sessions, errors|
+    opened = sessions.values
+    assert_equal ['test.rebex.net', 'test.rebex.net:22'], sessions.keys
+    assert_equal ['I am bad', 'test.rebex.net:0'], errors.keys
+    assert_kind_of SFTP::Session, sessions['test.rebex.net']
+    assert_equal 'test.rebex.net', sessions['test.rebex.net'].host
+    assert_true sessions['test.rebex.net:22'].exist?('readme.txt')
+    assert_kind_of SSH::NotConnected, errors['I am bad']
+    assert_false opened[0].session.closed?
+  end
+
+  assert_true opened.all? { |sftp| sftp.session.closed? }
+
+  sessions, errors = SFTP.start_many(['test.rebex.net'], 'demo', password: 'wrong')
+
+  assert_true sessions.empty?
+  assert_kind_of Exception, errors['test.rebex.net']
+end
+
 assert 'SFTP::Exception' do
   assert_kind_of Class, SFTP::Exception
 end
+
+assert 'SFTP.relay' do
+  SFTP.start('test.rebex.net', 'demo', password: 'password') do |src|
+    SFTP.start('test.rebex.net', 'demo', password: 'password') do |dst|
+      assert_raise(SFTP::FileError) { SFTP.relay(src, 'i am bad', dst, 'copy.txt') }
+
+      begin
+        size = SFTP.relay(src, 'readme.txt', dst, "#{TEST_ARGS['RAND']}.txt")
+        assert_equal src.stat('readme.txt').size, size
+        assert_equal src.read('readme.txt'), dst.read("#{TEST_ARGS['RAND']}.txt")
+      rescue SFTP::PermissionError => e
+        skip(e)
+      end
+    end
+  end
+end
@@ -0,0 +1,97 @@
+# MIT License
+#
+# Copyright (c) Sebastian Katzer 2017
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+tmp_dir = TEST_ARGS['TMP']
+
+assert 'SFTP::Snapshot' do
+  assert_kind_of Class, SFTP::Snapshot
+end
+
+assert 'SFTP::Snapshot#initialize' do
+  assert_nothing_raised { SFTP::Snapshot.new }
+  assert_equal 0, SFTP::Snapshot.new.size
+  assert_true SFTP::Snapshot.new.empty?
+end
+
+assert 'SFTP::Snapshot.load' do
+  assert_raise(ArgumentError) { SFTP::Snapshot.load }
+  assert_raise(RuntimeError) { SFTP::Snapshot.load('i/am/bad') }
+  assert_raise(RuntimeError) { SFTP::Snapshot.load(__FILE__) }
+
+  next unless Object.const_defined?(:File) && File.respond_to?(:open)
+
+  path = "#{tmp_dir}/snapshot.tmp"
+  rec  = "\x00\x00\x00\x00" * 4
+
+  File.open(path, 'wb') { |f| f.write "SFTPSNP1\xFF\xFF\xFF\x0F\x00\x00\x00\x00" }
+  assert_raise(RuntimeError) { SFTP::Snapshot.load(path) }
+
+  File.open(path, 'wb') do |f|
+    f.write "SFTPSNP1\x02\x00\x00\x00\x02\x00\x00\x00"
+    f.write "\x00\x00\x00\x00\x01\x00\x00\x00#{rec}"
+    f.write "\x01\x00\x00\x00\x01\x00\x00\x00#{rec}"
+    f.write 'ba'
+  end
+  assert_equal %w[a b], SFTP::Snapshot.load(path).map { |item| item[0] }
+end
+
+SFTP.start('test.rebex.net', 'demo', password: 'password') do |sftp|
+  snap = sftp.dir.snapshot('/')
+
+  assert 'SFTP::Dir#snapshot' do
+    assert_raise(ArgumentError) { sftp.dir.snapshot }
+    assert_raise(SFTP::FileError) { sftp.dir.snapshot 'i am bad' }
+    assert_kind_of SFTP::Snapshot, snap
+    assert_equal 4, snap.size
+  end
+
+  assert 'SFTP::Snapshot#each' do
+    names = snap.map { |item| item[0] }
+
+    assert_include names, 'readme.txt'
+    assert_equal names.sort, names
+    assert_equal sftp.stat('readme.txt').size, snap.find { |i| i[0] == 'readme.txt' }[1]
+  end
+
+  assert 'SFTP::Snapshot#diff' do
+    empty = SFTP::Snapshot.new
+
+    assert_raise(TypeError) { snap.diff('snap') }
+    assert_equal [], snap.diff(snap)
+    assert_equal 4, empty.diff(snap).size
+    assert_equal :added, empty.diff(snap)[0][0]
+    assert_equal :removed, snap.diff(empty)[0][0]
+  end
+
+  assert 'SFTP::Snapshot#save' do
+    path = "#{tmp_dir}/snapshot.tmp"
+
+    assert_raise(RuntimeError) { snap.save('i/am/bad') }
+    assert_true snap.save(path) > 0
+
+    copy = SFTP::Snapshot.load(path)
+
+    assert_equal snap.size, copy.size
+    assert_equal snap.to_a, copy.to_a
+    assert_equal [], snap.diff(copy)
+  end
+end
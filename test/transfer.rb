@@ -0,0 +1,106 @@
+# MIT License
+#
+# Copyright (c) Sebastian Katzer 2017
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+tmp_dir = TEST_ARGS['TMP']
+threads = begin
+  SFTP::Transfer.new(nil, :download, 'readme.txt', 'readme.tmp')
+rescue SFTP::Unsupported
+  false
+rescue TypeError
+  true
+end
+
+assert 'SFTP::Transfer' do
+  assert_kind_of Class, SFTP::Transfer
+end
+
+SFTP.start('test.rebex.net', 'demo', password: 'password') do |sftp|
+  assert 'SFTP::Transfer.new' do
+    skip 'MRB_SFTP_THREADS not set' unless threads
+
+    assert_raise(ArgumentError) { SFTP::Transfer.new }
+    assert_raise(TypeError) { SFTP::Transfer.new(nil, :download, 'readme.txt', 'readme.tmp') }
+    assert_raise(ArgumentError) { SFTP::Transfer.new(sftp, :copy, 'readme.txt', 'readme.tmp') }
+    assert_raise(ArgumentError) { sftp.download('readme.txt', 'readme.tmp', async: true, decompress: :gzip) }
+    assert_raise(SFTP::FileError) { sftp.download('I am wrong', "#{tmp_dir}/readme.tmp", async: true) }
+    assert_raise(RuntimeError) { sftp.download('readme.txt', 'bad/path', async: true) }
+  end
+
+  assert 'SFTP::Transfer#wait' do
+    skip 'MRB_SFTP_THREADS not set' unless threads
+
+    size     = sftp.stat('readme.txt').size
+    transfer = sftp.download('readme.txt', "#{tmp_dir}/readme.tmp", async: true)
+
+    assert_kind_of SFTP::Transfer, transfer
+    assert_equal size, transfer.size
+    assert_raise(TypeError) { transfer.wait('x') }
+    assert_equal size, transfer.wait
+    assert_true transfer.done?
+    assert_equal size, transfer.progress
+    assert_kind_of SFTP::Stat, sftp.stat('readme.txt')
+  end
+
+  assert 'SFTP::Transfer with metadata ops' do
+    skip 'MRB_SFTP_THREADS not set' unless threads
+
+    assert_raise(ArgumentError) { sftp.download('readme.txt', "#{tmp_dir}/readme.tmp", async: true, share: 0) }
+    assert_raise(ArgumentError) { sftp.download('readme.txt', "#{tmp_dir}/readme.tmp", async: true, share: 2) }
+
+    size     = sftp.stat('readme.txt').size
+    transfer = sftp.download('readme.txt', "#{tmp_dir}/readme.tmp", async: true, share: 0.1)
+
+    assert_kind_of SFTP::Stat, sftp.stat('readme.txt')
+    assert_true sftp.exist?('pub')
+    assert_false sftp.exist?('I am wrong')
+    assert_kind_of String, sftp.realpath('.')
+    assert_equal size, transfer.wait
+  end
+
+  assert 'SFTP::Transfer#cancel' do
+    skip 'MRB_SFTP_THREADS not set' unless threads
+
+    transfer = sftp.download('readme.txt', "#{tmp_dir}/readme.tmp", async: true)
+
+    assert_equal transfer, transfer.cancel
+
+    begin
+      transfer.wait
+    rescue SFTP::Exception => e
+      assert_equal 'SFTP transfer canceled.', e.message
+    end
+
+    assert_true transfer.done?
+  end
+end
+
+assert 'SFTP.start with a running transfer' do
+  skip 'MRB_SFTP_THREADS not set' unless threads
+
+  transfer = nil
+
+  SFTP.start('test.rebex.net', 'demo', password: 'password') do |sftp|
+    transfer = sftp.download('readme.txt', "#{tmp_dir}/readme.tmp", async: true)
+  end
+
+  assert_true transfer.done?
+end
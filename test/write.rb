@@ -43,6 +43,25 @@
 #     sftp.file.open(path) { |io| assert_equal "Hello\nWorld!\n", io.gets(nil) }
 #   end
 
+#   assert 'SFTP::File#buffer_size' do
+#     sftp.file.open(path, 'w') do |io|
+#       io.buffer_size = 8
+#       assert_equal 5, io.write('Hello')
+#       assert_equal 5, io.pos
+#       assert_equal 7, io.write('World!!')
+#       io.flush
+#       assert_equal 12, io.stat.size
+#     end
+#     sftp.file.open(path) { |io| assert_equal 'HelloWorld!!', io.gets(nil) }
+#   end
+
+#   assert 'SFTP::File#follow' do
+#     lines = []
+#     sftp.write(path, "Hello\nWorld!")
+#     sftp.file.open(path) { |io| io.follow(idle: 0) { |line| lines << line } }
+#     assert_equal ["Hello\n", 'World!'], lines
+#   end
+
 #   assert 'SFTP::Session#write' do
 #     assert_equal 13, sftp.write(path, 'Session#write')
 #     assert_equal 'Session#write', sftp.read(path)
@@ -50,5 +69,7 @@
 #     assert_equal 'Session#writewrite', sftp.read(path)
 #     assert_equal 5, sftp.write(path, 'write', 1)
 #     assert_equal 'Swriten#writewrite', sftp.read(path)
+#     assert_equal 0, sftp.write(path, '')
+#     assert_nil sftp.download(path)
 #   end
 # end